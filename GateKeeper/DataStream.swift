@@ -9,6 +9,7 @@ import CoreGraphics
 enum DataStreamError: Error {
     case readError
     case writeError
+    case outOfBounds(offset: Int, count: Int, available: Int)
 }
 
 public class DataReadStream {
@@ -38,6 +39,9 @@ public class DataReadStream {
     public func readBytes<T>() throws -> T {
         let valueSize = MemoryLayout<T>.size
         let valuePointer = UnsafeMutablePointer<T>.allocate(capacity: 1)
+        defer {
+            valuePointer.deallocate(capacity: 1)
+        }
         var buffer = [UInt8](repeating: 0, count: MemoryLayout<T>.stride)
         let bufferPointer = UnsafeMutablePointer<UInt8>(&buffer)
         if self.inputStream.read(bufferPointer, maxLength: valueSize) != valueSize {
@@ -134,6 +138,119 @@ public class DataReadStream {
     }
 }
 
+public final class DataReadCursor {
+
+    public let buffer: UnsafeRawBufferPointer
+    public private(set) var offset: Int = 0
+
+    // The buffer is borrowed, not copied. It must stay valid for as long as the
+    // cursor (and any slice returned from it) is in use.
+    public init(buffer: UnsafeRawBufferPointer) {
+        self.buffer = buffer
+    }
+
+    public static func with<T>(data: Data, _ body: (DataReadCursor) throws -> T) rethrows -> T {
+        let count = data.count
+        return try data.withUnsafeBytes { (pointer: UnsafePointer<UInt8>) -> T in
+            return try body(DataReadCursor(buffer: UnsafeRawBufferPointer(start: pointer, count: count)))
+        }
+    }
+
+    public static func with<T>(bytes: [UInt8], _ body: (DataReadCursor) throws -> T) rethrows -> T {
+        return try bytes.withUnsafeBytes { buffer -> T in
+            return try body(DataReadCursor(buffer: buffer))
+        }
+    }
+
+    public var hasBytesAvailable: Bool {
+        return offset < buffer.count
+    }
+
+    public var bytesAvailable: Int {
+        return buffer.count - offset
+    }
+
+    private func require(_ count: Int) throws {
+        guard count >= 0 && count <= bytesAvailable else {
+            throw DataStreamError.outOfBounds(offset: offset, count: count, available: bytesAvailable)
+        }
+    }
+
+    private func load<T: FixedWidthInteger>() throws -> T {
+        let size = MemoryLayout<T>.size
+        try require(size)
+
+        // memcpy rather than load(fromByteOffset:as:), which traps on unaligned offsets
+        var value: T = 0
+        memcpy(&value, buffer.baseAddress! + offset, size)
+        offset += size
+
+        return T(littleEndian: value)
+    }
+
+    public func read() throws -> Int8 {
+        return try load()
+    }
+
+    public func read() throws -> UInt8 {
+        return try load()
+    }
+
+    public func read() throws -> Int16 {
+        return try load()
+    }
+
+    public func read() throws -> UInt16 {
+        return try load()
+    }
+
+    public func read() throws -> Int32 {
+        return try load()
+    }
+
+    public func read() throws -> UInt32 {
+        return try load()
+    }
+
+    public func read() throws -> Int64 {
+        return try load()
+    }
+
+    public func read() throws -> UInt64 {
+        return try load()
+    }
+
+    public func read() throws -> Bool {
+        let byte = try self.read() as UInt8
+        return byte != 0
+    }
+
+    public func readSlice(count: Int) throws -> UnsafeRawBufferPointer {
+        try require(count)
+
+        let slice = UnsafeRawBufferPointer(rebasing: buffer[offset..<offset + count])
+        offset += count
+
+        return slice
+    }
+
+    public func readRemaining() -> UnsafeRawBufferPointer {
+        let slice = UnsafeRawBufferPointer(rebasing: buffer[offset..<buffer.count])
+        offset = buffer.count
+
+        return slice
+    }
+
+    public func readBytes(size: Int) throws -> [UInt8] {
+        return [UInt8](try readSlice(count: size))
+    }
+
+    public func skip(count: Int) throws {
+        try require(count)
+        offset += count
+    }
+}
+
 public class DataWriteStream {
 
     private var outputStream: OutputStream
@@ -3,7 +3,9 @@
 //  GateKeeper
 //
 
+import Hydra
 import Material
+import PKHUD
 
 class DatabaseSettingsViewController: UITableViewController {
 
@@ -11,6 +13,11 @@ class DatabaseSettingsViewController: UITableViewController {
     let passwordTextField = ErrorTextField()
     let passwordRepeatTextField = ErrorTextField()
     let transformationRoundsTextField = ErrorTextField()
+    let calibrateButton = RaisedButton()
+    let compressionControl = UISegmentedControl(items: ["Faster", "Balanced", "Smaller"])
+
+    // zlib levels for the segments of the compression control
+    static let compressionLevels: [Int32] = [1, 6, 9]
 
     override func viewDidLoad() {
         navigationItem.titleLabel.text = "Database Settings"
@@ -54,6 +61,20 @@ class DatabaseSettingsViewController: UITableViewController {
         transformationRoundsTextField.placeholder = "Transformation rounds"
         transformationRoundsTextField.translatesAutoresizingMaskIntoConstraints = false
 
+        // Calibrate button
+
+        calibrateButton.setTitle("Calibrate for 1 second unlock", for: .normal)
+        calibrateButton.pulseColor = UIColor.white
+        calibrateButton.backgroundColor = Theme.Buttons.mutedBackgroundColor
+        calibrateButton.setTitleColor(Theme.Buttons.mutedTitleColor, for: .normal)
+        calibrateButton.addTarget(self, action: #selector(didTouchUpInside(sender:)), for: .touchUpInside)
+        calibrateButton.translatesAutoresizingMaskIntoConstraints = false
+
+        // Compression control
+
+        compressionControl.tintColor = Theme.Buttons.mutedTitleColor
+        compressionControl.translatesAutoresizingMaskIntoConstraints = false
+
         // Load
 
         load()
@@ -63,6 +84,8 @@ class DatabaseSettingsViewController: UITableViewController {
         switch sender {
         case saveButton:
             save()
+        case calibrateButton:
+            calibrate()
         default:
             break
         }
@@ -72,6 +95,47 @@ class DatabaseSettingsViewController: UITableViewController {
         if let kdbx = Vault.kdbx {
             transformationRoundsTextField.text = String(kdbx.transformationRounds)
         }
+
+        compressionControl.selectedSegmentIndex = DatabaseSettingsViewController.segment(compressionLevel: Vault.compressionLevel)
+    }
+
+    // The nearest segment, since the default level is -1
+    static func segment(compressionLevel: Int32) -> Int {
+        let level = compressionLevel < 0 ? 6 : compressionLevel
+        let distances = compressionLevels.map { abs($0 - level) }
+
+        return distances.index(of: distances.min() ?? 0) ?? 1
+    }
+
+    var selectedCompressionLevel: Int32 {
+        return DatabaseSettingsViewController.compressionLevels[max(0, compressionControl.selectedSegmentIndex)]
+    }
+
+    func calibrate() {
+        guard let kdbx = Vault.kdbx else {
+            return
+        }
+
+        let kdf = kdbx.transformationKdf
+
+        HUD.dimsBackground = false
+        HUD.show(.labeledProgress(title: "Calibrating", subtitle: nil))
+
+        async(in: .background, {
+            do {
+                let rounds = try KdbxKdfCalibration.rounds(kdf: kdf)
+
+                async(in: .main, {
+                    HUD.hide()
+                    self.transformationRoundsTextField.text = String(rounds)
+                })
+            } catch {
+                async(in: .main, {
+                    HUD.hide()
+                    self.present(UIAlertController.makeSimple(title: "Error", message: "\(error)"), animated: true, completion: nil)
+                })
+            }
+        })
     }
 
     func save() {
@@ -87,6 +151,7 @@ class DatabaseSettingsViewController: UITableViewController {
                 let transformationRounds = Int(transformationRoundsStr) ?? 80000
 
                 kdbx.transformationRounds = transformationRounds
+                Vault.compressionLevel = selectedCompressionLevel
 
                 if password.count > 0 {
                     kdbx.setPassword(password)
@@ -105,10 +170,12 @@ class DatabaseSettingsViewController: UITableViewController {
         let transformationRoundsStr = transformationRoundsTextField.text ?? "80000"
         let transformationRounds = Int(transformationRoundsStr) ?? 80000
 
+        let minimumTransformationRounds = Vault.kdbx?.transformationKdf.minimumRounds ?? 80000
+
         var hasError = false
 
-        if transformationRounds < 80000 {
-            transformationRoundsTextField.detail = "Must be at least 80000."
+        if transformationRounds < minimumTransformationRounds {
+            transformationRoundsTextField.detail = "Must be at least \(minimumTransformationRounds)."
             transformationRoundsTextField.isErrorRevealed = true
             hasError = true
         } else {
@@ -140,14 +207,17 @@ class DatabaseSettingsViewController: UITableViewController {
         let transformationRoundsStr = transformationRoundsTextField.text ?? "80000"
         let transformationRounds = Int(transformationRoundsStr) ?? 80000
 
+        let compressionSegment = DatabaseSettingsViewController.segment(compressionLevel: Vault.compressionLevel)
+
         return password.count > 0
             || transformationRounds != kdbx.transformationRounds
+            || compressionControl.selectedSegmentIndex != compressionSegment
     }
 
     // MARK: UITableViewDataSource
 
     override func tableView(_ tableView: UITableView, numberOfRowsInSection section: Int) -> Int {
-        return 3
+        return 5
     }
 
     override func tableView(_ tableView: UITableView, cellForRowAt indexPath: IndexPath) -> UITableViewCell {
@@ -173,6 +243,18 @@ class DatabaseSettingsViewController: UITableViewController {
             NSLayoutConstraint(item: transformationRoundsTextField, attribute: .bottom, relatedBy: .equal, toItem: cell.contentView, attribute: .bottom, multiplier: 1.0, constant: -10.0).isActive = true
             NSLayoutConstraint(item: transformationRoundsTextField, attribute: .left, relatedBy: .equal, toItem: cell.contentView, attribute: .left, multiplier: 1.0, constant: 10.0).isActive = true
             NSLayoutConstraint(item: transformationRoundsTextField, attribute: .right, relatedBy: .equal, toItem: cell.contentView, attribute: .right, multiplier: 1.0, constant: -10.0).isActive = true
+        case 3:
+            cell.contentView.addSubview(calibrateButton)
+            NSLayoutConstraint(item: calibrateButton, attribute: .top, relatedBy: .equal, toItem: cell.contentView, attribute: .top, multiplier: 1.0, constant: 10.0).isActive = true
+            NSLayoutConstraint(item: calibrateButton, attribute: .bottom, relatedBy: .equal, toItem: cell.contentView, attribute: .bottom, multiplier: 1.0, constant: -10.0).isActive = true
+            NSLayoutConstraint(item: calibrateButton, attribute: .left, relatedBy: .equal, toItem: cell.contentView, attribute: .left, multiplier: 1.0, constant: 10.0).isActive = true
+            NSLayoutConstraint(item: calibrateButton, attribute: .right, relatedBy: .equal, toItem: cell.contentView, attribute: .right, multiplier: 1.0, constant: -10.0).isActive = true
+        case 4:
+            cell.contentView.addSubview(compressionControl)
+            NSLayoutConstraint(item: compressionControl, attribute: .top, relatedBy: .equal, toItem: cell.contentView, attribute: .top, multiplier: 1.0, constant: 20.0).isActive = true
+            NSLayoutConstraint(item: compressionControl, attribute: .bottom, relatedBy: .equal, toItem: cell.contentView, attribute: .bottom, multiplier: 1.0, constant: -10.0).isActive = true
+            NSLayoutConstraint(item: compressionControl, attribute: .left, relatedBy: .equal, toItem: cell.contentView, attribute: .left, multiplier: 1.0, constant: 10.0).isActive = true
+            NSLayoutConstraint(item: compressionControl, attribute: .right, relatedBy: .equal, toItem: cell.contentView, attribute: .right, multiplier: 1.0, constant: -10.0).isActive = true
         default:
             break
         }
@@ -65,15 +65,7 @@ extension CGFloat {
 extension Data {
 
     func crc16() -> UInt16 {
-        var crc = UInt16(0)
-        var temp = UInt16(0)
-
-        self.forEach { byte in
-            temp = UInt16(byte) ^ (crc >> 8) & 0xff
-            crc = UInt16(crc16Table[Int(temp)]) ^ (crc << 8)
-        }
-
-        return crc
+        return GKCrc16.checksum(self)
     }
 }
 
@@ -13,8 +13,21 @@ class GKCard {
     static let controlPointUUID = CBUUID(string: "423AD87A-0001-4F14-9EAA-5EB5839F2A54")
     static let fileWriteUUID = CBUUID(string: "423AD87A-0002-4F14-9EAA-5EB5839F2A54")
 
-    private let peripheral: Peripheral
-    private var controlPointBuffer = Data()
+    #if DEBUG
+    // When set, every card is this simulator
+    static var simulator: GKCardSimulator?
+    #endif
+
+    // No answer within this long counts as an empty response
+    static let responseTimeout: TimeInterval = 2.0
+    // A file being read back is complete once notifications pause this long
+    static let streamIdleGap: TimeInterval = 0.5
+
+    private let link: GKCardLink
+    private let responseQueue = DispatchQueue(label: "GKCard.response")
+    private var response: GKCardResponse?
+    // Settles the outstanding request's promise when a newer request replaces it
+    private var rejectResponse: ((Error) -> Void)?
 
     enum CardError: Error {
         case argumentInvalid
@@ -27,11 +40,19 @@ class GKCard {
         case fileNotFound
         case invalidChecksum
         case makeCommandDataFailed
+        case requestSuperseded
     }
 
     static func checkBluetoothState() -> Promise<Void> {
         return Promise { resolve, reject, _ in
             print("checkBluetoothState(): \(Thread.isMainThread)")
+            #if DEBUG
+            if GKCard.simulator != nil {
+                resolve(())
+                return
+            }
+            #endif
+
             SwiftyBluetooth.asyncState(completion: { state in
                 switch state {
                 case .poweredOn:
@@ -45,7 +66,14 @@ class GKCard {
         }
     }
 
-    required init?(uuid: UUID) {
+    required convenience init?(uuid: UUID) {
+        #if DEBUG
+        if let simulator = GKCard.simulator {
+            self.init(link: simulator)
+            return
+        }
+        #endif
+
         let peripherals = SwiftyBluetooth.retrievePeripherals(withUUIDs: [uuid])
 
         guard let peripheral = peripherals.first else {
@@ -53,16 +81,20 @@ class GKCard {
         }
 
         print("GKCard.init(): \(Thread.isMainThread)")
-        self.peripheral = peripheral
+        self.init(link: GKCardPeripheralLink(peripheral: peripheral))
+    }
+
+    init(link: GKCardLink) {
+        self.link = link
 
-        NotificationCenter.default.addObserver(forName: Peripheral.PeripheralCharacteristicValueUpdate, object: self.peripheral, queue: nil) { notification in
-            if let characteristic = notification.userInfo?["characteristic"] as? CBCharacteristic {
-                if let value = characteristic.value {
-                    self.controlPointBuffer.append(value)
-                    print("controlPointBuffer -> +\(String(format: "%03d", value.count)) bytes = \(String(format: "%03d", self.controlPointBuffer.count)) bytes")
+        self.link.controlPointHandler = { value in
+            self.responseQueue.async {
+                guard let response = self.response else {
+                    print("control point notification without a command dropped")
+                    return
                 }
-            } else {
-                print("update notification dropped")
+
+                response.append(value)
             }
         }
     }
@@ -89,77 +121,75 @@ class GKCard {
         }
     }
 
-    private func fileWrite(data: Data) -> Promise<Void> {
+    // Resolves with the CRC-16 of what was written
+    private func fileWrite(data: Data, isCurrent: @escaping () -> Bool) -> Promise<UInt16> {
         return Promise { resolve, reject, _ in
             print("fileWrite(): \(Thread.isMainThread)")
-            var round = 0
-            var offset = 0
+            let transfer = GKCardFileTransfer(data: data, transport: self.link, isCurrent: isCurrent)
 
-            repeat {
-                let chunkSize = (data.count - offset) > 128 ? 128 : data.count - offset
-                let chunk = data.subdata(in: offset..<offset + chunkSize)
+            transfer.start { error in
+                print("fileWrite <- \(transfer.statistics.bytes) bytes in \(transfer.statistics.writes) writes")
 
-                print("fileWrite <- \(chunk.count) bytes (round \(round))")
-
-                self.peripheral.writeValue(ofCharacWithUUID: GKCard.fileWriteUUID, fromServiceWithUUID: GKCard.serviceUUID, value: chunk, type: .withoutResponse, completion: { result in
-                    switch result {
-                    case .failure(let error):
-                        print(error)
-                        reject(CardError.characteristicWriteFailure)
-                        return
-                    case .success:
-                        break
-                    }
-                })
-
-                usleep(5000)
-
-                round += 1
-                offset += chunkSize
-            } while offset < data.count
-
-            resolve(())
+                if let error = error as? GKCardFileTransfer.TransferError {
+                    reject(error)
+                } else if let error = error {
+                    print(error)
+                    reject(CardError.characteristicWriteFailure)
+                } else {
+                    resolve(transfer.checksum.value)
+                }
+            }
         }
     }
 
-    private func waitOnControlPointResult() -> Promise<Data> {
-        return Promise { resolve, _, _ in
-            print("waitOnControlPointResult(): \(Thread.isMainThread)")
-            var bufferCount = 0
+    // Arms the response before writing the command, so no notification is missed
+    private func request(data: Data, framing: GKCardResponse.Framing, timeout: TimeInterval = GKCard.responseTimeout) -> Promise<Data> {
+        return Promise { resolve, reject, _ in
+            self.responseQueue.async {
+                if let previous = self.response, !previous.isFinished {
+                    previous.cancel()
+                    self.rejectResponse?(CardError.requestSuperseded)
+                }
 
-            let timer = DispatchSource.makeTimerSource()
-            timer.schedule(deadline: .now() + 1.0, repeating: 1.0)
-            timer.setEventHandler {
-                if bufferCount < self.controlPointBuffer.count {
-                    bufferCount = self.controlPointBuffer.count
-                } else {
-                    timer.cancel()
-                    print("controlPointBuffer: \(self.controlPointBuffer.count) bytes")
-                    resolve(self.controlPointBuffer)
-                    self.controlPointBuffer.removeAll()
+                let response = GKCardResponse(framing: framing, timeout: timeout, queue: self.responseQueue) { data in
+                    print("control point response: \(data.count) bytes")
+                    self.response = nil
+                    self.rejectResponse = nil
+                    resolve(data)
+                }
+                self.response = response
+                self.rejectResponse = reject
+                response.start()
+
+                self.writeToControlPoint(data: data).catch { error in
+                    self.responseQueue.async {
+                        // Already settled if a newer request took over
+                        guard !response.isFinished else {
+                            return
+                        }
+
+                        response.cancel()
+                        if self.response === response {
+                            self.response = nil
+                            self.rejectResponse = nil
+                        }
+                        reject(error)
+                    }
                 }
             }
-            timer.resume()
         }
     }
 
     private func writeToControlPoint(data: Data) -> Promise<Void> {
         return Promise { resolve, reject, _ in
             print("writeToControlPoint: \([UInt8](data).hexString): \(Thread.isMainThread)")
-            self.peripheral.writeValue(
-                ofCharacWithUUID: GKCard.controlPointUUID,
-                fromServiceWithUUID: GKCard.serviceUUID,
-                value: data,
-                type: .withoutResponse,
-                completion: { result in
-                    switch result {
-                    case .failure(let error):
-                        reject(error)
-                    case .success:
-                        resolve(())
-                    }
+            self.link.writeControlPoint(data, completion: { error in
+                if let error = error {
+                    reject(error)
+                } else {
+                    resolve(())
                 }
-            )
+            })
         }
     }
 
@@ -168,35 +198,12 @@ class GKCard {
     func connect(timeout: TimeInterval = 10.0) -> Promise<Void> {
         return Promise(in: .main, { resolve, reject, _ in
             print("connect(): \(Thread.isMainThread)")
-            self.peripheral.connect(withTimeout: timeout, completion: { result in
-                switch result {
-                case .failure(let error):
-                    switch error {
-                    case SBError.operationTimedOut:
-                        reject(CardError.connectionTimedOut)
-                    default:
-                        reject(error)
-                    }
-                case .success:
-                    self.peripheral.setNotifyValue(
-                        toEnabled: true,
-                        forCharacWithUUID: GKCard.controlPointUUID,
-                        ofServiceWithUUID: GKCard.serviceUUID
-                    ) { result in
-                        switch result {
-                        case .failure(let error):
-                            let nsError = error as NSError
-                            switch nsError.code {
-                            case CBATTError.insufficientEncryption.rawValue:
-                                reject(CardError.cardNotPaired)
-                            default:
-                                reject(error)
-                            }
-                        case .success:
-                            print("connected")
-                            resolve(())
-                        }
-                    }
+            self.link.connect(timeout: timeout, completion: { error in
+                if let error = error {
+                    reject(error)
+                } else {
+                    print("connected")
+                    resolve(())
                 }
             })
         })
@@ -205,11 +212,10 @@ class GKCard {
     func disconnect() -> Promise<Void> {
         return Promise { resolve, reject, _ in
             print("disconnect(): \(Thread.isMainThread)")
-            self.peripheral.disconnect { result in
-                switch result {
-                case .failure(let error):
+            self.link.disconnect { error in
+                if let error = error {
                     reject(error)
-                case .success:
+                } else {
                     print("disconnected")
                     resolve(())
                 }
@@ -220,17 +226,22 @@ class GKCard {
     // MARK: Commands
 
     func checksum(data: Data) -> Promise<Void> {
+        return checksum(expected: data.crc16())
+    }
+
+    // Compares the card's checksum of the written file with `ourChecksum`,
+    // as resolved by put
+    func checksum(expected ourChecksum: UInt16) -> Promise<Void> {
         return Promise { resolve, reject, _ in
             print("checksum(): \(Thread.isMainThread)")
-            let ourChecksum = data.crc16()
             let ourChecksumBytes = [
                 UInt8(truncatingIfNeeded: ourChecksum >> 8),
                 UInt8(truncatingIfNeeded: ourChecksum)
             ]
 
-            self.peripheral.readValue(ofCharacWithUUID: GKCard.fileWriteUUID, fromServiceWithUUID: GKCard.serviceUUID, completion: { result in
-                if result.error == nil {
-                    guard let value = result.value else {
+            self.link.readFileChecksum(completion: { value, error in
+                if error == nil {
+                    guard let value = value else {
                         reject(CardError.characteristicReadFailure)
                         return
                     }
@@ -255,8 +266,7 @@ class GKCard {
         return Promise { resolve, reject, _ in
             print("close(): \(Thread.isMainThread)")
             self.makeCommandData(command: 4, string: path)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .status) }
             .then({ _ in
                 resolve(())
             })
@@ -273,8 +283,7 @@ class GKCard {
             }
 
             self.makeCommandData(command: 7, string: path)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .status) }
             .then({ _ in
                 resolve(())
             })
@@ -291,8 +300,7 @@ class GKCard {
             }
 
             self.makeCommandData(command: 10, string: path)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .status) }
             .then { data in
                 if data.count == 1 {
                     if data[0] == 0x06 {
@@ -319,8 +327,7 @@ class GKCard {
 
             
             self.makeCommandData(command: 2, string: path)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .stream(idleGap: GKCard.streamIdleGap)) }
             .then { data in
                 if data.count == 0 {
                     reject(CardError.fileNotFound)
@@ -342,8 +349,7 @@ class GKCard {
 
             
             self.makeCommandData(command: 8, string: name)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .status) }
             .then({ _ in
                 resolve(())
             })
@@ -351,14 +357,15 @@ class GKCard {
         }
     }
 
-    func put(data: Data) -> Promise<Void> {
+    // Resolves with the CRC-16 of the file, for checksum(expected:)
+    // Stops writing once `isCurrent` returns false, failing with GKCardFileTransfer.TransferError.superseded
+    func put(data: Data, isCurrent: @escaping () -> Bool = { true }) -> Promise<UInt16> {
         return Promise { resolve, reject, _ in
             print("put(): \(Thread.isMainThread)")
             self.makeCommandData(command: 3, string: nil)
-            .then(self.writeToControlPoint)
-            .then(self.waitOnControlPointResult)
+            .then { self.request(data: $0, framing: .status) }
             .then { _ in
-                self.fileWrite(data: data)
+                self.fileWrite(data: data, isCurrent: isCurrent)
             }
             .then(resolve)
             .catch(reject)
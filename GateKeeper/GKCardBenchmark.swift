@@ -0,0 +1,198 @@
+//
+//  GKCardBenchmark.swift
+//  GateKeeper
+//
+
+#if DEBUG
+
+import Foundation
+import Hydra
+import Signals
+
+// Times Vault.save() and the unlock path, Vault.load and Vault.open, against
+// a simulated card installed as GKCard.simulator. Saving is timed from
+// encrypting to complete, so the scheduler's window is left out.
+final class GKCardBenchmark {
+
+    enum BenchmarkError: Error {
+        case saveFailed
+    }
+
+    struct Result {
+        let size: Int
+        let save: TimeInterval
+        let unlock: TimeInterval
+    }
+
+    struct CompressionResult {
+        let algorithm: GKCardContainer.Algorithm?
+        let size: Int
+        let storedSize: Int
+        let wrap: TimeInterval
+        let unwrap: TimeInterval
+
+        var ratio: Double {
+            return Double(storedSize) / Double(max(1, size))
+        }
+    }
+
+    static let password = "benchmark"
+
+    static let sizes = [10 << 10, 100 << 10, 1 << 20, 10 << 20]
+
+    // Completes on the main queue
+    static func run(sizes: [Int] = GKCardBenchmark.sizes, configuration: GKCardSimulator.Configuration = GKCardSimulator.Configuration(), completion: @escaping ([Result]?, Error?) -> Void) {
+        async(in: .background, {
+            do {
+                let results = try sizes.map { try GKCardBenchmark.measure(size: $0, configuration: configuration) }
+
+                for result in results {
+                    print("GKCardBenchmark: \(result.size) bytes, save \(String(format: "%.3f", result.save)) s, unlock \(String(format: "%.3f", result.unlock)) s")
+                }
+
+                async(in: .main, {
+                    completion(results, nil)
+                })
+            } catch {
+                async(in: .main, {
+                    completion(nil, error)
+                })
+            }
+        })
+    }
+
+    // A vault of about `size` bytes on the card. Blocks, so never call this
+    // on the main queue.
+    static func measure(size: Int, configuration: GKCardSimulator.Configuration) throws -> Result {
+        let simulator = GKCardSimulator(configuration: configuration)
+
+        let savedSimulator = GKCard.simulator
+        let savedKdbx = Vault.kdbx
+        let savedCardUUID = Vault.cardUUID
+
+        defer {
+            GKCard.simulator = savedSimulator
+            Vault.kdbx = savedKdbx
+            Vault.cardUUID = savedCardUUID
+        }
+
+        GKCard.simulator = simulator
+        Vault.cardUUID = UUID()
+        Vault.kdbx = makeKdbx(size: size)
+
+        let save = try measureSave()
+
+        guard let card = GKCard(uuid: Vault.cardUUID!) else {
+            throw GKCard.CardError.cardNotFound
+        }
+
+        let start = Date()
+        defer {
+            _ = try? await(card.disconnect())
+        }
+
+        guard let data = try Vault.load(card: card) else {
+            throw GKCard.CardError.fileNotFound
+        }
+        _ = try Vault.open(encryptedData: data, password: password)
+        let unlock = Date().timeIntervalSince(start)
+
+        return Result(size: data.count, save: save, unlock: unlock)
+    }
+
+    // Ratio and CPU time of `data` stored plain and with each container
+    // algorithm. The save time of the stored size follows from measure.
+    static func measureCompression(data: Data) throws -> [CompressionResult] {
+        let algorithms: [GKCardContainer.Algorithm?] = [nil, .lz4, .lzfse]
+
+        return try algorithms.map { algorithm in
+            var start = Date()
+            let stored = algorithm.map { GKCardContainer.wrap(data, algorithm: $0) } ?? data
+            let wrap = Date().timeIntervalSince(start)
+
+            start = Date()
+            guard try GKCardContainer.unwrap(stored) == data else {
+                throw GKCardContainer.ContainerError.invalid
+            }
+            let unwrap = Date().timeIntervalSince(start)
+
+            let result = CompressionResult(algorithm: algorithm, size: data.count, storedSize: stored.count, wrap: wrap, unwrap: unwrap)
+            print("GKCardBenchmark: \(algorithm.map { "\($0)" } ?? "plain"), \(result.size) -> \(result.storedSize) bytes, wrap \(String(format: "%.4f", wrap)) s, unwrap \(String(format: "%.4f", unwrap)) s")
+
+            return result
+        }
+    }
+
+    // Runs one Vault.save() to the end, timed from its first status
+    private static func measureSave() throws -> TimeInterval {
+        let observer = NSObject()
+        let done = DispatchSemaphore(value: 0)
+        var start: Date?
+        var end: Date?
+        var failed = false
+
+        Vault.syncStatus.subscribe(with: observer) { status in
+            switch status {
+            case .encrypting:
+                start = start ?? Date()
+            case .complete:
+                end = Date()
+                done.signal()
+            case .failed:
+                failed = true
+                done.signal()
+            case .connecting, .pending, .transferring:
+                break
+            }
+        }
+
+        defer {
+            Vault.syncStatus.cancelSubscription(for: observer)
+        }
+
+        Vault.save()
+        done.wait()
+
+        guard !failed, let first = start, let last = end else {
+            throw BenchmarkError.saveFailed
+        }
+
+        return last.timeIntervalSince(first)
+    }
+
+    // Entries with incompressible notes, so the file comes out near `size`
+    private static func makeKdbx(size: Int) -> Kdbx {
+        let kdbx = Kdbx(password: password)
+        let noteLength = 4096
+        let now = Date()
+
+        for index in 0..<max(1, size / noteLength) {
+            let times = KdbxXml.Times(lastModificationTime: now, creationTime: now, lastAccessTime: now, expiryTime: nil, expires: false, usageCount: 0, locationChanged: nil)
+            let autoType = KdbxXml.AutoType(enabled: false, dataTransferObfuscation: 0, association: nil)
+            let notes = Data(bytes: [UInt8].random(size: noteLength * 3 / 4)).base64EncodedString()
+
+            let entry = KdbxXml.Entry(
+                uuid: UUID(),
+                iconId: 0,
+                foregroundColor: "",
+                backgroundColor: "",
+                overrideURL: "",
+                tags: "",
+                times: times,
+                autoType: autoType,
+                strings: [
+                    KdbxXml.Str(key: "Title", value: "Entry \(index)", isProtected: false),
+                    KdbxXml.Str(key: "Password", value: "password \(index)", isProtected: true),
+                    KdbxXml.Str(key: "Notes", value: notes, isProtected: false)
+                ],
+                histories: []
+            )
+
+            kdbx.add(groupUUID: kdbx.database.root.group.uuid, entry: entry)
+        }
+
+        return kdbx
+    }
+}
+
+#endif
@@ -0,0 +1,120 @@
+//
+//  GKCardContainer.swift
+//  GateKeeper
+//
+
+#if DEBUG
+
+import Compression
+import Foundation
+
+// Compression of the file as it would be stored on the card, to spend less
+// time on the radio. Layout, little endian:
+//   "GKZ1", UInt8 algorithm, UInt32 unwrapped length, compressed bytes
+// A file without the magic is a plain KDBX file, and the unwrapped bytes are
+// always a valid KDBX file.
+//
+// Vault does not store wrapped files: the card cannot tell a reader that the
+// file is wrapped, so any other KDBX reader of the card would fail to open it.
+// Like GKCardBenchmark, which measures what it would save, it is only built
+// for debugging. The KDBX payload is encrypted, so only the header
+// compresses; wrap keeps the plain file unless compression actually saves
+// something.
+enum GKCardContainer {
+
+    enum Algorithm: UInt8 {
+        case lz4 = 1
+        case lzfse = 2
+
+        var compressionAlgorithm: compression_algorithm {
+            switch self {
+            case .lz4:
+                return COMPRESSION_LZ4
+            case .lzfse:
+                return COMPRESSION_LZFSE
+            }
+        }
+    }
+
+    enum ContainerError: Error {
+        case invalid
+    }
+
+    static let magic: [UInt8] = [0x47, 0x4b, 0x5a, 0x31]
+    static let headerLength = magic.count + 1 + 4
+    // Neither algorithm gets near this on a KDBX file, so a larger unwrapped
+    // length is a corrupt header rather than a file worth allocating for
+    static let maximumExpansion = 1024
+
+    static func isWrapped(_ data: Data) -> Bool {
+        return data.count >= headerLength && data.prefix(magic.count).elementsEqual(magic)
+    }
+
+    static func wrap(_ data: Data, algorithm: Algorithm) -> Data {
+        guard data.count > headerLength, data.count <= Int(UInt32.max) else {
+            return data
+        }
+
+        // Anything that would not save at least the header is not worth wrapping
+        let capacity = data.count - headerLength
+        var compressed = Data(count: capacity)
+
+        let count = compressed.withUnsafeMutableBytes { (output: UnsafeMutablePointer<UInt8>) in
+            data.withUnsafeBytes { (input: UnsafePointer<UInt8>) in
+                compression_encode_buffer(output, capacity, input, data.count, nil, algorithm.compressionAlgorithm)
+            }
+        }
+
+        guard count > 0, data.count <= count * maximumExpansion else {
+            return data
+        }
+
+        var wrapped = Data(capacity: headerLength + count)
+        wrapped.append(contentsOf: magic)
+        wrapped.append(algorithm.rawValue)
+        wrapped.append(contentsOf: UInt32(data.count).littleEndianBytes)
+        wrapped.append(compressed.prefix(count))
+
+        return wrapped
+    }
+
+    // Returns a file without the magic as it is
+    static func unwrap(_ data: Data) throws -> Data {
+        guard isWrapped(data) else {
+            return data
+        }
+
+        let stream = DataReadStream(data: data)
+        _ = try stream.read(count: magic.count)
+
+        let algorithmField: UInt8 = try stream.read()
+        let lengthField: UInt32 = try stream.read()
+
+        guard let algorithm = Algorithm(rawValue: algorithmField) else {
+            throw ContainerError.invalid
+        }
+
+        let length = Int(lengthField)
+        let compressed = data.suffix(from: data.startIndex + headerLength)
+
+        guard length <= compressed.count * maximumExpansion else {
+            throw ContainerError.invalid
+        }
+
+        var unwrapped = Data(count: length)
+
+        let count = unwrapped.withUnsafeMutableBytes { (output: UnsafeMutablePointer<UInt8>) in
+            compressed.withUnsafeBytes { (input: UnsafePointer<UInt8>) in
+                compression_decode_buffer(output, length, input, compressed.count, nil, algorithm.compressionAlgorithm)
+            }
+        }
+
+        guard count == length else {
+            throw ContainerError.invalid
+        }
+
+        return unwrapped
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+//
+//  GKCardFileTransfer.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// The link a file transfer writes to. A write's completion means the value
+// was queued for the radio (or failed to be). Nothing comes back from the
+// card for a write without response, so a transport paces its own writes and
+// holds back the completion until it can take the next value.
+protocol GKCardTransport: class {
+    // Longest value one write without response can carry on this connection
+    var maximumWriteLength: Int { get }
+
+    func write(_ value: Data, completion: @escaping (Error?) -> Void)
+}
+
+// Streams a file to the card in chunks sized from the transport's write
+// length, keeping a bounded number of writes queued on the transport. The
+// first failure, or `isCurrent` turning false, stops new writes; completion
+// fires exactly once, after every write that was started has completed. The
+// CRC-16 of the file is folded in as chunks go out, so it is ready when the
+// last write completes.
+final class GKCardFileTransfer {
+
+    enum TransferError: Error {
+        case superseded
+    }
+
+    struct Statistics {
+        var writes = 0
+        var bytes = 0
+        var largestChunk = 0
+        var mostOutstanding = 0
+    }
+
+    static let defaultMaximumOutstandingWrites = 8
+
+    let data: Data
+    let maximumOutstandingWrites: Int
+
+    private(set) var statistics = Statistics()
+    private(set) var checksum = GKCrc16()
+
+    private let transport: GKCardTransport
+    private let isCurrent: () -> Bool
+    private let queue = DispatchQueue(label: "GKCardFileTransfer")
+    private var offset = 0
+    private var outstanding = 0
+    private var failure: Error?
+    private var completion: ((Error?) -> Void)?
+
+    init(data: Data, transport: GKCardTransport, maximumOutstandingWrites: Int = GKCardFileTransfer.defaultMaximumOutstandingWrites, isCurrent: @escaping () -> Bool = { true }) {
+        self.data = data
+        self.transport = transport
+        self.isCurrent = isCurrent
+        self.maximumOutstandingWrites = max(1, maximumOutstandingWrites)
+    }
+
+    func start(completion: @escaping (Error?) -> Void) {
+        queue.async {
+            self.completion = completion
+            self.pump()
+        }
+    }
+
+    // Only called on the queue
+    private func pump() {
+        if failure == nil, offset < data.count, !isCurrent() {
+            failure = TransferError.superseded
+        }
+
+        while failure == nil, offset < data.count, outstanding < maximumOutstandingWrites {
+            // The write length can change after an MTU exchange, so it is read per chunk
+            let chunkSize = min(max(1, transport.maximumWriteLength), data.count - offset)
+            let chunk = data.subdata(in: offset..<offset + chunkSize)
+
+            offset += chunkSize
+            outstanding += 1
+            checksum.update(chunk)
+
+            statistics.writes += 1
+            statistics.largestChunk = max(statistics.largestChunk, chunkSize)
+            statistics.mostOutstanding = max(statistics.mostOutstanding, outstanding)
+
+            transport.write(chunk) { error in
+                self.queue.async {
+                    self.didWrite(byteCount: chunkSize, error: error)
+                }
+            }
+        }
+
+        if outstanding == 0, failure != nil || offset == data.count {
+            finish()
+        }
+    }
+
+    private func didWrite(byteCount: Int, error: Error?) {
+        outstanding -= 1
+
+        if let error = error {
+            failure = failure ?? error
+        } else {
+            statistics.bytes += byteCount
+        }
+
+        pump()
+    }
+
+    private func finish() {
+        let completion = self.completion
+        self.completion = nil
+        completion?(failure)
+    }
+}
@@ -0,0 +1,137 @@
+//
+//  GKCardLink.swift
+//  GateKeeper
+//
+
+import CoreBluetooth
+import SwiftyBluetooth
+
+// Everything GKCard needs from a card: the connection, the control point
+// characteristic and its notifications, and the file write characteristic.
+protocol GKCardLink: GKCardTransport {
+    // Receives each control point notification, in order
+    var controlPointHandler: ((Data) -> Void)? { get set }
+
+    func connect(timeout: TimeInterval, completion: @escaping (Error?) -> Void)
+    func disconnect(completion: @escaping (Error?) -> Void)
+    func writeControlPoint(_ value: Data, completion: @escaping (Error?) -> Void)
+    func readFileChecksum(completion: @escaping (Data?, Error?) -> Void)
+}
+
+// A physical card over SwiftyBluetooth. SwiftyBluetooth 1.0 exposes neither
+// the negotiated MTU nor the CBPeripheral, so there is no
+// maximumWriteValueLength(for:) or canSendWriteWithoutResponse to go by, and
+// the latter would also need iOS 11. File writes keep the chunk length and
+// gap the transfer used before it was pipelined. iOS reports a write without
+// response as done as soon as it is queued and can drop values queued faster
+// than the radio sends them, so the gap is the only pacing there is.
+final class GKCardPeripheralLink: GKCardLink {
+
+    // The chunk length of the original transfer loop
+    static let cardWriteLength = 128
+
+    // The original transfer loop's usleep(5000); no shorter gap has been tried on a card
+    static let writeInterval: TimeInterval = 0.005
+
+    var controlPointHandler: ((Data) -> Void)?
+
+    var maximumWriteLength: Int {
+        return GKCardPeripheralLink.cardWriteLength
+    }
+
+    private let peripheral: Peripheral
+    private let writeQueue = DispatchQueue(label: "GKCardPeripheralLink")
+    private var nextWrite = Date.distantPast
+
+    init(peripheral: Peripheral) {
+        self.peripheral = peripheral
+
+        NotificationCenter.default.addObserver(forName: Peripheral.PeripheralCharacteristicValueUpdate, object: peripheral, queue: nil) { notification in
+            if let characteristic = notification.userInfo?["characteristic"] as? CBCharacteristic {
+                if let value = characteristic.value {
+                    self.controlPointHandler?(value)
+                }
+            } else {
+                print("update notification dropped")
+            }
+        }
+    }
+
+    func connect(timeout: TimeInterval, completion: @escaping (Error?) -> Void) {
+        peripheral.connect(withTimeout: timeout, completion: { result in
+            switch result {
+            case .failure(let error):
+                switch error {
+                case SBError.operationTimedOut:
+                    completion(GKCard.CardError.connectionTimedOut)
+                default:
+                    completion(error)
+                }
+            case .success:
+                self.peripheral.setNotifyValue(
+                    toEnabled: true,
+                    forCharacWithUUID: GKCard.controlPointUUID,
+                    ofServiceWithUUID: GKCard.serviceUUID
+                ) { result in
+                    switch result {
+                    case .failure(let error):
+                        let nsError = error as NSError
+                        switch nsError.code {
+                        case CBATTError.insufficientEncryption.rawValue:
+                            completion(GKCard.CardError.cardNotPaired)
+                        default:
+                            completion(error)
+                        }
+                    case .success:
+                        completion(nil)
+                    }
+                }
+            }
+        })
+    }
+
+    func disconnect(completion: @escaping (Error?) -> Void) {
+        peripheral.disconnect { result in
+            switch result {
+            case .failure(let error):
+                completion(error)
+            case .success:
+                completion(nil)
+            }
+        }
+    }
+
+    func writeControlPoint(_ value: Data, completion: @escaping (Error?) -> Void) {
+        write(value, characteristicUUID: GKCard.controlPointUUID, completion: completion)
+    }
+
+    // Completes once the value is queued, no sooner than `writeInterval` after the previous one
+    func write(_ value: Data, completion: @escaping (Error?) -> Void) {
+        writeQueue.async {
+            let wait = self.nextWrite.timeIntervalSinceNow
+            if wait > 0 {
+                usleep(useconds_t(wait * 1_000_000))
+            }
+
+            self.nextWrite = Date(timeIntervalSinceNow: GKCardPeripheralLink.writeInterval)
+            self.write(value, characteristicUUID: GKCard.fileWriteUUID, completion: completion)
+        }
+    }
+
+    func readFileChecksum(completion: @escaping (Data?, Error?) -> Void) {
+        peripheral.readValue(ofCharacWithUUID: GKCard.fileWriteUUID, fromServiceWithUUID: GKCard.serviceUUID, completion: { result in
+            completion(result.value, result.error)
+        })
+    }
+
+    private func write(_ value: Data, characteristicUUID: CBUUID, completion: @escaping (Error?) -> Void) {
+        peripheral.writeValue(ofCharacWithUUID: characteristicUUID, fromServiceWithUUID: GKCard.serviceUUID, value: value, type: .withoutResponse, completion: { result in
+            switch result {
+            case .failure(let error):
+                completion(error)
+            case .success:
+                completion(nil)
+            }
+        })
+    }
+}
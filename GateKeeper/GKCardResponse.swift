@@ -0,0 +1,85 @@
+//
+//  GKCardResponse.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Collects the control point notifications answering one command and
+// completes as soon as the response is whole, instead of waiting for the
+// buffer to stop growing.
+final class GKCardResponse {
+
+    enum Framing {
+        // One ACK or NAK byte
+        case status
+        // Data of unannounced length, such as a file; it is whole once
+        // notifications pause for `idleGap`
+        case stream(idleGap: TimeInterval)
+    }
+
+    let framing: Framing
+    let timeout: TimeInterval
+
+    private(set) var data = Data()
+
+    private let queue: DispatchQueue
+    private var completion: ((Data) -> Void)?
+    private var timer: DispatchWorkItem?
+
+    // Everything, including the completion, happens on `queue`
+    init(framing: Framing, timeout: TimeInterval, queue: DispatchQueue, completion: @escaping (Data) -> Void) {
+        self.framing = framing
+        self.timeout = timeout
+        self.queue = queue
+        self.completion = completion
+    }
+
+    var isFinished: Bool {
+        return completion == nil
+    }
+
+    // The timeout covers the wait for the first notification; a card that
+    // does not answer yields an empty response
+    func start() {
+        schedule(after: timeout)
+    }
+
+    func append(_ value: Data) {
+        guard !isFinished else {
+            return
+        }
+
+        data.append(value)
+
+        switch framing {
+        case .status:
+            finish()
+        case .stream(let idleGap):
+            schedule(after: idleGap)
+        }
+    }
+
+    func cancel() {
+        timer?.cancel()
+        timer = nil
+        completion = nil
+    }
+
+    private func schedule(after interval: TimeInterval) {
+        timer?.cancel()
+
+        let timer = DispatchWorkItem { [weak self] in
+            self?.finish()
+        }
+        self.timer = timer
+
+        queue.asyncAfter(deadline: .now() + interval, execute: timer)
+    }
+
+    private func finish() {
+        let completion = self.completion
+        cancel()
+        completion?(data)
+    }
+}
@@ -0,0 +1,222 @@
+//
+//  GKCardSimulator.swift
+//  GateKeeper
+//
+
+#if DEBUG
+
+import Foundation
+
+// An in-process card for measuring and testing transfers without hardware.
+// It speaks the control point protocol GKCard uses:
+//   2 get, 3 put, 4 close, 7 delete, 8 rename, 10 exists
+// and accepts file writes, staging them until close stores them under a path.
+// Like the real link, file writes are taken one per `writeInterval` and
+// complete as soon as they are taken; everything reaches the other side
+// `latency` later. Writes and notifications are dropped with probability
+// `dropRate`.
+final class GKCardSimulator: GKCardLink {
+
+    struct Configuration {
+        var latency: TimeInterval = 0.0
+        var writeInterval = GKCardPeripheralLink.writeInterval
+        var maximumWriteLength = 128
+        var notificationLength = 128
+        var dropRate = 0.0
+
+        init() {
+        }
+    }
+
+    enum SimulatedError: Error {
+        case notConnected
+    }
+
+    static let ack: UInt8 = 0x06
+    static let nak: UInt8 = 0x15
+
+    var configuration: Configuration
+    var controlPointHandler: ((Data) -> Void)?
+
+    var maximumWriteLength: Int {
+        return configuration.maximumWriteLength
+    }
+
+    // Card state, only touched on the queue
+    private(set) var files = [String: Data]()
+    private(set) var name = "GateKeeper"
+    private var staged = Data()
+    private var isConnected = false
+    private var nextWrite = DispatchTime.now()
+
+    private let queue = DispatchQueue(label: "GKCardSimulator")
+
+    init(configuration: Configuration = Configuration()) {
+        self.configuration = configuration
+    }
+
+    func store(path: String, data: Data) {
+        queue.sync {
+            files[path] = data
+        }
+    }
+
+    func file(path: String) -> Data? {
+        return queue.sync {
+            files[path]
+        }
+    }
+
+    // MARK: GKCardLink
+
+    func connect(timeout: TimeInterval, completion: @escaping (Error?) -> Void) {
+        later {
+            self.isConnected = true
+            completion(nil)
+        }
+    }
+
+    func disconnect(completion: @escaping (Error?) -> Void) {
+        later {
+            self.isConnected = false
+            completion(nil)
+        }
+    }
+
+    func writeControlPoint(_ value: Data, completion: @escaping (Error?) -> Void) {
+        later {
+            guard self.isConnected else {
+                completion(SimulatedError.notConnected)
+                return
+            }
+
+            completion(nil)
+
+            if !self.drops() {
+                self.handle(command: value)
+            }
+        }
+    }
+
+    func write(_ value: Data, completion: @escaping (Error?) -> Void) {
+        queue.async {
+            guard self.isConnected else {
+                completion(SimulatedError.notConnected)
+                return
+            }
+
+            let taken = max(DispatchTime.now(), self.nextWrite)
+            self.nextWrite = taken + self.configuration.writeInterval
+
+            self.queue.asyncAfter(deadline: taken) {
+                completion(nil)
+
+                // A write without response that is lost still completed on the sender's side
+                self.later {
+                    if !self.drops() {
+                        self.staged.append(value)
+                    }
+                }
+            }
+        }
+    }
+
+    func readFileChecksum(completion: @escaping (Data?, Error?) -> Void) {
+        later {
+            let checksum = self.staged.crc16()
+            completion(Data(bytes: [UInt8(truncatingIfNeeded: checksum >> 8), UInt8(truncatingIfNeeded: checksum)]), nil)
+        }
+    }
+
+    // MARK: Commands
+
+    // Only called on the queue
+    private func handle(command value: Data) {
+        guard let command = value.first else {
+            return
+        }
+
+        let argument = GKCardSimulator.argument(command: value)
+
+        switch command {
+        case 2:
+            // Like the card, a missing file gets no reply at all
+            if let path = argument, let data = files[path] {
+                notify(data)
+            }
+        case 3:
+            staged.removeAll()
+            notify(Data(bytes: [GKCardSimulator.ack]))
+        case 4:
+            if let path = argument {
+                files[path] = staged
+                staged.removeAll()
+            }
+            notify(Data(bytes: [GKCardSimulator.ack]))
+        case 7:
+            if let path = argument {
+                files.removeValue(forKey: path)
+            }
+            notify(Data(bytes: [GKCardSimulator.ack]))
+        case 8:
+            if let newName = argument {
+                name = newName
+            }
+            notify(Data(bytes: [GKCardSimulator.ack]))
+        case 10:
+            let exists = argument.map { files[$0] != nil } ?? false
+            notify(Data(bytes: [exists ? GKCardSimulator.ack : GKCardSimulator.nak]))
+        default:
+            notify(Data(bytes: [GKCardSimulator.nak]))
+        }
+    }
+
+    // Command byte, length byte, the string, then a zero byte
+    private static func argument(command value: Data) -> String? {
+        guard value.count >= 2 else {
+            return nil
+        }
+
+        let length = Int(value[value.startIndex + 1])
+        let start = value.startIndex + 2
+
+        guard value.count >= 2 + length else {
+            return nil
+        }
+
+        return String(bytes: value[start..<start + length], encoding: .utf8)
+    }
+
+    // Splits a response into notifications of at most `notificationLength` bytes
+    private func notify(_ data: Data) {
+        let length = max(1, configuration.notificationLength)
+        var offset = 0
+
+        while offset < data.count {
+            let fragment = data.subdata(in: offset..<min(offset + length, data.count))
+            offset += fragment.count
+
+            later {
+                if !self.drops() {
+                    self.controlPointHandler?(fragment)
+                }
+            }
+        }
+    }
+
+    // MARK: Timing
+
+    private func later(_ work: @escaping () -> Void) {
+        if configuration.latency > 0 {
+            queue.asyncAfter(deadline: .now() + configuration.latency, execute: work)
+        } else {
+            queue.async(execute: work)
+        }
+    }
+
+    private func drops() -> Bool {
+        return configuration.dropRate > 0 && Double(arc4random_uniform(1_000_000)) < configuration.dropRate * 1_000_000
+    }
+}
+
+#endif
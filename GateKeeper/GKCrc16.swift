@@ -0,0 +1,78 @@
+//
+//  GKCrc16.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// The card's CRC-16 (polynomial 0x1021, initial value 0, not reflected),
+// computed incrementally. Eight bytes are folded per step with
+// slicing-by-8 tables: tables[k][b] is the CRC of byte b followed by k zero
+// bytes, so the eight lookups of a step are independent of each other.
+struct GKCrc16 {
+
+    static let tables: [UInt16] = {
+        var tables = [UInt16](repeating: 0, count: 8 * 256)
+
+        for byte in 0..<256 {
+            tables[byte] = crc16Table[byte]
+        }
+
+        for slice in 1..<8 {
+            for byte in 0..<256 {
+                let previous = tables[(slice - 1) * 256 + byte]
+                tables[slice * 256 + byte] = (previous << 8) ^ tables[Int(previous >> 8)]
+            }
+        }
+
+        return tables
+    }()
+
+    private(set) var value: UInt16 = 0
+
+    static func checksum(_ data: Data) -> UInt16 {
+        var crc = GKCrc16()
+        crc.update(data)
+        return crc.value
+    }
+
+    mutating func update(_ data: Data) {
+        data.withUnsafeBytes { (pointer: UnsafePointer<UInt8>) in
+            update(UnsafeBufferPointer(start: pointer, count: data.count))
+        }
+    }
+
+    mutating func update(_ bytes: UnsafeBufferPointer<UInt8>) {
+        guard let base = bytes.baseAddress else {
+            return
+        }
+
+        var crc = value
+        var offset = 0
+        let count = bytes.count
+
+        GKCrc16.tables.withUnsafeBufferPointer { tables in
+            let t = tables.baseAddress!
+
+            while count - offset >= 8 {
+                let b = base + offset
+                let high = Int(b[0] ^ UInt8(truncatingIfNeeded: crc >> 8))
+                let low = Int(b[1] ^ UInt8(truncatingIfNeeded: crc))
+
+                crc = t[7 * 256 + high] ^ t[6 * 256 + low] ^
+                    t[5 * 256 + Int(b[2])] ^ t[4 * 256 + Int(b[3])] ^
+                    t[3 * 256 + Int(b[4])] ^ t[2 * 256 + Int(b[5])] ^
+                    t[1 * 256 + Int(b[6])] ^ t[Int(b[7])]
+
+                offset += 8
+            }
+
+            while offset < count {
+                crc = t[Int(base[offset] ^ UInt8(truncatingIfNeeded: crc >> 8))] ^ (crc << 8)
+                offset += 1
+            }
+        }
+
+        value = crc
+    }
+}
@@ -7,5 +7,6 @@
 #define GateKeeper_Bridging_Header_h
 
 #import <CommonCrypto/CommonCrypto.h>
+#import <zlib.h>
 
 #endif /* GateKeeper_Bridging_Header_h */
@@ -21,7 +21,12 @@ enum KdbxError: Error {
 protocol KdbxProtocol {
     var database: KdbxXml.KeePassFile { get set }
     var transformationRounds: Int { get set }
+    var transformationKdf: KdbxKdfCalibration.Kdf { get }
+    // zlib level for gzip compressed payloads, 1 fastest to 9 smallest
+    var compressionLevel: Int32 { get set }
 
+    func add(groupUUID: UUID, entry: KdbxXml.Entry)
+    func add(groupUUID: UUID, group: KdbxXml.Group)
     func delete(entryUUID: UUID)
     func delete(groupUUID: UUID)
     func encrypt(compositeKey: [UInt8]) throws -> Data
@@ -33,6 +38,7 @@ class Kdbx {
 
     enum CipherType {
         case aes
+        case chaCha20
     }
 
     enum StreamAlgorithm {
@@ -43,6 +49,7 @@ class Kdbx {
 
     private var kdbx: KdbxProtocol
     private var compositeKey: [UInt8]
+    private var searchIndex: KdbxSearchIndex
 
     var database: KdbxXml.KeePassFile {
         return kdbx.database
@@ -57,6 +64,19 @@ class Kdbx {
         }
     }
 
+    var transformationKdf: KdbxKdfCalibration.Kdf {
+        return kdbx.transformationKdf
+    }
+
+    var compressionLevel: Int32 {
+        get {
+            return kdbx.compressionLevel
+        }
+        set {
+            kdbx.compressionLevel = newValue
+        }
+    }
+
     required init(encryptedData: Data, compositeKey: [UInt8]) throws {
         self.compositeKey = compositeKey
 
@@ -65,6 +85,8 @@ class Kdbx {
         } catch KdbxError.databaseVersionUnsupported {
             kdbx = try Kdbx3(encryptedData: encryptedData, compositeKey: compositeKey)
         }
+
+        searchIndex = KdbxSearchIndex(group: kdbx.database.root.group)
     }
 
     required init(compositeKey: [UInt8]) {
@@ -137,6 +159,7 @@ class Kdbx {
 
         self.kdbx = Kdbx3(header: header, database: database)
         self.compositeKey = compositeKey
+        self.searchIndex = KdbxSearchIndex(group: group)
     }
 
     convenience init(encryptedData: Data, password: String) throws {
@@ -148,30 +171,31 @@ class Kdbx {
     }
 
     func add(groupUUID: UUID, entry: KdbxXml.Entry) {
-        if kdbx.database.root.group.uuid == groupUUID {
-            kdbx.database.root.group.entries.append(entry)
-        } else {
-            for index in kdbx.database.root.group.groups.indices {
-                kdbx.database.root.group.groups[index].add(groupUUID: groupUUID, entry: entry)
-            }
+        kdbx.add(groupUUID: groupUUID, entry: entry)
+
+        if database.get(entryUUID: entry.uuid) != nil {
+            searchIndex.update(entry: entry)
         }
     }
 
     func add(groupUUID: UUID, group: KdbxXml.Group) {
-        if kdbx.database.root.group.uuid == groupUUID {
-            kdbx.database.root.group.groups.append(group)
-        } else {
-            for index in kdbx.database.root.group.groups.indices {
-                kdbx.database.root.group.groups[index].add(groupUUID: groupUUID, group: group)
-            }
+        kdbx.add(groupUUID: groupUUID, group: group)
+
+        if database.get(groupUUID: group.uuid) != nil {
+            searchIndex.add(group: group)
         }
     }
 
     func delete(entryUUID: UUID) {
         kdbx.delete(entryUUID: entryUUID)
+        searchIndex.remove(entryUUID: entryUUID)
     }
 
     func delete(groupUUID: UUID) {
+        if let group = database.get(groupUUID: groupUUID) {
+            searchIndex.remove(group: group)
+        }
+
         kdbx.delete(groupUUID: groupUUID)
     }
 
@@ -179,39 +203,46 @@ class Kdbx {
         return try kdbx.encrypt(compositeKey: compositeKey)
     }
 
+    // Same results, in the same order, as a full tree search
     func search(query: String, attributes: Set<KdbxEntrySearchAttribute>) -> [KdbxEntrySearchAttribute:[KdbxXml.Entry]] {
-        return database.root.group.search(query: query, attributes: attributes)
-    }
-
-    func get(groupUUID: UUID) -> KdbxXml.Group? {
-        if database.root.group.uuid == groupUUID {
-            return database.root.group
-        } else {
-            for group in database.root.group.groups {
-                if group.uuid == groupUUID {
-                    return group
-                }
-                if let foundGroup = group.get(groupUUID: groupUUID) {
-                    return foundGroup
-                }
-            }
+        let lowercasedQuery = query.lowercased(with: .current)
+        let database = self.database
+
+        var results: [KdbxEntrySearchAttribute:[KdbxXml.Entry]] = [
+            .title: [],
+            .username: [],
+            .url: [],
+            .notes: []
+        ]
+
+        for attribute in attributes {
+            let uuids = searchIndex.matches(lowercasedQuery: lowercasedQuery, attribute: attribute)
+            results[attribute] = database.entries(uuids: uuids)
         }
 
-        return nil
+        return results
     }
 
-    func get(entryUUID: UUID) -> KdbxXml.Entry? {
-        for entry in database.root.group.entries where entry.uuid == entryUUID {
-            return entry
-        }
+    // Searches a snapshot, so edits made while the session is open are not seen
+    func makeSearchSession(attributes: [KdbxEntrySearchAttribute] = KdbxSearchIndex.attributes) -> KdbxSearchSession {
+        return KdbxSearchSession(database: database, index: searchIndex, attributes: attributes)
+    }
 
-        for group in database.root.group.groups {
-            if let foundEntry = group.get(entryUUID: entryUUID) {
-                return foundEntry
-            }
+    // Up to `limit` fuzzy matches, best first, ties in document order
+    func rankedSearch(query: String, attributes: Set<KdbxEntrySearchAttribute>, limit: Int) -> [KdbxFuzzyMatcher.Match] {
+        guard let matcher = KdbxFuzzyMatcher(query: query) else {
+            return []
         }
 
-        return nil
+        return searchIndex.rankedMatches(matcher: matcher, attributes: attributes, limit: limit, database: database)
+    }
+
+    func get(groupUUID: UUID) -> KdbxXml.Group? {
+        return database.get(groupUUID: groupUUID)
+    }
+
+    func get(entryUUID: UUID) -> KdbxXml.Entry? {
+        return database.get(entryUUID: entryUUID)
     }
 
     func setPassword(_ password: String) {
@@ -220,9 +251,19 @@ class Kdbx {
 
     func update(entry: KdbxXml.Entry) {
         kdbx.update(entry: entry)
+
+        if database.get(entryUUID: entry.uuid) != nil {
+            searchIndex.update(entry: entry)
+        }
     }
 
     func update(group: KdbxXml.Group) {
+        guard let previous = database.get(groupUUID: group.uuid) else {
+            return
+        }
+
         kdbx.update(group: group)
+        searchIndex.remove(group: previous)
+        searchIndex.add(group: group)
     }
 }
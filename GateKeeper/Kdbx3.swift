@@ -17,6 +17,10 @@ class Kdbx3: KdbxProtocol {
             header.transformRounds = UInt64(newValue)
         }
     }
+    var transformationKdf: KdbxKdfCalibration.Kdf {
+        return .aes
+    }
+    var compressionLevel = KdbxParallelGzipSink.defaultLevel
 
     required init(header: Kdbx3Header, database: KdbxXml.KeePassFile) {
         self.header = header
@@ -24,13 +28,13 @@ class Kdbx3: KdbxProtocol {
     }
 
     convenience init(encryptedData: Data, compositeKey: [UInt8]) throws {
-        let readStream = DataReadStream(data: encryptedData)
-
         do {
-            let header = try Kdbx3Header(readStream: readStream)
+            let (header, payload) = try DataReadCursor.with(data: encryptedData) { cursor -> (Kdbx3Header, Kdbx3Payload) in
+                let header = try Kdbx3Header(cursor: cursor)
+                let payload = try Kdbx3Payload(encryptedBytes: cursor.readRemaining(), compositeKey: compositeKey, header: header)
 
-            let encryptedBytes = try readStream.readBytes(size: readStream.bytesAvailable)
-            let payload = try Kdbx3Payload(encryptedBytes: encryptedBytes, compositeKey: compositeKey, header: header)
+                return (header, payload)
+            }
 
             self.init(header: header, database: payload.database)
         } catch Kdbx3Header.ReadError.unknownVersion {
@@ -38,33 +42,23 @@ class Kdbx3: KdbxProtocol {
         }
     }
 
+    func add(groupUUID: UUID, entry: KdbxXml.Entry) {
+        database.add(groupUUID: groupUUID, entry: entry)
+    }
+
+    func add(groupUUID: UUID, group: KdbxXml.Group) {
+        database.add(groupUUID: groupUUID, group: group)
+    }
+
     func delete(groupUUID: UUID) {
-        if let index = database.root.group.groups.index(where: { $0.uuid == groupUUID }) {
-            database.root.group.groups.remove(at: index)
-        } else {
-            for index in database.root.group.groups.indices {
-                database.root.group.groups[index].delete(groupUUID: groupUUID)
-            }
-        }
+        database.delete(groupUUID: groupUUID)
     }
 
     func delete(entryUUID: UUID) {
-        if let index = database.root.group.entries.index(where: { $0.uuid == entryUUID }) {
-            database.root.group.entries.remove(at: index)
-        } else {
-            for index in database.root.group.groups.indices {
-                database.root.group.groups[index].delete(entryUUID: entryUUID)
-            }
-        }
+        database.delete(entryUUID: entryUUID)
     }
 
     func encrypt(compositeKey: [UInt8]) throws -> Data {
-        // XML
-
-        guard let xmlData = database.build().xmlCompact.data(using: .utf8) else {
-            throw KdbxError.encryptionFailed
-        }
-
         // Randomize
 
         header.masterKeySeed = [UInt8].random(size: 32)
@@ -82,7 +76,7 @@ class Kdbx3: KdbxProtocol {
             rounds: Int(header.transformRounds)
         )
         let transformedCompositeKeyHashed = transformedCompositeKey.sha256()
-        let masterKey = (header.masterKeySeed + transformedCompositeKeyHashed).sha256()
+        let masterKey = KdbxSha256.hash(header.masterKeySeed, transformedCompositeKeyHashed)
 
         // Write: Magic numbers, version
 
@@ -100,6 +94,8 @@ class Kdbx3: KdbxProtocol {
             let data = KdbxCrypto.aesUUID.data
             try writeStream.write(UInt16(data.count))
             try writeStream.write(KdbxCrypto.aesUUID.data)
+        case .chaCha20:
+            throw KdbxError.encryptionFailed
         }
 
         try writeStream.write(Kdbx3Header.ReadType.compressionType.rawValue)
@@ -138,53 +134,38 @@ class Kdbx3: KdbxProtocol {
         try writeStream.write(UInt16(4))
         try writeStream.write(Data(bytes: [UInt8](repeating: 0x0, count: 4)))
 
-        // Write: Payload block
+        // Write: Payload. XML is serialized straight into compression, hashed blocks and encryption,
+        // with protected values going through the inner stream as they are written
+
+        let salsaKey = header.protectedStreamKey.sha256()
+        let iv = [0xE8, 0x30, 0x09, 0x4B, 0x97, 0x20, 0x5D, 0x2A] as [UInt8]
+        let streamCipher = Salsa20(key: salsaKey, iv: iv)
 
-        let payloadData: Data
+        let payloadSink = KdbxBufferSink()
+        let encryptor = try KdbxAesCbcSink(operation: .encrypt, key: masterKey, iv: header.encryptionIv, next: payloadSink)
+        let blockWriter = try KdbxHashedBlockWriteSink(streamStartBytes: header.streamStartBytes, next: encryptor)
+
+        let compressor: KdbxByteSink
         switch header.compressionType {
         case .none:
-            payloadData = xmlData
+            compressor = blockWriter
         case .gzip:
-            payloadData = try xmlData.gzipped()
+            compressor = try KdbxParallelGzipSink(level: compressionLevel, next: blockWriter)
         }
 
-        let payloadWriteStream = DataWriteStream()
-        try payloadWriteStream.write(Data(bytes: header.streamStartBytes))
-        try payloadWriteStream.write(UInt32(0))
-        try payloadWriteStream.write(Data(bytes: [UInt8](payloadData).sha256()))
-        try payloadWriteStream.write(UInt32(payloadData.count))
-        try payloadWriteStream.write(payloadData)
-        try payloadWriteStream.write(UInt32(1))
-        try payloadWriteStream.write(Data(bytes: [UInt8](repeating: 0x0, count: 32)))
-        try payloadWriteStream.write(UInt32(0))
+        try KdbxXmlWriter(next: compressor, dateFormat: .iso8601, streamCipher: streamCipher).write(file: database)
+        try compressor.finish()
 
-        let encryptedBytes = try KdbxCrypto.aes(operation: .encrypt, bytes: [UInt8](payloadWriteStream.data), key: masterKey, iv: header.encryptionIv)
-        try writeStream.write(Data(bytes: encryptedBytes))
+        try writeStream.write(Data(bytes: payloadSink.bytes))
 
         return writeStream.data
     }
 
     func update(entry: KdbxXml.Entry) {
-        if let index = database.root.group.entries.index(where: { $0.uuid == entry.uuid }) {
-            database.root.group.entries[index] = entry
-        } else {
-            for index in database.root.group.groups.indices {
-                database.root.group.groups[index].update(entry: entry)
-            }
-        }
+        database.update(entry: entry)
     }
 
     func update(group: KdbxXml.Group) {
-        if database.root.group.uuid == group.uuid {
-            database.root.group = group
-        } else {
-            if let index = database.root.group.groups.index(where: { $0.uuid == group.uuid }) {
-                database.root.group.groups[index] = group
-            } else {
-                for index in database.root.group.groups.indices {
-                    database.root.group.groups[index].update(group: group)
-                }
-            }
-        }
+        database.update(group: group)
     }
 }
@@ -37,6 +37,7 @@ class Kdbx3Header {
         case unknownCipherUuid
         case unknownCompressionType
         case unknownStreamAlgorithm
+        case invalidTransformRounds
     }
 
     struct Version {
@@ -66,17 +67,17 @@ class Kdbx3Header {
         streamStartBytes = [UInt8].random(size: 32)
     }
 
-    required init(readStream: DataReadStream) throws {
+    required init(cursor: DataReadCursor) throws {
         // Verify magic numbers and version
 
-        magicNumbers = try readStream.readBytes(size: 8)
+        magicNumbers = try cursor.readBytes(size: 8)
 
         guard magicNumbers == Kdbx.magicNumbers else {
             throw ReadError.unknownMagicNumbers
         }
 
-        let minor = try readStream.read() as UInt16
-        let major = try readStream.read() as UInt16
+        let minor = try cursor.read() as UInt16
+        let major = try cursor.read() as UInt16
 
         version = Version(major: major, minor: minor)
 
@@ -87,18 +88,16 @@ class Kdbx3Header {
         // Dynamic header
 
         readLoop: repeat {
-            let readTypeInt = try readStream.read() as UInt8
+            let readTypeInt = try cursor.read() as UInt8
 
             if let readType = ReadType(rawValue: readTypeInt) {
-                let size = Int(try readStream.read() as Int16)
+                let size = Int(try cursor.read() as Int16)
 
                 switch readType {
                 case .comment:
-                    _ = try readStream.readBytes(size: size)
+                    try cursor.skip(count: size)
                 case .cipherUuid:
-                    let b = try readStream.readBytes(size: size)
-
-                    let cipherUuid = UUID(uuid: (b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]))
+                    let cipherUuid = try cursor.readBytes(size: size).uuid()
 
                     if cipherUuid == KdbxCrypto.aesUUID {
                         cipherType = .aes
@@ -106,7 +105,7 @@ class Kdbx3Header {
                         throw ReadError.unknownCipherUuid
                     }
                 case .compressionType:
-                    let rawValue = try readStream.read() as UInt32
+                    let rawValue = try cursor.read() as UInt32
 
                     if let ct = CompressionType(rawValue: rawValue) {
                         compressionType = ct
@@ -114,19 +113,26 @@ class Kdbx3Header {
                         throw ReadError.unknownCompressionType
                     }
                 case .masterKeySeed:
-                    masterKeySeed = try readStream.readBytes(size: size)
+                    masterKeySeed = try cursor.readBytes(size: size)
                 case .transformSeed:
-                    transformSeed = try readStream.readBytes(size: size)
+                    transformSeed = try cursor.readBytes(size: size)
                 case .transformRounds:
-                    transformRounds = try readStream.read() as UInt64
+                    let rounds = try cursor.read() as UInt64
+
+                    // Rounds are converted to Int for the transform
+                    if rounds <= UInt64(Int.max) {
+                        transformRounds = rounds
+                    } else {
+                        throw ReadError.invalidTransformRounds
+                    }
                 case .encryptionIv:
-                    encryptionIv = try readStream.readBytes(size: size)
+                    encryptionIv = try cursor.readBytes(size: size)
                 case .protectedStreamKey:
-                    protectedStreamKey = try readStream.readBytes(size: size)
+                    protectedStreamKey = try cursor.readBytes(size: size)
                 case .streamStartBytes:
-                    streamStartBytes = try readStream.readBytes(size: size)
+                    streamStartBytes = try cursor.readBytes(size: size)
                 case .streamAlgorithm:
-                    let rawValue = try readStream.read() as UInt32
+                    let rawValue = try cursor.read() as UInt32
 
                     if let algorithm = StreamAlgorithm(rawValue: rawValue) {
                         streamAlgorithm = algorithm
@@ -134,7 +140,7 @@ class Kdbx3Header {
                         throw ReadError.unknownStreamAlgorithm
                     }
                 case .end:
-                    _ = try readStream.readBytes(size: size)
+                    try cursor.skip(count: size)
                     break readLoop
                 }
             } else {
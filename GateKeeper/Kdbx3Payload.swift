@@ -3,7 +3,7 @@
 //  GateKeeper
 //
 
-import Gzip
+import Foundation
 
 class Kdbx3Payload {
 
@@ -13,7 +13,7 @@ class Kdbx3Payload {
         self.database = database
     }
 
-    convenience init(encryptedBytes: [UInt8], compositeKey: [UInt8], header: Kdbx3Header) throws {
+    convenience init(encryptedBytes: UnsafeRawBufferPointer, compositeKey: [UInt8], header: Kdbx3Header) throws {
         // Master key
 
         let hashedCompositeKey = compositeKey.sha256()
@@ -23,79 +23,45 @@ class Kdbx3Payload {
                 rounds: Int(header.transformRounds)
         )
         let transformedCompositeKeyHashed = transformedCompositeKey.sha256()
-        let masterKey = (header.masterKeySeed + transformedCompositeKeyHashed).sha256()
+        let masterKey = KdbxSha256.hash(header.masterKeySeed, transformedCompositeKeyHashed)
 
-        // Decrypt with master key and initialization vector
-
-        let decryptedBytes: [UInt8]
-        switch header.cipherType {
-        case .aes:
-            decryptedBytes = try KdbxCrypto.aes(operation: .decrypt, bytes: encryptedBytes, key: masterKey, iv: header.encryptionIv)
-        }
-
-        let readStream = DataReadStream(data: Data(bytes: decryptedBytes))
-
-        // Verify stream start bytes
+        // Prepare stream cipher (if any)
 
-        let streamStartBytes = try readStream.readBytes(size: header.streamStartBytes.count)
+        let streamCipher: KdbxStreamCipher?
+        switch header.streamAlgorithm {
+        case .salsa20:
+            let salsaKey = header.protectedStreamKey.sha256()
+            let iv = [0xE8, 0x30, 0x09, 0x4B, 0x97, 0x20, 0x5D, 0x2A] as [UInt8]
 
-        if streamStartBytes != header.streamStartBytes {
-            throw KdbxError.decryptionFailed
+            streamCipher = Salsa20(key: salsaKey, iv: iv)
         }
 
-        // Read payload block (block 0 is XML)
-
-        var payloadBytes = [UInt8]()
-        repeat {
-            let id = try readStream.read() as UInt32
-            let hash = try readStream.readBytes(size: 32)
-            let size = try readStream.read() as UInt32
-
-            guard size > 0 else {
-                throw KdbxError.decryptionFailed
-            }
-
-            let bytes = try readStream.readBytes(size: Int(size))
+        // Decode and parse in fixed-size chunks: decrypt -> hashed blocks -> decompress -> XML -> structs
 
-            guard bytes.sha256() == hash else {
-                throw KdbxError.decryptionFailed
-            }
+        let structBuilder = KdbxXml.StructBuilder(streamCipher: streamCipher)
+        let tokenizer = KdbxXmlTokenizer(delegate: structBuilder)
 
-            if id == 0 {
-                payloadBytes.append(contentsOf: bytes)
-                break
-            }
-        } while (readStream.hasBytesAvailable)
-
-        guard !payloadBytes.isEmpty else {
-            throw KdbxError.decryptionFailed
-        }
-
-        // Decompress
-
-        let payloadData: Data
+        let decompressor: KdbxByteSink
         switch header.compressionType {
         case .none:
-            payloadData = Data(bytes: payloadBytes)
+            decompressor = tokenizer
         case .gzip:
-            payloadData = try Data(bytes: payloadBytes).gunzipped()
+            decompressor = try KdbxGunzipSink(next: tokenizer)
         }
 
-        // Prepare stream cipher (if any)
+        let blockReader = KdbxHashedBlockSink(streamStartBytes: header.streamStartBytes, next: decompressor)
 
-        let streamCipher: KdbxStreamCipher?
-        switch header.streamAlgorithm {
-        case .salsa20:
-            let salsaKey = header.protectedStreamKey.sha256()
-            let iv = [0xE8, 0x30, 0x09, 0x4B, 0x97, 0x20, 0x5D, 0x2A] as [UInt8]
-
-            streamCipher = Salsa20(key: salsaKey, iv: iv)
+        let decryptor: KdbxByteSink
+        switch header.cipherType {
+        case .aes:
+            decryptor = try KdbxAesCbcSink(operation: .decrypt, key: masterKey, iv: header.encryptionIv, next: blockReader)
+        case .chaCha20:
+            throw KdbxError.decryptionFailed
         }
 
-        // Parse
-
-        let database = try KdbxXml.parse(data: payloadData, streamCipher: streamCipher)
+        try decryptor.write(chunked: encryptedBytes, chunkSize: KdbxAesCbcCryptor.parallelChunkSize)
+        try decryptor.finish()
 
-        self.init(database: database)
+        self.init(database: structBuilder.database)
     }
 }
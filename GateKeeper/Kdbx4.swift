@@ -4,6 +4,7 @@
 //
 
 import Foundation
+import Gzip
 
 class Kdbx4: KdbxProtocol {
 
@@ -17,6 +18,20 @@ class Kdbx4: KdbxProtocol {
             header.transformRounds = UInt64(newValue)
         }
     }
+    var transformationKdf: KdbxKdfCalibration.Kdf {
+        switch header.kdf {
+        case .aes:
+            return .aes
+        case .argon2(let parameters):
+            return .argon2(
+                variant: parameters.variant,
+                version: parameters.version,
+                memoryKiB: Int(parameters.memory / 1024),
+                parallelism: Int(parameters.parallelism)
+            )
+        }
+    }
+    var compressionLevel = KdbxParallelGzipSink.defaultLevel
 
     required init(database: KdbxXml.KeePassFile, header: Kdbx4Header) {
         self.database = database
@@ -24,13 +39,13 @@ class Kdbx4: KdbxProtocol {
     }
 
     convenience init(encryptedData: Data, compositeKey: [UInt8]) throws {
-        let readStream = DataReadStream(data: encryptedData)
-
         do {
-            let header = try Kdbx4Header(readStream: readStream)
+            let (header, payload) = try DataReadCursor.with(data: encryptedData) { cursor -> (Kdbx4Header, Kdbx4Payload) in
+                let header = try Kdbx4Header(cursor: cursor)
+                let payload = try Kdbx4Payload(encryptedBytes: cursor.readRemaining(), compositeKey: compositeKey, header: header)
 
-            let encryptedBytes = try readStream.readBytes(size: readStream.bytesAvailable)
-            let payload = try Kdbx4Payload(encryptedBytes: encryptedBytes, compositeKey: compositeKey, header: header)
+                return (header, payload)
+            }
 
             self.init(database: payload.database, header: header)
         } catch Kdbx4Header.ReadError.unknownVersion {
@@ -38,23 +53,188 @@ class Kdbx4: KdbxProtocol {
         }
     }
 
+    func add(groupUUID: UUID, entry: KdbxXml.Entry) {
+        database.add(groupUUID: groupUUID, entry: entry)
+    }
+
+    func add(groupUUID: UUID, group: KdbxXml.Group) {
+        database.add(groupUUID: groupUUID, group: group)
+    }
+
     func delete(groupUUID: UUID) {
-        fatalError("Not implemented.")
+        database.delete(groupUUID: groupUUID)
     }
 
     func delete(entryUUID: UUID) {
-        fatalError("Not implemented.")
+        database.delete(entryUUID: entryUUID)
     }
 
     func encrypt(compositeKey: [UInt8]) throws -> Data {
-        fatalError("Not implemented.")
+        // Randomize
+
+        header.masterKeySeed = [UInt8].random(size: 32)
+
+        switch header.cipherType {
+        case .aes:
+            header.encryptionIv = [UInt8].random(size: 16)
+        case .chaCha20:
+            header.encryptionIv = [UInt8].random(size: 12)
+        }
+
+        switch header.kdf {
+        case .aes(_, let rounds):
+            header.kdf = .aes(seed: [UInt8].random(size: 32), rounds: rounds)
+        case .argon2(var parameters):
+            parameters.salt = [UInt8].random(size: 32)
+            header.kdf = .argon2(parameters)
+        }
+
+        let protectedStreamKey = [UInt8].random(size: 64)
+
+        // Master key, HMAC key
+
+        let transformedCompositeKey = try header.transform(compositeKey: compositeKey)
+        let masterKey = KdbxSha256.hash(header.masterKeySeed, transformedCompositeKey)
+        let hmacKey = KdbxSha512.hash(header.masterKeySeed, transformedCompositeKey, [0x01])
+
+        // Write: Magic numbers, version
+
+        let writeStream = DataWriteStream()
+
+        try writeStream.write(Data(bytes: Kdbx.magicNumbers))
+        try writeStream.write(UInt16(0))
+        try writeStream.write(UInt16(4))
+
+        // Write: Dynamic header
+
+        try writeStream.write(Kdbx4Header.ReadType.cipherUuid.rawValue)
+        let cipherUuid: UUID
+        switch header.cipherType {
+        case .aes:
+            cipherUuid = KdbxCrypto.aesUUID
+        case .chaCha20:
+            cipherUuid = KdbxCrypto.chaCha20UUID
+        }
+        try writeStream.write(UInt32(cipherUuid.data.count))
+        try writeStream.write(cipherUuid.data)
+
+        try writeStream.write(Kdbx4Header.ReadType.compressionType.rawValue)
+        try writeStream.write(UInt32(4))
+        try writeStream.write(header.compressionType.rawValue)
+
+        try writeStream.write(Kdbx4Header.ReadType.masterKeySeed.rawValue)
+        try writeStream.write(UInt32(header.masterKeySeed.count))
+        try writeStream.write(Data(bytes: header.masterKeySeed))
+
+        try writeStream.write(Kdbx4Header.ReadType.encryptionIv.rawValue)
+        try writeStream.write(UInt32(header.encryptionIv.count))
+        try writeStream.write(Data(bytes: header.encryptionIv))
+
+        let kdfParametersStream = DataWriteStream()
+        try Kdbx4Header.parameters(kdf: header.kdf).write(to: kdfParametersStream)
+        let kdfParameters = kdfParametersStream.data
+
+        try writeStream.write(Kdbx4Header.ReadType.kdfParameters.rawValue)
+        try writeStream.write(UInt32(kdfParameters.count))
+        try writeStream.write(kdfParameters)
+
+        if let publicCustomData = header.publicCustomData {
+            try writeStream.write(Kdbx4Header.ReadType.publicCustomData.rawValue)
+            try writeStream.write(UInt32(publicCustomData.count))
+            try writeStream.write(Data(bytes: publicCustomData))
+        }
+
+        try writeStream.write(Kdbx4Header.ReadType.end.rawValue)
+        try writeStream.write(UInt32(4))
+        try writeStream.write(Data(bytes: [0x0D, 0x0A, 0x0D, 0x0A]))
+
+        // Write: Header hash, header HMAC
+
+        let headerBytes = [UInt8](writeStream.data)
+        let headerHmacKey = KdbxCrypto.hmacBlockKey(index: UInt64.max, hmacKey: hmacKey)
+
+        try writeStream.write(Data(bytes: headerBytes.sha256()))
+        try writeStream.write(Data(bytes: KdbxCrypto.hmacSha256(key: headerHmacKey, bytes: headerBytes)))
+
+        // Inner header
+
+        let innerHeaderStream = DataWriteStream()
+
+        try innerHeaderStream.write(KdbxInnerHeaderSink.ReadType.streamAlgorithm.rawValue)
+        try innerHeaderStream.write(UInt32(4))
+        try innerHeaderStream.write(Kdbx4Payload.InnerStreamAlgorithm.chaCha20.rawValue)
+
+        try innerHeaderStream.write(KdbxInnerHeaderSink.ReadType.streamKey.rawValue)
+        try innerHeaderStream.write(UInt32(protectedStreamKey.count))
+        try innerHeaderStream.write(Data(bytes: protectedStreamKey))
+
+        for binary in database.meta.binaries {
+            guard var content = Data(base64Encoded: binary.content) else {
+                throw KdbxError.encryptionFailed
+            }
+
+            if binary.compressed {
+                content = try content.gunzipped()
+            }
+
+            try innerHeaderStream.write(KdbxInnerHeaderSink.ReadType.binary.rawValue)
+            try innerHeaderStream.write(UInt32(content.count + 1))
+            try innerHeaderStream.write(UInt8(binary.isProtected ? 0x01 : 0x00))
+            try innerHeaderStream.write(content)
+        }
+
+        try innerHeaderStream.write(KdbxInnerHeaderSink.ReadType.end.rawValue)
+        try innerHeaderStream.write(UInt32(0))
+
+        // XML: binaries live in the inner header, times are base64 ticks, protected values use the inner stream
+
+        var xmlDatabase = database
+        xmlDatabase.meta.binaries = []
+
+        let streamKeyHash = protectedStreamKey.sha512()
+        let streamCipher = ChaCha20(key: Array(streamKeyHash[0..<32]), nonce: Array(streamKeyHash[32..<44]))
+
+        // Write: Payload blocks. Serializing, compression and CBC run here, block HMACs (and ChaCha20) run on a worker pool
+
+        let blockWriter: KdbxHmacBlockWriteSink
+        let encryptor: KdbxByteSink
+        switch header.cipherType {
+        case .aes:
+            blockWriter = KdbxHmacBlockWriteSink(hmacKey: hmacKey)
+            encryptor = try KdbxAesCbcSink(operation: .encrypt, key: masterKey, iv: header.encryptionIv, next: blockWriter)
+        case .chaCha20:
+            let nonce = header.encryptionIv
+            let blocksPerChunk = UInt64(KdbxHmacBlockWriteSink.defaultBlockSize / 64)
+
+            blockWriter = KdbxHmacBlockWriteSink(hmacKey: hmacKey) { index, bytes in
+                let cipher = ChaCha20(key: masterKey, nonce: nonce, counter: UInt32(truncatingIfNeeded: index * blocksPerChunk))
+                cipher.transform(bytes)
+            }
+            encryptor = blockWriter
+        }
+
+        let compressor: KdbxByteSink
+        switch header.compressionType {
+        case .none:
+            compressor = encryptor
+        case .gzip:
+            compressor = try KdbxParallelGzipSink(level: compressionLevel, next: encryptor)
+        }
+
+        try compressor.write(chunked: innerHeaderStream.data)
+        try KdbxXmlWriter(next: compressor, dateFormat: .base64Ticks, streamCipher: streamCipher).write(file: xmlDatabase)
+        try compressor.finish()
+
+        try writeStream.write(blockWriter.data)
+
+        return writeStream.data
     }
 
     func update(entry: KdbxXml.Entry) {
-        fatalError("Not implemented.")
+        database.update(entry: entry)
     }
 
     func update(group: KdbxXml.Group) {
-        fatalError("Not implemented.")
+        database.update(group: group)
     }
 }
@@ -3,11 +3,34 @@
 //  GateKeeper
 //
 
+import Foundation
+
 class Kdbx4Header {
 
+    enum CompressionType: UInt32 {
+        case none = 0
+        case gzip = 1
+    }
+
+    enum ReadType: UInt8 {
+        case end = 0
+        case comment = 1
+        case cipherUuid = 2
+        case compressionType = 3
+        case masterKeySeed = 4
+        case encryptionIv = 7
+        case kdfParameters = 11
+        case publicCustomData = 12
+    }
+
     enum ReadError: Error {
         case unknownMagicNumbers
         case unknownVersion
+        case unknownReadType
+        case unknownCipherUuid
+        case unknownCompressionType
+        case unknownKdfUuid
+        case invalidKdfParameters
     }
 
     struct Version {
@@ -15,19 +38,73 @@ class Kdbx4Header {
         let minor: UInt16
     }
 
+    struct Argon2Parameters {
+        var variant: KdbxArgon2.Variant
+        var salt: [UInt8]
+        var parallelism: UInt32
+        var memory: UInt64
+        var iterations: UInt64
+        var version: UInt32
+    }
+
+    enum Kdf {
+        case aes(seed: [UInt8], rounds: UInt64)
+        case argon2(Argon2Parameters)
+    }
+
     var magicNumbers: [UInt8]
     var version: Version
-    var transformRounds: UInt64 = 80000
+    var cipherType = Kdbx.CipherType.aes
+    var compressionType = CompressionType.gzip
+    var masterKeySeed = [UInt8]()
+    var encryptionIv = [UInt8]()
+    var kdf = Kdf.aes(seed: [], rounds: 80000)
+    var publicCustomData: [UInt8]?
+
+    // Raw header as read, with its SHA-256 and HMAC from the file
+    var headerBytes = [UInt8]()
+    var headerHash = [UInt8]()
+    var headerHmac = [UInt8]()
+
+    var transformRounds: UInt64 {
+        get {
+            switch kdf {
+            case .aes(_, let rounds):
+                return rounds
+            case .argon2(let parameters):
+                return parameters.iterations
+            }
+        }
+        set {
+            switch kdf {
+            case .aes(let seed, _):
+                kdf = .aes(seed: seed, rounds: newValue)
+            case .argon2(var parameters):
+                parameters.iterations = newValue
+                kdf = .argon2(parameters)
+            }
+        }
+    }
+
+    required init() {
+        magicNumbers = Kdbx.magicNumbers
+        version = Version(major: 4, minor: 0)
+        masterKeySeed = [UInt8].random(size: 32)
+        encryptionIv = [UInt8].random(size: 16)
+        kdf = .aes(seed: [UInt8].random(size: 32), rounds: 80000)
+    }
+
+    required init(cursor: DataReadCursor) throws {
+        let start = cursor.offset
 
-    required init(readStream: DataReadStream) throws {
-        magicNumbers = try readStream.readBytes(size: 8)
+        magicNumbers = try cursor.readBytes(size: 8)
 
         if magicNumbers != Kdbx.magicNumbers {
             throw ReadError.unknownMagicNumbers
         }
 
-        let minor = try readStream.read() as UInt16
-        let major = try readStream.read() as UInt16
+        let minor = try cursor.read() as UInt16
+        let major = try cursor.read() as UInt16
 
         version = Version(major: major, minor: minor)
 
@@ -35,6 +112,143 @@ class Kdbx4Header {
             throw ReadError.unknownVersion
         }
 
-        throw ReadError.unknownVersion
+        // Dynamic header
+
+        readLoop: repeat {
+            let readTypeInt = try cursor.read() as UInt8
+
+            guard let readType = ReadType(rawValue: readTypeInt) else {
+                throw ReadError.unknownReadType
+            }
+
+            let size = Int(try cursor.read() as UInt32)
+
+            switch readType {
+            case .comment:
+                try cursor.skip(count: size)
+            case .cipherUuid:
+                let cipherUuid = try cursor.readBytes(size: size).uuid()
+
+                if cipherUuid == KdbxCrypto.aesUUID {
+                    cipherType = .aes
+                } else if cipherUuid == KdbxCrypto.chaCha20UUID {
+                    cipherType = .chaCha20
+                } else {
+                    throw ReadError.unknownCipherUuid
+                }
+            case .compressionType:
+                let rawValue = try cursor.read() as UInt32
+
+                if let ct = CompressionType(rawValue: rawValue) {
+                    compressionType = ct
+                } else {
+                    throw ReadError.unknownCompressionType
+                }
+            case .masterKeySeed:
+                masterKeySeed = try cursor.readBytes(size: size)
+            case .encryptionIv:
+                encryptionIv = try cursor.readBytes(size: size)
+            case .kdfParameters:
+                let parameters = try KdbxVariantDictionary(cursor: DataReadCursor(buffer: try cursor.readSlice(count: size)))
+                kdf = try Kdbx4Header.kdf(parameters: parameters)
+            case .publicCustomData:
+                publicCustomData = try cursor.readBytes(size: size)
+            case .end:
+                try cursor.skip(count: size)
+                break readLoop
+            }
+        } while (true)
+
+        headerBytes = [UInt8](UnsafeRawBufferPointer(rebasing: cursor.buffer[start..<cursor.offset]))
+        headerHash = try cursor.readBytes(size: 32)
+        headerHmac = try cursor.readBytes(size: 32)
+    }
+
+    static func kdf(parameters: KdbxVariantDictionary) throws -> Kdf {
+        guard let uuid = parameters.bytes("$UUID")?.uuid() else {
+            throw ReadError.invalidKdfParameters
+        }
+
+        switch uuid {
+        case KdbxCrypto.aesKdfUUID:
+            guard let seed = parameters.bytes("S"), let rounds = parameters.uint64("R") else {
+                throw ReadError.invalidKdfParameters
+            }
+
+            return .aes(seed: seed, rounds: rounds)
+        case KdbxCrypto.argon2dUUID, KdbxCrypto.argon2idUUID:
+            guard let salt = parameters.bytes("S"),
+                let parallelism = parameters.uint32("P"),
+                let memory = parameters.uint64("M"),
+                let iterations = parameters.uint64("I"),
+                let version = parameters.uint32("V") else {
+                throw ReadError.invalidKdfParameters
+            }
+
+            return .argon2(Argon2Parameters(
+                variant: uuid == KdbxCrypto.argon2dUUID ? .d : .id,
+                salt: salt,
+                parallelism: parallelism,
+                memory: memory,
+                iterations: iterations,
+                version: version
+            ))
+        default:
+            throw ReadError.unknownKdfUuid
+        }
+    }
+
+    static func parameters(kdf: Kdf) -> KdbxVariantDictionary {
+        var parameters = KdbxVariantDictionary()
+
+        switch kdf {
+        case .aes(let seed, let rounds):
+            parameters["$UUID"] = .bytes([UInt8](KdbxCrypto.aesKdfUUID.data))
+            parameters["R"] = .uint64(rounds)
+            parameters["S"] = .bytes(seed)
+        case .argon2(let argon2):
+            let uuid = argon2.variant == .d ? KdbxCrypto.argon2dUUID : KdbxCrypto.argon2idUUID
+
+            parameters["$UUID"] = .bytes([UInt8](uuid.data))
+            parameters["S"] = .bytes(argon2.salt)
+            parameters["P"] = .uint32(argon2.parallelism)
+            parameters["M"] = .uint64(argon2.memory)
+            parameters["I"] = .uint64(argon2.iterations)
+            parameters["V"] = .uint32(argon2.version)
+        }
+
+        return parameters
+    }
+
+    func transform(compositeKey: [UInt8]) throws -> [UInt8] {
+        let hashedCompositeKey = compositeKey.sha256()
+
+        switch kdf {
+        case .aes(let seed, let rounds):
+            // The values come from the file, check them before they are converted
+            guard rounds <= UInt64(Int.max) else {
+                throw ReadError.invalidKdfParameters
+            }
+
+            let transformedCompositeKey = try KdbxCrypto.aesTransform(bytes: seed, key: hashedCompositeKey, rounds: Int(rounds))
+            return transformedCompositeKey.sha256()
+        case .argon2(let parameters):
+            let memoryKiB = parameters.memory / 1024
+
+            guard parameters.iterations <= UInt64(UInt32.max),
+                memoryKiB <= UInt64(KdbxArgon2.maximumMemoryKiB) else {
+                throw ReadError.invalidKdfParameters
+            }
+
+            return try KdbxArgon2.hash(
+                password: hashedCompositeKey,
+                salt: parameters.salt,
+                parallelism: Int(parameters.parallelism),
+                memoryKiB: Int(memoryKiB),
+                iterations: Int(parameters.iterations),
+                version: parameters.version,
+                variant: parameters.variant
+            )
+        }
     }
 }
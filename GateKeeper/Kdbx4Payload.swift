@@ -3,17 +3,100 @@
 //  GateKeeper
 //
 
-import Gzip
+import Foundation
 
 class Kdbx4Payload {
 
+    enum InnerStreamAlgorithm: UInt32 {
+        case salsa20 = 2
+        case chaCha20 = 3
+    }
+
     var database: KdbxXml.KeePassFile
 
     required init(database: KdbxXml.KeePassFile) {
         self.database = database
     }
 
-    convenience init(encryptedBytes: [UInt8], compositeKey: [UInt8], header: Kdbx4Header) throws {
-        fatalError("Not implemented.")
+    convenience init(encryptedBytes: UnsafeRawBufferPointer, compositeKey: [UInt8], header: Kdbx4Header) throws {
+        // Header integrity
+
+        guard header.headerBytes.sha256() == header.headerHash else {
+            throw KdbxError.decryptionFailed
+        }
+
+        // Master key, HMAC key
+
+        let transformedCompositeKey = try header.transform(compositeKey: compositeKey)
+        let masterKey = KdbxSha256.hash(header.masterKeySeed, transformedCompositeKey)
+        let hmacKey = KdbxSha512.hash(header.masterKeySeed, transformedCompositeKey, [0x01])
+
+        let headerHmacKey = KdbxCrypto.hmacBlockKey(index: UInt64.max, hmacKey: hmacKey)
+
+        guard KdbxCrypto.hmacSha256(key: headerHmacKey, bytes: header.headerBytes) == header.headerHmac else {
+            throw KdbxError.decryptionFailed
+        }
+
+        // Decode and parse in fixed-size chunks: HMAC blocks -> decrypt -> decompress -> inner header -> XML -> structs
+
+        weak var completedInnerHeader: KdbxInnerHeaderSink?
+        let structBuilder = KdbxXml.StructBuilder(streamCipherProvider: {
+            // The inner header has been read by the time the XML starts
+            guard let innerHeader = completedInnerHeader else {
+                throw KdbxError.decryptionFailed
+            }
+
+            return try Kdbx4Payload.streamCipher(innerHeader: innerHeader)
+        })
+        let tokenizer = KdbxXmlTokenizer(delegate: structBuilder)
+        let innerHeader = KdbxInnerHeaderSink(next: tokenizer)
+        completedInnerHeader = innerHeader
+
+        let decompressor: KdbxByteSink
+        switch header.compressionType {
+        case .none:
+            decompressor = innerHeader
+        case .gzip:
+            decompressor = try KdbxGunzipSink(next: innerHeader)
+        }
+
+        let decryptor: KdbxByteSink
+        switch header.cipherType {
+        case .aes:
+            decryptor = try KdbxAesCbcSink(operation: .decrypt, key: masterKey, iv: header.encryptionIv, next: decompressor)
+        case .chaCha20:
+            decryptor = KdbxChaCha20Sink(key: masterKey, nonce: header.encryptionIv, next: decompressor)
+        }
+
+        let blockReader = KdbxHmacBlockSink(hmacKey: hmacKey, next: decryptor)
+
+        try blockReader.write(chunked: encryptedBytes)
+        try blockReader.finish()
+
+        var database = structBuilder.database
+
+        // Binaries live in the inner header, referenced by their position
+
+        database.meta.binaries = innerHeader.binaries.enumerated().map { index, binary in
+            return KdbxXml.Binary(id: String(index), compressed: false, content: Data(bytes: binary.bytes).base64EncodedString(), isProtected: binary.isProtected)
+        }
+
+        self.init(database: database)
+    }
+
+    private static func streamCipher(innerHeader: KdbxInnerHeaderSink) throws -> KdbxStreamCipher {
+        switch innerHeader.streamAlgorithm.flatMap({ InnerStreamAlgorithm(rawValue: $0) }) {
+        case .some(.salsa20):
+            let salsaKey = innerHeader.streamKey.sha256()
+            let iv = [0xE8, 0x30, 0x09, 0x4B, 0x97, 0x20, 0x5D, 0x2A] as [UInt8]
+
+            return Salsa20(key: salsaKey, iv: iv)
+        case .some(.chaCha20):
+            let hash = innerHeader.streamKey.sha512()
+
+            return ChaCha20(key: Array(hash[0..<32]), nonce: Array(hash[32..<44]))
+        case .none:
+            throw KdbxError.decryptionFailed
+        }
     }
 }
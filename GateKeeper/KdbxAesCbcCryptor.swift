@@ -0,0 +1,291 @@
+//
+//  KdbxAesCbcCryptor.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// AES-256-CBC a chunk at a time over caller-provided buffers, so a payload
+// never has to be held as input, output and copy at once.
+//
+// Output may be the input buffer itself (in place) while no partial block is
+// buffered: when encrypting whole blocks, or decrypting whole blocks without
+// padding. With padding, decryption holds back the last block until finalize,
+// since that block carries the padding.
+//
+// Decryption of block i only needs ciphertext blocks i and i - 1, so long
+// runs are split into segments decrypted on all cores, each by its own
+// cryptor chained from the ciphertext block before it.
+final class KdbxAesCbcCryptor {
+
+    static let blockSize = kCCBlockSizeAES128
+
+    // Decryption runs of at least this many bytes are split across cores
+    static let parallelThreshold = 1024 * 1024
+    // Decrypting input in chunks this long keeps every run but the last above the threshold
+    static let parallelChunkSize = 4 * parallelThreshold
+
+    let operation: KdbxCrypto.Operation
+    let padding: Bool
+
+    private let key: [UInt8]
+    private let error: KdbxError
+    private var cryptor: CCCryptorRef?
+
+    // Decryption only: the ciphertext block ahead of the next one to decrypt,
+    // and input that has not been decrypted yet
+    private var chain: [UInt8]
+    private var held = [UInt8]()
+
+    init(operation: KdbxCrypto.Operation, key: [UInt8], iv: [UInt8], padding: Bool = true) throws {
+        self.operation = operation
+        self.padding = padding
+        self.key = key
+        self.chain = iv
+        self.error = operation == .encrypt ? .encryptionFailed : .decryptionFailed
+
+        // Decryption handles the padding itself, so it can hold back the last block
+        let options = operation == .encrypt && padding ? UInt32(kCCOptionPKCS7Padding) : 0
+        cryptor = try KdbxAesCbcCryptor.makeCryptor(operation: operation, options: options, key: key, iv: iv, error: error)
+
+        held.reserveCapacity(KdbxAesCbcCryptor.blockSize)
+    }
+
+    deinit {
+        if let cryptor = cryptor {
+            CCCryptorRelease(cryptor)
+        }
+    }
+
+    // The most update can write for `inputLength` more bytes; finalize writes at most one block
+    func outputLength(inputLength: Int) -> Int {
+        switch operation {
+        case .encrypt:
+            return CCCryptorGetOutputLength(cryptor, inputLength, false)
+        case .decrypt:
+            let total = held.count + inputLength
+            return total - keptLength(total: total)
+        }
+    }
+
+    func update(in input: UnsafeRawBufferPointer, out output: UnsafeMutableRawBufferPointer) throws -> Int {
+        switch operation {
+        case .encrypt:
+            var moved = 0
+            let status = CCCryptorUpdate(cryptor, input.baseAddress, input.count, output.baseAddress, output.count, &moved)
+
+            guard status == Int32(kCCSuccess) else {
+                throw error
+            }
+
+            return moved
+        case .decrypt:
+            return try decryptUpdate(in: input, out: output)
+        }
+    }
+
+    func finalize(out output: UnsafeMutableRawBufferPointer) throws -> Int {
+        switch operation {
+        case .encrypt:
+            var moved = 0
+            let status = CCCryptorFinal(cryptor, output.baseAddress, output.count, &moved)
+
+            guard status == Int32(kCCSuccess) else {
+                throw error
+            }
+
+            return moved
+        case .decrypt:
+            return try decryptFinal(out: output)
+        }
+    }
+
+    // MARK: Decryption
+
+    // Input left over after an update: a partial block, or with padding 1...16 bytes
+    private func keptLength(total: Int) -> Int {
+        let blockSize = KdbxAesCbcCryptor.blockSize
+
+        if padding {
+            return total == 0 ? 0 : (total - 1) % blockSize + 1
+        } else {
+            return total % blockSize
+        }
+    }
+
+    private func decryptUpdate(in input: UnsafeRawBufferPointer, out output: UnsafeMutableRawBufferPointer) throws -> Int {
+        let blockSize = KdbxAesCbcCryptor.blockSize
+        let total = held.count + input.count
+        let run = total - keptLength(total: total)
+
+        guard output.count >= run else {
+            throw error
+        }
+
+        var consumed = 0
+        var written = 0
+
+        // A block started by an earlier update is completed from a copy
+        if run > 0 && !held.isEmpty {
+            consumed = blockSize - held.count
+            held.append(contentsOf: UnsafeRawBufferPointer(rebasing: input[0..<consumed]))
+
+            try held.withUnsafeBytes { block in
+                try decryptRun(in: block, out: UnsafeMutableRawBufferPointer(rebasing: output[0..<blockSize]))
+            }
+
+            held.removeAll(keepingCapacity: true)
+            written = blockSize
+        }
+
+        if run > written {
+            let count = run - written
+            try decryptRun(in: UnsafeRawBufferPointer(rebasing: input[consumed..<consumed + count]),
+                           out: UnsafeMutableRawBufferPointer(rebasing: output[written..<written + count]))
+            consumed += count
+            written += count
+        }
+
+        held.append(contentsOf: UnsafeRawBufferPointer(rebasing: input[consumed..<input.count]))
+
+        return written
+    }
+
+    private func decryptFinal(out output: UnsafeMutableRawBufferPointer) throws -> Int {
+        let blockSize = KdbxAesCbcCryptor.blockSize
+
+        guard padding else {
+            guard held.isEmpty else {
+                throw error
+            }
+
+            return 0
+        }
+
+        guard held.count == blockSize else {
+            throw error
+        }
+
+        var block = [UInt8](repeating: 0x0, count: blockSize)
+        try held.withUnsafeBytes { input in
+            try block.withUnsafeMutableBytes { try decryptRun(in: input, out: $0) }
+        }
+        held.removeAll()
+
+        let pad = Int(block[blockSize - 1])
+
+        guard pad >= 1, pad <= blockSize, block[(blockSize - pad)...].first(where: { Int($0) != pad }) == nil else {
+            throw error
+        }
+
+        let count = blockSize - pad
+
+        guard output.count >= count else {
+            throw error
+        }
+
+        for index in 0..<count {
+            output[index] = block[index]
+        }
+
+        return count
+    }
+
+    // Decrypts whole blocks, chaining from `chain`
+    private func decryptRun(in input: UnsafeRawBufferPointer, out output: UnsafeMutableRawBufferPointer) throws {
+        let blockSize = KdbxAesCbcCryptor.blockSize
+
+        // Read before an in-place decryption overwrites it
+        let last = [UInt8](UnsafeRawBufferPointer(rebasing: input[(input.count - blockSize)..<input.count]))
+
+        if input.count >= KdbxAesCbcCryptor.parallelThreshold && !KdbxAesCbcCryptor.overlaps(input, output) {
+            try decryptInParallel(in: input, out: output)
+        } else {
+            var moved = 0
+            guard CCCryptorReset(cryptor, chain) == Int32(kCCSuccess),
+                CCCryptorUpdate(cryptor, input.baseAddress, input.count, output.baseAddress, input.count, &moved) == Int32(kCCSuccess),
+                moved == input.count else {
+                throw error
+            }
+        }
+
+        chain = last
+    }
+
+    private func decryptInParallel(in input: UnsafeRawBufferPointer, out output: UnsafeMutableRawBufferPointer) throws {
+        let blockSize = KdbxAesCbcCryptor.blockSize
+        let blocks = input.count / blockSize
+        let segments = min(ProcessInfo.processInfo.activeProcessorCount, blocks)
+        let segmentLength = (blocks + segments - 1) / segments * blockSize
+
+        let failures = UnsafeMutablePointer<Bool>.allocate(capacity: segments)
+        failures.initialize(to: false, count: segments)
+
+        defer {
+            failures.deinitialize(count: segments)
+            failures.deallocate(capacity: segments)
+        }
+
+        let key = self.key
+        let chain = self.chain
+
+        DispatchQueue.concurrentPerform(iterations: segments) { segment in
+            let start = segment * segmentLength
+            let end = min(start + segmentLength, input.count)
+
+            guard start < end else {
+                return
+            }
+
+            let iv = start == 0 ? chain : [UInt8](UnsafeRawBufferPointer(rebasing: input[(start - blockSize)..<start]))
+
+            do {
+                let cryptor = try KdbxAesCbcCryptor.makeCryptor(operation: .decrypt, options: 0, key: key, iv: iv, error: .decryptionFailed)
+                defer {
+                    CCCryptorRelease(cryptor)
+                }
+
+                var moved = 0
+                let status = CCCryptorUpdate(cryptor, input.baseAddress! + start, end - start, output.baseAddress! + start, end - start, &moved)
+                failures[segment] = status != Int32(kCCSuccess) || moved != end - start
+            } catch {
+                failures[segment] = true
+            }
+        }
+
+        for segment in 0..<segments where failures[segment] {
+            throw error
+        }
+    }
+
+    // MARK: Helpers
+
+    private static func makeCryptor(operation: KdbxCrypto.Operation, options: UInt32, key: [UInt8], iv: [UInt8], error: KdbxError) throws -> CCCryptorRef {
+        var cryptor: CCCryptorRef?
+
+        let status = CCCryptorCreate(
+            operation.cc,
+            UInt32(kCCAlgorithmAES128),
+            options,
+            key,
+            kCCKeySizeAES256,
+            iv,
+            &cryptor
+        )
+
+        guard status == Int32(kCCSuccess), let created = cryptor else {
+            throw error
+        }
+
+        return created
+    }
+
+    private static func overlaps(_ input: UnsafeRawBufferPointer, _ output: UnsafeMutableRawBufferPointer) -> Bool {
+        guard let inputStart = input.baseAddress, let outputStart = output.baseAddress else {
+            return false
+        }
+
+        let outputRaw = UnsafeRawPointer(outputStart)
+        return inputStart < outputRaw + output.count && outputRaw < inputStart + input.count
+    }
+}
@@ -0,0 +1,101 @@
+//
+//  KdbxAesKdf.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// AES-KDF: the 32-byte key is encrypted `rounds` times with AES-256-ECB under
+// the transform seed, one CCCryptorUpdate over both blocks per round. The
+// work is split into batches so progress can be reported and a long
+// transform cancelled.
+final class KdbxAesKdf {
+
+    typealias ProgressHandler = (_ progress: Double) -> Void
+
+    enum KdfError: Error {
+        case cancelled
+        case cryptorFailed
+    }
+
+    private static let keySize = 32
+
+    // Rounds between progress reports and cancellation checks
+    private static let batchRounds = 1 << 15
+
+    private let seed: [UInt8]
+    private let lock = NSLock()
+    private var isCancelledValue = false
+
+    init(seed: [UInt8]) {
+        self.seed = seed
+    }
+
+    var isCancelled: Bool {
+        lock.lock()
+        defer { lock.unlock() }
+
+        return isCancelledValue
+    }
+
+    func cancel() {
+        lock.lock()
+        defer { lock.unlock() }
+
+        isCancelledValue = true
+    }
+
+    // The progress handler is called on the calling thread
+    func transform(key: [UInt8], rounds: Int, progress: ProgressHandler? = nil) throws -> [UInt8] {
+        precondition(key.count == KdbxAesKdf.keySize)
+
+        var cryptor: CCCryptorRef?
+
+        let status = CCCryptorCreate(
+            UInt32(kCCEncrypt),
+            UInt32(kCCAlgorithmAES128),
+            UInt32(kCCOptionECBMode),
+            seed,
+            kCCKeySizeAES256,
+            nil,
+            &cryptor
+        )
+
+        guard status == Int32(kCCSuccess) else {
+            throw KdfError.cryptorFailed
+        }
+
+        let state = UnsafeMutablePointer<UInt8>.allocate(capacity: key.count)
+        state.initialize(from: key, count: key.count)
+
+        defer {
+            CCCryptorRelease(cryptor)
+            memset(state, 0, key.count)
+            state.deallocate(capacity: key.count)
+        }
+
+        var remaining = rounds
+        var moved = 0
+
+        while remaining > 0 {
+            guard !isCancelled else {
+                throw KdfError.cancelled
+            }
+
+            let batch = min(remaining, KdbxAesKdf.batchRounds)
+
+            for _ in 0..<batch {
+                let status = CCCryptorUpdate(cryptor, state, KdbxAesKdf.keySize, state, KdbxAesKdf.keySize, &moved)
+
+                guard status == Int32(kCCSuccess) else {
+                    throw KdfError.cryptorFailed
+                }
+            }
+
+            remaining -= batch
+            progress?(Double(rounds - remaining) / Double(rounds))
+        }
+
+        return [UInt8](UnsafeBufferPointer(start: state, count: key.count))
+    }
+}
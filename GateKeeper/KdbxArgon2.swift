@@ -0,0 +1,480 @@
+//
+//  KdbxArgon2.swift
+//  GateKeeper
+//
+
+import Foundation
+
+final class Blake2b {
+
+    private static let iv: [UInt64] = [
+        0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+        0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179
+    ]
+
+    private static let sigma: [[Int]] = [
+        [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15],
+        [14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3],
+        [11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4],
+        [7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8],
+        [9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13],
+        [2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9],
+        [12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11],
+        [13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10],
+        [6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5],
+        [10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0],
+        [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15],
+        [14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3]
+    ]
+
+    let outputLength: Int
+    private var h: [UInt64]
+    private var counter = UInt64(0)
+    private var buffer = [UInt8](repeating: 0x0, count: 128)
+    private var bufferCount = 0
+
+    init(outputLength: Int) {
+        precondition(outputLength > 0 && outputLength <= 64)
+
+        self.outputLength = outputLength
+        h = Blake2b.iv
+        h[0] ^= 0x01010000 ^ UInt64(outputLength)
+    }
+
+    static func hash(_ bytes: [UInt8], outputLength: Int) -> [UInt8] {
+        let blake2b = Blake2b(outputLength: outputLength)
+        blake2b.update(bytes)
+        return blake2b.finalize()
+    }
+
+    func update(_ bytes: [UInt8]) {
+        bytes.withUnsafeBytes { update($0) }
+    }
+
+    func update(_ value: UInt32) {
+        update([UInt8](value.littleEndianBytes))
+    }
+
+    func update(_ bytes: UnsafeRawBufferPointer) {
+        var offset = 0
+
+        while offset < bytes.count {
+            // The last block is compressed by finalize(), so only flush once more input arrives
+            if bufferCount == 128 {
+                counter = counter &+ 128
+                compress(isFinal: false)
+                bufferCount = 0
+            }
+
+            let count = min(128 - bufferCount, bytes.count - offset)
+            for i in 0..<count {
+                buffer[bufferCount + i] = bytes[offset + i]
+            }
+
+            bufferCount += count
+            offset += count
+        }
+    }
+
+    func finalize() -> [UInt8] {
+        counter = counter &+ UInt64(bufferCount)
+
+        for i in bufferCount..<128 {
+            buffer[i] = 0
+        }
+
+        compress(isFinal: true)
+
+        var output = [UInt8]()
+        output.reserveCapacity(64)
+        for word in h {
+            output.append(contentsOf: word.littleEndianBytes)
+        }
+
+        return Array(output.prefix(outputLength))
+    }
+
+    private func compress(isFinal: Bool) {
+        var m = [UInt64](repeating: 0, count: 16)
+        for i in 0..<16 {
+            var word = UInt64(0)
+            for j in 0..<8 {
+                word |= UInt64(buffer[i * 8 + j]) << UInt64(j * 8)
+            }
+            m[i] = word
+        }
+
+        var v = h + Blake2b.iv
+        v[12] ^= counter
+        if isFinal {
+            v[14] = ~v[14]
+        }
+
+        for round in 0..<12 {
+            let s = Blake2b.sigma[round]
+
+            Blake2b.g(&v, 0, 4, 8, 12, m[s[0]], m[s[1]])
+            Blake2b.g(&v, 1, 5, 9, 13, m[s[2]], m[s[3]])
+            Blake2b.g(&v, 2, 6, 10, 14, m[s[4]], m[s[5]])
+            Blake2b.g(&v, 3, 7, 11, 15, m[s[6]], m[s[7]])
+            Blake2b.g(&v, 0, 5, 10, 15, m[s[8]], m[s[9]])
+            Blake2b.g(&v, 1, 6, 11, 12, m[s[10]], m[s[11]])
+            Blake2b.g(&v, 2, 7, 8, 13, m[s[12]], m[s[13]])
+            Blake2b.g(&v, 3, 4, 9, 14, m[s[14]], m[s[15]])
+        }
+
+        for i in 0..<8 {
+            h[i] ^= v[i] ^ v[i + 8]
+        }
+    }
+
+    private static func g(_ v: inout [UInt64], _ a: Int, _ b: Int, _ c: Int, _ d: Int, _ x: UInt64, _ y: UInt64) {
+        v[a] = v[a] &+ v[b] &+ x
+        v[d] = rotate(v[d] ^ v[a], 32)
+        v[c] = v[c] &+ v[d]
+        v[b] = rotate(v[b] ^ v[c], 24)
+        v[a] = v[a] &+ v[b] &+ y
+        v[d] = rotate(v[d] ^ v[a], 16)
+        v[c] = v[c] &+ v[d]
+        v[b] = rotate(v[b] ^ v[c], 63)
+    }
+
+    @inline(__always) static func rotate(_ v: UInt64, _ c: UInt64) -> UInt64 {
+        return (v >> c) | (v << (64 - c))
+    }
+}
+
+// Argon2 (RFC 9106) as used by the KDBX 4 key derivation. Each pass is split
+// into four slices; within a slice every lane only references blocks from
+// earlier slices or from itself, so the lanes of a slice are filled in
+// parallel and joined before the next slice starts.
+final class KdbxArgon2 {
+
+    enum Variant: UInt32 {
+        case d = 0
+        case id = 2
+    }
+
+    enum Argon2Error: Error {
+        case invalidParameters
+    }
+
+    static let version10: UInt32 = 0x10
+    static let version13: UInt32 = 0x13
+
+    // 1 GiB. A file can ask for far more, which a device could never allocate
+    static let maximumMemoryKiB = 1 << 20
+
+    private static let blockWords = 128
+    private static let blockSize = 1024
+    private static let syncPoints = 4
+
+    private let variant: Variant
+    private let version: UInt32
+    private let lanes: Int
+    private let passes: Int
+    private let laneLength: Int
+    private let segmentLength: Int
+    private let memoryBlocks: Int
+    private let memory: UnsafeMutablePointer<UInt64>
+
+    private init(variant: Variant, version: UInt32, lanes: Int, passes: Int, memoryKiB: Int) {
+        self.variant = variant
+        self.version = version
+        self.lanes = lanes
+        self.passes = passes
+
+        let minimumBlocks = 2 * KdbxArgon2.syncPoints * lanes
+        let blocks = max(memoryKiB, minimumBlocks)
+
+        segmentLength = blocks / (lanes * KdbxArgon2.syncPoints)
+        laneLength = segmentLength * KdbxArgon2.syncPoints
+        memoryBlocks = laneLength * lanes
+
+        memory = UnsafeMutablePointer<UInt64>.allocate(capacity: memoryBlocks * KdbxArgon2.blockWords)
+        memory.initialize(to: 0, count: memoryBlocks * KdbxArgon2.blockWords)
+    }
+
+    deinit {
+        // Wipe before releasing, the blocks are derived from the key
+        memset(memory, 0, memoryBlocks * KdbxArgon2.blockSize)
+        memory.deallocate(capacity: memoryBlocks * KdbxArgon2.blockWords)
+    }
+
+    static func hash(password: [UInt8], salt: [UInt8], parallelism: Int, memoryKiB: Int, iterations: Int, version: UInt32, variant: Variant,
+                     secret: [UInt8] = [], associatedData: [UInt8] = [], outputLength: Int = 32) throws -> [UInt8] {
+        guard parallelism >= 1 && parallelism <= 0xFFFFFF,
+            iterations >= 1 && iterations <= Int(UInt32.max),
+            memoryKiB >= 8 * parallelism && memoryKiB <= maximumMemoryKiB,
+            outputLength >= 4,
+            salt.count >= 8,
+            version == version10 || version == version13 else {
+            throw Argon2Error.invalidParameters
+        }
+
+
+        let argon2 = KdbxArgon2(variant: variant, version: version, lanes: parallelism, passes: iterations, memoryKiB: memoryKiB)
+
+        // H0
+
+        let blake2b = Blake2b(outputLength: 64)
+        blake2b.update(UInt32(parallelism))
+        blake2b.update(UInt32(outputLength))
+        blake2b.update(UInt32(memoryKiB))
+        blake2b.update(UInt32(iterations))
+        blake2b.update(version)
+        blake2b.update(variant.rawValue)
+        for input in [password, salt, secret, associatedData] {
+            blake2b.update(UInt32(input.count))
+            blake2b.update(input)
+        }
+        let h0 = blake2b.finalize()
+
+        argon2.initialize(h0: h0)
+        argon2.fill()
+
+
+        return argon2.finalize(outputLength: outputLength)
+    }
+
+    // MARK: Variable-length hash
+
+    static func hashLong(_ input: [UInt8], outputLength: Int) -> [UInt8] {
+        let lengthPrefix = [UInt8](UInt32(outputLength).littleEndianBytes)
+
+        if outputLength <= 64 {
+            return Blake2b.hash(lengthPrefix + input, outputLength: outputLength)
+        }
+
+        var output = [UInt8]()
+        output.reserveCapacity(outputLength)
+
+        var v = Blake2b.hash(lengthPrefix + input, outputLength: 64)
+        output.append(contentsOf: v.prefix(32))
+
+        while outputLength - output.count > 64 {
+            v = Blake2b.hash(v, outputLength: 64)
+            output.append(contentsOf: v.prefix(32))
+        }
+
+        output.append(contentsOf: Blake2b.hash(v, outputLength: outputLength - output.count))
+
+        return output
+    }
+
+    // MARK: Memory
+
+    private func block(_ index: Int) -> UnsafeMutablePointer<UInt64> {
+        return memory + index * KdbxArgon2.blockWords
+    }
+
+    private func initialize(h0: [UInt8]) {
+        for lane in 0..<lanes {
+            for i in 0..<2 {
+                let bytes = KdbxArgon2.hashLong(h0 + UInt32(i).littleEndianBytes + UInt32(lane).littleEndianBytes, outputLength: KdbxArgon2.blockSize)
+                let target = block(lane * laneLength + i)
+
+                for word in 0..<KdbxArgon2.blockWords {
+                    var value = UInt64(0)
+                    for j in 0..<8 {
+                        value |= UInt64(bytes[word * 8 + j]) << UInt64(j * 8)
+                    }
+                    target[word] = value
+                }
+            }
+        }
+    }
+
+    private func fill() {
+        for pass in 0..<passes {
+            for slice in 0..<KdbxArgon2.syncPoints {
+                DispatchQueue.concurrentPerform(iterations: lanes) { lane in
+                    fillSegment(pass: pass, lane: lane, slice: slice)
+                }
+            }
+        }
+    }
+
+    private func finalize(outputLength: Int) -> [UInt8] {
+        var final = [UInt64](repeating: 0, count: KdbxArgon2.blockWords)
+
+        for lane in 0..<lanes {
+            let last = block(lane * laneLength + laneLength - 1)
+            for word in 0..<KdbxArgon2.blockWords {
+                final[word] ^= last[word]
+            }
+        }
+
+        var bytes = [UInt8]()
+        bytes.reserveCapacity(KdbxArgon2.blockSize)
+        for word in final {
+            bytes.append(contentsOf: word.littleEndianBytes)
+        }
+
+        return KdbxArgon2.hashLong(bytes, outputLength: outputLength)
+    }
+
+    private func fillSegment(pass: Int, lane: Int, slice: Int) {
+        // Per-segment scratch: two blocks for the compression function, three for address generation
+        let scratch = UnsafeMutablePointer<UInt64>.allocate(capacity: 5 * KdbxArgon2.blockWords)
+        scratch.initialize(to: 0, count: 5 * KdbxArgon2.blockWords)
+        defer {
+            scratch.deallocate(capacity: 5 * KdbxArgon2.blockWords)
+        }
+
+        let r = scratch
+        let t = scratch + KdbxArgon2.blockWords
+        let zeroBlock = scratch + 2 * KdbxArgon2.blockWords
+        let inputBlock = scratch + 3 * KdbxArgon2.blockWords
+        let addressBlock = scratch + 4 * KdbxArgon2.blockWords
+
+        let isDataIndependent = variant == .id && pass == 0 && slice < KdbxArgon2.syncPoints / 2
+
+        if isDataIndependent {
+            inputBlock[0] = UInt64(pass)
+            inputBlock[1] = UInt64(lane)
+            inputBlock[2] = UInt64(slice)
+            inputBlock[3] = UInt64(memoryBlocks)
+            inputBlock[4] = UInt64(passes)
+            inputBlock[5] = UInt64(variant.rawValue)
+        }
+
+        var startingIndex = 0
+        if pass == 0 && slice == 0 {
+            startingIndex = 2
+
+            if isDataIndependent {
+                nextAddresses(addressBlock: addressBlock, inputBlock: inputBlock, zeroBlock: zeroBlock, r: r, t: t)
+            }
+        }
+
+        var currentOffset = lane * laneLength + slice * segmentLength + startingIndex
+        var previousOffset = currentOffset % laneLength == 0 ? currentOffset + laneLength - 1 : currentOffset - 1
+
+        for index in startingIndex..<segmentLength {
+            if currentOffset % laneLength == 1 {
+                previousOffset = currentOffset - 1
+            }
+
+            let pseudoRandom: UInt64
+            if isDataIndependent {
+                if index % KdbxArgon2.blockWords == 0 {
+                    nextAddresses(addressBlock: addressBlock, inputBlock: inputBlock, zeroBlock: zeroBlock, r: r, t: t)
+                }
+                pseudoRandom = addressBlock[index % KdbxArgon2.blockWords]
+            } else {
+                pseudoRandom = block(previousOffset)[0]
+            }
+
+            var referenceLane = Int((pseudoRandom >> 32) % UInt64(lanes))
+            if pass == 0 && slice == 0 {
+                referenceLane = lane
+            }
+
+            let referenceIndex = indexAlpha(pass: pass, slice: slice, index: index, pseudoRandom: pseudoRandom & 0xFFFFFFFF, isSameLane: referenceLane == lane)
+
+            let withXor = version != KdbxArgon2.version10 && pass != 0
+            KdbxArgon2.fillBlock(
+                previous: block(previousOffset),
+                reference: block(referenceLane * laneLength + referenceIndex),
+                next: block(currentOffset),
+                withXor: withXor,
+                r: r,
+                t: t
+            )
+
+            currentOffset += 1
+            previousOffset += 1
+        }
+    }
+
+    private func indexAlpha(pass: Int, slice: Int, index: Int, pseudoRandom: UInt64, isSameLane: Bool) -> Int {
+        let referenceAreaSize: Int
+        if pass == 0 {
+            if slice == 0 {
+                referenceAreaSize = index - 1
+            } else if isSameLane {
+                referenceAreaSize = slice * segmentLength + index - 1
+            } else {
+                referenceAreaSize = slice * segmentLength + (index == 0 ? -1 : 0)
+            }
+        } else {
+            if isSameLane {
+                referenceAreaSize = laneLength - segmentLength + index - 1
+            } else {
+                referenceAreaSize = laneLength - segmentLength + (index == 0 ? -1 : 0)
+            }
+        }
+
+        var relativePosition = pseudoRandom
+        relativePosition = (relativePosition &* relativePosition) >> 32
+        relativePosition = UInt64(referenceAreaSize - 1) &- ((UInt64(referenceAreaSize) &* relativePosition) >> 32)
+
+        var startPosition = 0
+        if pass != 0 {
+            startPosition = slice == KdbxArgon2.syncPoints - 1 ? 0 : (slice + 1) * segmentLength
+        }
+
+        return Int((UInt64(startPosition) &+ relativePosition) % UInt64(laneLength))
+    }
+
+    private func nextAddresses(addressBlock: UnsafeMutablePointer<UInt64>, inputBlock: UnsafeMutablePointer<UInt64>, zeroBlock: UnsafeMutablePointer<UInt64>,
+                               r: UnsafeMutablePointer<UInt64>, t: UnsafeMutablePointer<UInt64>) {
+        inputBlock[6] = inputBlock[6] &+ 1
+        KdbxArgon2.fillBlock(previous: zeroBlock, reference: inputBlock, next: addressBlock, withXor: false, r: r, t: t)
+        KdbxArgon2.fillBlock(previous: zeroBlock, reference: addressBlock, next: addressBlock, withXor: false, r: r, t: t)
+    }
+
+    // MARK: Compression function
+
+    private static func fillBlock(previous: UnsafeMutablePointer<UInt64>, reference: UnsafeMutablePointer<UInt64>, next: UnsafeMutablePointer<UInt64>,
+                                  withXor: Bool, r: UnsafeMutablePointer<UInt64>, t: UnsafeMutablePointer<UInt64>) {
+        for i in 0..<blockWords {
+            r[i] = previous[i] ^ reference[i]
+            t[i] = withXor ? r[i] ^ next[i] : r[i]
+        }
+
+        for i in 0..<8 {
+            let b = 16 * i
+            round(r, b, b + 1, b + 2, b + 3, b + 4, b + 5, b + 6, b + 7, b + 8, b + 9, b + 10, b + 11, b + 12, b + 13, b + 14, b + 15)
+        }
+
+        for i in 0..<8 {
+            let b = 2 * i
+            round(r, b, b + 1, b + 16, b + 17, b + 32, b + 33, b + 48, b + 49, b + 64, b + 65, b + 80, b + 81, b + 96, b + 97, b + 112, b + 113)
+        }
+
+        for i in 0..<blockWords {
+            next[i] = t[i] ^ r[i]
+        }
+    }
+
+    @inline(__always) private static func round(_ v: UnsafeMutablePointer<UInt64>,
+                                                _ v0: Int, _ v1: Int, _ v2: Int, _ v3: Int, _ v4: Int, _ v5: Int, _ v6: Int, _ v7: Int,
+                                                _ v8: Int, _ v9: Int, _ v10: Int, _ v11: Int, _ v12: Int, _ v13: Int, _ v14: Int, _ v15: Int) {
+        g(v, v0, v4, v8, v12)
+        g(v, v1, v5, v9, v13)
+        g(v, v2, v6, v10, v14)
+        g(v, v3, v7, v11, v15)
+        g(v, v0, v5, v10, v15)
+        g(v, v1, v6, v11, v12)
+        g(v, v2, v7, v8, v13)
+        g(v, v3, v4, v9, v14)
+    }
+
+    @inline(__always) private static func g(_ v: UnsafeMutablePointer<UInt64>, _ a: Int, _ b: Int, _ c: Int, _ d: Int) {
+        v[a] = blaMka(v[a], v[b])
+        v[d] = Blake2b.rotate(v[d] ^ v[a], 32)
+        v[c] = blaMka(v[c], v[d])
+        v[b] = Blake2b.rotate(v[b] ^ v[c], 24)
+        v[a] = blaMka(v[a], v[b])
+        v[d] = Blake2b.rotate(v[d] ^ v[a], 16)
+        v[c] = blaMka(v[c], v[d])
+        v[b] = Blake2b.rotate(v[b] ^ v[c], 63)
+    }
+
+    @inline(__always) private static func blaMka(_ x: UInt64, _ y: UInt64) -> UInt64 {
+        let mask = UInt64(0xFFFFFFFF)
+        return x &+ y &+ 2 &* ((x & mask) &* (y & mask))
+    }
+}
@@ -8,6 +8,11 @@ import Foundation
 class KdbxCrypto {
 
     public static let aesUUID = UUID(uuidString: "31C1F2E6-BF71-4350-BE58-05216AFC5AFF")!
+    public static let chaCha20UUID = UUID(uuidString: "D6038A2B-8B6F-4CB5-A524-339A31DBB59A")!
+
+    public static let aesKdfUUID = UUID(uuidString: "C9D9F39A-628A-4460-BF74-0D08C18A4FEA")!
+    public static let argon2dUUID = UUID(uuidString: "EF636DDF-8C29-444B-91F7-A9A403E30A0C")!
+    public static let argon2idUUID = UUID(uuidString: "9E298B19-56DB-4773-B23D-FC3EC6F0A1E6")!
 
     enum Operation: UInt32 {
         case decrypt
@@ -27,68 +32,19 @@ class KdbxCrypto {
         case dataError
     }
 
-    static func aes(operation: Operation, bytes: [UInt8], key: [UInt8], iv: [UInt8]) throws -> [UInt8] {
-        var buffer = [UInt8](repeating: 0x0, count: bytes.count + kCCBlockSizeAES128)
-
-        print("aes: \(operation) \(bytes.count) bytes")
-
-        var cryptoCount = 0
-        let status = CCCrypt(
-            operation.cc,
-            UInt32(kCCAlgorithmAES128),
-            UInt32(kCCOptionPKCS7Padding),
-            key,
-            kCCKeySizeAES256,
-            iv,
-            bytes,
-            bytes.count,
-            &buffer,
-            buffer.count,
-            &cryptoCount
-        )
+    static func hmacSha256(key: [UInt8], bytes: [UInt8]) -> [UInt8] {
+        var hmac = [UInt8](repeating: 0x0, count: Int(CC_SHA256_DIGEST_LENGTH))
+        CCHmac(UInt32(kCCHmacAlgSHA256), key, key.count, bytes, bytes.count, &hmac)
 
-        guard status == Int32(kCCSuccess) else {
-            switch operation {
-            case .decrypt:
-                throw KdbxError.decryptionFailed
-            case .encrypt:
-                throw KdbxError.encryptionFailed
-            }
-        }
-
-        let output = Array(buffer.prefix(cryptoCount))
-        print("aes: \(operation) output \(output.count) bytes")
+        return hmac
+    }
 
-        return output
+    // KDBX 4 derives a separate HMAC key for every block, and for the header (index UInt64.max)
+    static func hmacBlockKey(index: UInt64, hmacKey: [UInt8]) -> [UInt8] {
+        return KdbxSha512.hash(index.littleEndianBytes, hmacKey)
     }
 
     static func aesTransform(bytes: [UInt8], key: [UInt8], rounds: Int) throws -> [UInt8] {
-        let cryptor = UnsafeMutablePointer<CCCryptorRef?>.allocate(capacity: 1)
-
-        CCCryptorCreate(
-            UInt32(kCCEncrypt),
-            UInt32(kCCAlgorithmAES128),
-            UInt32(kCCOptionECBMode),
-            bytes,
-            kCCKeySizeAES256,
-            nil,
-            cryptor
-        )
-
-        var transformedKey = key
-
-        print("aesTransform: \(rounds) rounds")
-
-        for _ in 0..<rounds {
-            let status = CCCryptorUpdate(cryptor.pointee, transformedKey, transformedKey.count, &transformedKey, transformedKey.count, nil)
-
-            guard status == Int32(kCCSuccess) else {
-                throw CryptoError.dataError
-            }
-        }
-
-        print("aesTransform: complete")
-
-        return transformedKey
+        return try KdbxAesKdf(seed: bytes).transform(key: key, rounds: rounds)
     }
 }
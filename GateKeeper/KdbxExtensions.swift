@@ -30,14 +30,11 @@ extension Array where Iterator.Element == UInt8 {
     }
 
     func sha256() -> [UInt8] {
-        let bytes = [UInt8](self)
-
-        let digestLength = Int(CC_SHA256_DIGEST_LENGTH)
-
-        var hash = [UInt8](repeating: 0x0, count: digestLength)
-        CC_SHA256(bytes, UInt32(bytes.count), &hash)
+        return KdbxSha256.hash(self)
+    }
 
-        return hash
+    func sha512() -> [UInt8] {
+        return KdbxSha512.hash(self)
     }
 
     func uuid() -> UUID? {
@@ -50,6 +47,16 @@ extension Array where Iterator.Element == UInt8 {
     }
 }
 
+extension UnsafeRawBufferPointer {
+
+    func sha256() -> [UInt8] {
+        var sha = KdbxSha256()
+        sha.update(self)
+
+        return sha.finalize()
+    }
+}
+
 extension Date {
 
     var xmlString: String {
@@ -57,6 +64,20 @@ extension Date {
 
         return xmlDateFormatter.to(date: self)
     }
+
+    func xmlString(format: KdbxXml.XmlDateFormatter.Format) -> String {
+        let xmlDateFormatter = KdbxXml.XmlDateFormatter.sharedInstance
+
+        return xmlDateFormatter.to(date: self, format: format)
+    }
+}
+
+extension FixedWidthInteger {
+
+    var littleEndianBytes: [UInt8] {
+        var value = littleEndian
+        return withUnsafeBytes(of: &value) { [UInt8]($0) }
+    }
 }
 
 extension Int {
@@ -66,6 +87,18 @@ extension Int {
     }
 }
 
+// 0xFF marks invalid characters, 0xFE the padding character
+private let base64DecodeTable: [UInt8] = {
+    var table = [UInt8](repeating: 0xFF, count: 256)
+
+    for (index, character) in "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/".utf8.enumerated() {
+        table[Int(character)] = UInt8(index)
+    }
+    table[Int(UInt8(ascii: "="))] = 0xFE
+
+    return table
+}()
+
 extension String {
 
     func base64Decoded() -> [UInt8]? {
@@ -75,15 +108,64 @@ extension String {
         return nil
     }
 
-    func sha256() -> [UInt8] {
-        let bytes = [UInt8](self.utf8)
+    // Decodes straight into the end of `bytes`, returning false (with `bytes`
+    // unchanged) when the string is not valid padded base64
+    func base64Decode(appendingTo bytes: inout [UInt8]) -> Bool {
+        let start = bytes.count
+        var accumulator = UInt32(0)
+        var count = 0
+        var padding = 0
+
+        for character in utf8 {
+            let value = base64DecodeTable[Int(character)]
+
+            if value == 0xFF {
+                bytes.removeSubrange(start..<bytes.count)
+                return false
+            }
+
+            if value == 0xFE {
+                padding += 1
+            } else if padding > 0 {
+                bytes.removeSubrange(start..<bytes.count)
+                return false
+            }
+
+            accumulator = accumulator << 6 | UInt32(padding > 0 ? 0 : value)
+            count += 1
+
+            if count == 4 {
+                bytes.append(UInt8(truncatingIfNeeded: accumulator >> 16))
+                if padding < 2 {
+                    bytes.append(UInt8(truncatingIfNeeded: accumulator >> 8))
+                }
+                if padding < 1 {
+                    bytes.append(UInt8(truncatingIfNeeded: accumulator))
+                }
+
+                accumulator = 0
+                count = 0
+            }
+        }
+
+        guard count == 0 && padding <= 2 else {
+            bytes.removeSubrange(start..<bytes.count)
+            return false
+        }
 
-        let digestLength = Int(CC_SHA256_DIGEST_LENGTH)
+        return true
+    }
 
-        var hash = [UInt8](repeating: 0x0, count: digestLength)
-        CC_SHA256(bytes, UInt32(bytes.count), &hash)
+    func sha256() -> [UInt8] {
+        let count = utf8.count
+        var sha = KdbxSha256()
+
+        // Hashes the UTF-8 in place rather than copying it into an array
+        withCString { cString in
+            sha.update(UnsafeRawBufferPointer(start: cString, count: count))
+        }
 
-        return hash
+        return sha.finalize()
     }
 
     var xmlBool: Bool {
@@ -0,0 +1,307 @@
+//
+//  KdbxFuzzyMatcher.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Scores case-folded UTF-8 fields against a query. Higher is better:
+//   prefix > substring at a word start > substring inside a word > subsequence
+// Urls are matched against their host first, so "amaz" finds
+// https://www.amazon.com before a note that mentions amazon.
+struct KdbxFuzzyMatcher {
+
+    struct Match {
+        let entry: KdbxXml.Entry
+        let attribute: KdbxEntrySearchAttribute
+        let score: Int
+    }
+
+    struct Candidate {
+        let uuid: UUID
+        let attribute: KdbxEntrySearchAttribute
+        let score: Int
+    }
+
+    private static let www = Array("www.".utf8)
+
+    let query: [UInt8]
+
+    init?(query: String) {
+        self.query = KdbxFuzzyMatcher.fold(query)
+
+        if self.query.isEmpty {
+            return nil
+        }
+    }
+
+    static func fold(_ string: String) -> [UInt8] {
+        return Array(string.lowercased(with: .current).utf8)
+    }
+
+    // Ties between attributes go to the field a user most likely typed from
+    static func weight(attribute: KdbxEntrySearchAttribute) -> Int {
+        switch attribute {
+        case .title:
+            return 40
+        case .url:
+            return 30
+        case .username:
+            return 20
+        case .notes:
+            return 0
+        }
+    }
+
+    func score(field: [UInt8], attribute: KdbxEntrySearchAttribute) -> Int? {
+        let score: Int?
+
+        switch attribute {
+        case .url:
+            score = self.score(url: field)
+        case .notes:
+            // Long free text contains almost any subsequence
+            score = self.score(field: field, allowSubsequence: false)
+        case .title, .username:
+            score = self.score(field: field, allowSubsequence: true)
+        }
+
+        return score.map { $0 + KdbxFuzzyMatcher.weight(attribute: attribute) }
+    }
+
+    func score(field: [UInt8], allowSubsequence: Bool) -> Int? {
+        guard field.count >= query.count else {
+            return nil
+        }
+
+        return field.withUnsafeBufferPointer { haystack -> Int? in
+            if let position = firstOccurrence(in: haystack, from: 0, to: haystack.count) {
+                if position == 0 {
+                    // Shorter fields are closer to an exact match
+                    return 1000 - min(field.count - query.count, 99)
+                }
+
+                var boundary: Int? = KdbxFuzzyMatcher.isWordStart(haystack, position) ? position : nil
+                var next = position + 1
+
+                while boundary == nil, let found = firstOccurrence(in: haystack, from: next, to: haystack.count) {
+                    if KdbxFuzzyMatcher.isWordStart(haystack, found) {
+                        boundary = found
+                    }
+                    next = found + 1
+                }
+
+                if let boundary = boundary {
+                    return 800 - min(boundary, 99)
+                }
+                return 600 - min(position, 99)
+            }
+
+            return allowSubsequence ? subsequenceScore(in: haystack) : nil
+        }
+    }
+
+    func score(url: [UInt8]) -> Int? {
+        let host = KdbxFuzzyMatcher.host(url: url)
+
+        if !host.isEmpty {
+            let hostScore = url.withUnsafeBufferPointer { haystack -> Int? in
+                guard let position = firstOccurrence(in: haystack, from: host.lowerBound, to: host.upperBound) else {
+                    return nil
+                }
+
+                if position == host.lowerBound {
+                    return 950
+                }
+                if haystack[position - 1] == UInt8(ascii: ".") {
+                    return 850
+                }
+                return 650
+            }
+
+            if let hostScore = hostScore {
+                return hostScore
+            }
+        }
+
+        return score(field: url, allowSubsequence: false).map { min($0, 600) }
+    }
+
+    // MARK: Byte scanning
+
+    // memchr finds each candidate first byte with the C library's vectorized scan
+    private func firstOccurrence(in haystack: UnsafeBufferPointer<UInt8>, from start: Int, to end: Int) -> Int? {
+        guard let base = haystack.baseAddress else {
+            return nil
+        }
+
+        let first = Int32(query[0])
+        var position = start
+
+        while end - position >= query.count {
+            guard let found = memchr(base + position, first, end - position - query.count + 1) else {
+                return nil
+            }
+
+            let index = UnsafeRawPointer(base).distance(to: UnsafeRawPointer(found))
+            let matches = query.withUnsafeBufferPointer { needle in
+                return memcmp(base + index + 1, needle.baseAddress! + 1, query.count - 1) == 0
+            }
+
+            if matches {
+                return index
+            }
+            position = index + 1
+        }
+
+        return nil
+    }
+
+    // Greedy left to right; matches at word starts and in runs score higher, gaps lower
+    private func subsequenceScore(in haystack: UnsafeBufferPointer<UInt8>) -> Int? {
+        guard let base = haystack.baseAddress else {
+            return nil
+        }
+
+        var score = 300
+        var position = 0
+        var previous = -2
+
+        for byte in query {
+            guard position < haystack.count, let found = memchr(base + position, Int32(byte), haystack.count - position) else {
+                return nil
+            }
+
+            let index = UnsafeRawPointer(base).distance(to: UnsafeRawPointer(found))
+
+            if index == previous + 1 {
+                score += 8
+            } else if KdbxFuzzyMatcher.isWordStart(haystack, index) {
+                score += 12
+            } else {
+                score -= min(index - previous, 20)
+            }
+
+            previous = index
+            position = index + 1
+        }
+
+        return max(1, min(score, 590))
+    }
+
+    private static func isWordStart(_ haystack: UnsafeBufferPointer<UInt8>, _ index: Int) -> Bool {
+        return index == 0 || !isWordByte(haystack[index - 1])
+    }
+
+    // Bytes of non-ASCII characters count as part of a word
+    private static func isWordByte(_ byte: UInt8) -> Bool {
+        switch byte {
+        case UInt8(ascii: "a")...UInt8(ascii: "z"), UInt8(ascii: "0")...UInt8(ascii: "9"), 0x80...0xFF:
+            return true
+        default:
+            return false
+        }
+    }
+
+    // The host of a url, without a leading "www."; empty when there is none
+    static func host(url: [UInt8]) -> CountableRange<Int> {
+        var start = 0
+
+        if let colon = url.index(of: UInt8(ascii: ":")), url.count > colon + 2,
+            url[colon + 1] == UInt8(ascii: "/"), url[colon + 2] == UInt8(ascii: "/") {
+            start = colon + 3
+        }
+
+        let www = KdbxFuzzyMatcher.www
+        if url.count >= start + www.count, Array(url[start..<start + www.count]) == www {
+            start += www.count
+        }
+
+        var end = start
+        while end < url.count {
+            switch url[end] {
+            case UInt8(ascii: "/"), UInt8(ascii: ":"), UInt8(ascii: "?"), UInt8(ascii: "#"), UInt8(ascii: "@"):
+                return start..<end
+            default:
+                end += 1
+            }
+        }
+
+        return start..<end
+    }
+}
+
+// The best `limit` candidates, kept in a min-heap so the full set is never
+// sorted. Equal scores are decided by document order, so which of several
+// tied candidates survive the cutoff does not depend on hashing order.
+struct KdbxTopCandidates {
+
+    let limit: Int
+    private let precedes: (UUID, UUID) -> Bool
+    private(set) var heap = [KdbxFuzzyMatcher.Candidate]()
+
+    // `precedes` tells whether the first entry comes before the second in the document
+    init(limit: Int, precedes: @escaping (UUID, UUID) -> Bool) {
+        self.limit = limit
+        self.precedes = precedes
+    }
+
+    // Best first
+    var sorted: [KdbxFuzzyMatcher.Candidate] {
+        return heap.sorted { ranksBelow($1, $0) }
+    }
+
+    mutating func insert(_ candidate: KdbxFuzzyMatcher.Candidate) {
+        guard limit > 0 else {
+            return
+        }
+
+        if heap.count < limit {
+            heap.append(candidate)
+            siftUp(heap.count - 1)
+        } else if ranksBelow(heap[0], candidate) {
+            heap[0] = candidate
+            siftDown(0)
+        }
+    }
+
+    // A lower score, or the same score later in the document
+    private func ranksBelow(_ lhs: KdbxFuzzyMatcher.Candidate, _ rhs: KdbxFuzzyMatcher.Candidate) -> Bool {
+        if lhs.score != rhs.score {
+            return lhs.score < rhs.score
+        }
+        return precedes(rhs.uuid, lhs.uuid)
+    }
+
+    private mutating func siftUp(_ start: Int) {
+        var child = start
+
+        while child > 0 {
+            let parent = (child - 1) / 2
+            guard ranksBelow(heap[child], heap[parent]) else {
+                return
+            }
+
+            heap.swapAt(child, parent)
+            child = parent
+        }
+    }
+
+    private mutating func siftDown(_ start: Int) {
+        var parent = start
+
+        while true {
+            var lowest = parent
+            for child in [2 * parent + 1, 2 * parent + 2] where child < heap.count && ranksBelow(heap[child], heap[lowest]) {
+                lowest = child
+            }
+
+            guard lowest != parent else {
+                return
+            }
+
+            heap.swapAt(parent, lowest)
+            parent = lowest
+        }
+    }
+}
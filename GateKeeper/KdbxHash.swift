@@ -0,0 +1,112 @@
+//
+//  KdbxHash.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Incremental SHA-256 over borrowed memory, so a pipeline can hash bytes as
+// they pass through and key derivation can hash several parts without
+// concatenating them first.
+struct KdbxSha256 {
+
+    static let digestLength = Int(CC_SHA256_DIGEST_LENGTH)
+
+    private var context = CC_SHA256_CTX()
+
+    init() {
+        CC_SHA256_Init(&context)
+    }
+
+    static func hash(_ parts: [UInt8]...) -> [UInt8] {
+        var sha = KdbxSha256()
+        for part in parts {
+            sha.update(part)
+        }
+
+        return sha.finalize()
+    }
+
+    mutating func update(_ bytes: UnsafeRawBufferPointer) {
+        CC_SHA256_Update(&context, bytes.baseAddress, CC_LONG(bytes.count))
+    }
+
+    mutating func update(_ bytes: [UInt8]) {
+        CC_SHA256_Update(&context, bytes, CC_LONG(bytes.count))
+    }
+
+    // Returns the digest and starts over, ready for the next message
+    mutating func finalize() -> [UInt8] {
+        var hash = [UInt8](repeating: 0x0, count: KdbxSha256.digestLength)
+        CC_SHA256_Final(&hash, &context)
+        CC_SHA256_Init(&context)
+
+        return hash
+    }
+}
+
+struct KdbxSha512 {
+
+    static let digestLength = Int(CC_SHA512_DIGEST_LENGTH)
+
+    private var context = CC_SHA512_CTX()
+
+    init() {
+        CC_SHA512_Init(&context)
+    }
+
+    static func hash(_ parts: [UInt8]...) -> [UInt8] {
+        var sha = KdbxSha512()
+        for part in parts {
+            sha.update(part)
+        }
+
+        return sha.finalize()
+    }
+
+    mutating func update(_ bytes: UnsafeRawBufferPointer) {
+        CC_SHA512_Update(&context, bytes.baseAddress, CC_LONG(bytes.count))
+    }
+
+    mutating func update(_ bytes: [UInt8]) {
+        CC_SHA512_Update(&context, bytes, CC_LONG(bytes.count))
+    }
+
+    mutating func finalize() -> [UInt8] {
+        var hash = [UInt8](repeating: 0x0, count: KdbxSha512.digestLength)
+        CC_SHA512_Final(&hash, &context)
+        CC_SHA512_Init(&context)
+
+        return hash
+    }
+}
+
+// Incremental HMAC-SHA256. finalize() leaves the context spent; call
+// reset(key:) before authenticating the next message.
+struct KdbxHmacSha256 {
+
+    private var context = CCHmacContext()
+
+    init(key: [UInt8]) {
+        reset(key: key)
+    }
+
+    mutating func reset(key: [UInt8]) {
+        CCHmacInit(&context, UInt32(kCCHmacAlgSHA256), key, key.count)
+    }
+
+    mutating func update(_ bytes: UnsafeRawBufferPointer) {
+        CCHmacUpdate(&context, bytes.baseAddress, bytes.count)
+    }
+
+    mutating func update(_ bytes: [UInt8]) {
+        CCHmacUpdate(&context, bytes, bytes.count)
+    }
+
+    mutating func finalize() -> [UInt8] {
+        var hmac = [UInt8](repeating: 0x0, count: KdbxSha256.digestLength)
+        CCHmacFinal(&context, &hmac)
+
+        return hmac
+    }
+}
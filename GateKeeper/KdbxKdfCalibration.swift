@@ -0,0 +1,144 @@
+//
+//  KdbxKdfCalibration.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Picks transformation rounds for a target unlock time from the measured KDF
+// throughput of this device. Measurements are kept in UserDefaults per device
+// model and KDF configuration, so recalibrating later needs no benchmark.
+class KdbxKdfCalibration {
+
+    enum Kdf {
+        case aes
+        case argon2(variant: KdbxArgon2.Variant, version: UInt32, memoryKiB: Int, parallelism: Int)
+
+        var minimumRounds: Int {
+            switch self {
+            case .aes:
+                return 80000
+            case .argon2:
+                return 1
+            }
+        }
+
+        fileprivate var measurementKey: String {
+            switch self {
+            case .aes:
+                return "aes"
+            case let .argon2(variant, version, memoryKiB, parallelism):
+                return "argon2-\(variant.rawValue)-\(version)-\(memoryKiB)-\(parallelism)"
+            }
+        }
+    }
+
+    static let defaultTarget: TimeInterval = 1.0
+    static let defaultWindow: TimeInterval = 0.25
+
+    private static let measurementsKey = "kdfThroughput"
+    private static let aesBatchRounds = 50000
+
+    // Argon2 samples time these two iteration counts; the difference leaves
+    // out allocating and first filling the memory, which every unlock pays once
+    private static let argon2SampleIterations = (1, 3)
+
+    private struct Measurement {
+        // Rounds (AES) or iterations (Argon2) per second, past the fixed cost
+        let throughput: Double
+        // Time an unlock takes regardless of the rounds
+        let fixedCost: TimeInterval
+    }
+
+    // Rounds (AES) or iterations (Argon2) per second
+    static func throughput(kdf: Kdf, window: TimeInterval = KdbxKdfCalibration.defaultWindow, useStoredMeasurement: Bool = true) throws -> Double {
+        return try measurement(kdf: kdf, window: window, useStoredMeasurement: useStoredMeasurement).throughput
+    }
+
+    static func rounds(kdf: Kdf, target: TimeInterval = KdbxKdfCalibration.defaultTarget, useStoredMeasurement: Bool = true) throws -> Int {
+        let measurement = try self.measurement(kdf: kdf, window: defaultWindow, useStoredMeasurement: useStoredMeasurement)
+        let rounds = Int(measurement.throughput * max(0, target - measurement.fixedCost))
+
+        switch kdf {
+        case .aes:
+            // Round down to a readable figure
+            return max(kdf.minimumRounds, rounds / 1000 * 1000)
+        case .argon2:
+            return max(kdf.minimumRounds, rounds)
+        }
+    }
+
+    static func removeMeasurements() {
+        UserDefaults.standard.removeObject(forKey: measurementsKey)
+    }
+
+    private static func measurement(kdf: Kdf, window: TimeInterval, useStoredMeasurement: Bool) throws -> Measurement {
+        let key = "\(deviceModel)/\(kdf.measurementKey)"
+        let fixedCostKey = "\(key)/fixed"
+        var measurements = UserDefaults.standard.dictionary(forKey: measurementsKey) as? [String: Double] ?? [:]
+
+        if useStoredMeasurement, let throughput = measurements[key] {
+            return Measurement(throughput: throughput, fixedCost: measurements[fixedCostKey] ?? 0)
+        }
+
+        let measurement = try measure(kdf: kdf, window: window)
+
+        measurements[key] = measurement.throughput
+        measurements[fixedCostKey] = measurement.fixedCost
+        UserDefaults.standard.set(measurements, forKey: measurementsKey)
+
+        return measurement
+    }
+
+    private static func measure(kdf: Kdf, window: TimeInterval) throws -> Measurement {
+        let start = Date()
+
+        switch kdf {
+        case .aes:
+            let aesKdf = KdbxAesKdf(seed: [UInt8].random(size: 32))
+            var key = [UInt8].random(size: 32)
+            var rounds = 0
+
+            repeat {
+                key = try aesKdf.transform(key: key, rounds: aesBatchRounds)
+                rounds += aesBatchRounds
+            } while Date().timeIntervalSince(start) < window
+
+            return Measurement(throughput: Double(rounds) / Date().timeIntervalSince(start), fixedCost: 0)
+        case let .argon2(variant, version, memoryKiB, parallelism):
+            let password = [UInt8].random(size: 32)
+            let salt = [UInt8].random(size: 32)
+            let (fewer, more) = argon2SampleIterations
+
+            func time(iterations: Int) throws -> TimeInterval {
+                let sampleStart = Date()
+                _ = try KdbxArgon2.hash(password: password, salt: salt, parallelism: parallelism, memoryKiB: memoryKiB, iterations: iterations, version: version, variant: variant)
+                return Date().timeIntervalSince(sampleStart)
+            }
+
+            var samples = 0
+            var fewerTime = 0.0
+            var moreTime = 0.0
+
+            repeat {
+                fewerTime += try time(iterations: fewer)
+                moreTime += try time(iterations: more)
+                samples += 1
+            } while Date().timeIntervalSince(start) < window
+
+            let perIteration = max((moreTime - fewerTime) / Double(samples * (more - fewer)), 1e-6)
+            let fixedCost = max(0, fewerTime / Double(samples) - perIteration * Double(fewer))
+
+            return Measurement(throughput: 1 / perIteration, fixedCost: fixedCost)
+        }
+    }
+
+    private static var deviceModel: String {
+        var systemInfo = utsname()
+        uname(&systemInfo)
+
+        return withUnsafeBytes(of: &systemInfo.machine) { bytes in
+            return String(decoding: bytes.prefix(while: { $0 != 0 }), as: UTF8.self)
+        }
+    }
+}
@@ -0,0 +1,875 @@
+//
+//  KdbxPayloadStream.swift
+//  GateKeeper
+//
+
+import Foundation
+
+protocol KdbxByteSink: class {
+    func write(_ bytes: UnsafeRawBufferPointer) throws
+    func finish() throws
+}
+
+extension KdbxByteSink {
+
+    func write(chunked bytes: UnsafeRawBufferPointer, chunkSize: Int = 64 * 1024) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            let count = min(chunkSize, bytes.count - offset)
+            try write(UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+            offset += count
+        }
+    }
+
+    func write(chunked data: Data, chunkSize: Int = 64 * 1024) throws {
+        let count = data.count
+
+        try data.withUnsafeBytes { (pointer: UnsafePointer<UInt8>) in
+            try write(chunked: UnsafeRawBufferPointer(start: pointer, count: count), chunkSize: chunkSize)
+        }
+    }
+}
+
+final class KdbxAesCbcSink: KdbxByteSink {
+
+    private let next: KdbxByteSink
+    private let cryptor: KdbxAesCbcCryptor
+    private var buffer = [UInt8]()
+
+    init(operation: KdbxCrypto.Operation, key: [UInt8], iv: [UInt8], next: KdbxByteSink) throws {
+        self.next = next
+        self.cryptor = try KdbxAesCbcCryptor(operation: operation, key: key, iv: iv)
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        reserve(cryptor.outputLength(inputLength: bytes.count))
+
+        let moved = try buffer.withUnsafeMutableBytes { output in
+            return try cryptor.update(in: bytes, out: output)
+        }
+
+        try forward(count: moved)
+    }
+
+    func finish() throws {
+        reserve(KdbxAesCbcCryptor.blockSize)
+
+        let moved = try buffer.withUnsafeMutableBytes { output in
+            return try cryptor.finalize(out: output)
+        }
+
+        try forward(count: moved)
+        try next.finish()
+    }
+
+    private func reserve(_ capacity: Int) {
+        if buffer.count < capacity {
+            buffer = [UInt8](repeating: 0x0, count: capacity)
+        }
+    }
+
+    private func forward(count: Int) throws {
+        guard count > 0 else {
+            return
+        }
+
+        try buffer.withUnsafeBytes { output in
+            try next.write(UnsafeRawBufferPointer(rebasing: output[0..<count]))
+        }
+    }
+}
+
+// Verifies the stream start bytes and the SHA-256 of every hashed block,
+// passing block contents downstream as they arrive. A corrupt block fails the
+// whole decode, so nothing parsed from it is ever returned to the caller.
+final class KdbxHashedBlockSink: KdbxByteSink {
+
+    private enum State {
+        case streamStart
+        case blockHeader
+        case blockData(remaining: Int)
+        case end
+    }
+
+    private static let blockHeaderSize = 4 + 32 + 4
+
+    private let next: KdbxByteSink
+    private let streamStartBytes: [UInt8]
+    private var state = State.streamStart
+    private var headerBuffer = [UInt8]()
+    private var blockId = UInt32(0)
+    private var blockHash = [UInt8]()
+    private var sha = KdbxSha256()
+
+    init(streamStartBytes: [UInt8], next: KdbxByteSink) {
+        self.streamStartBytes = streamStartBytes
+        self.next = next
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            switch state {
+            case .streamStart:
+                offset += fillHeaderBuffer(size: streamStartBytes.count, bytes: bytes, offset: offset)
+
+                if headerBuffer.count == streamStartBytes.count {
+                    guard headerBuffer == streamStartBytes else {
+                        throw KdbxError.decryptionFailed
+                    }
+
+                    headerBuffer.removeAll(keepingCapacity: true)
+                    state = .blockHeader
+                }
+            case .blockHeader:
+                offset += fillHeaderBuffer(size: KdbxHashedBlockSink.blockHeaderSize, bytes: bytes, offset: offset)
+
+                if headerBuffer.count == KdbxHashedBlockSink.blockHeaderSize {
+                    try readBlockHeader()
+                }
+            case .blockData(let remaining):
+                let count = min(remaining, bytes.count - offset)
+                let slice = UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count])
+
+                sha.update(slice)
+                try next.write(slice)
+
+                offset += count
+
+                if count == remaining {
+                    guard sha.finalize() == blockHash else {
+                        throw KdbxError.decryptionFailed
+                    }
+
+                    blockId += 1
+                    state = .blockHeader
+                } else {
+                    state = .blockData(remaining: remaining - count)
+                }
+            case .end:
+                // Anything after the terminating block is padding
+                offset = bytes.count
+            }
+        }
+    }
+
+    func finish() throws {
+        switch state {
+        case .end:
+            break
+        case .blockHeader where headerBuffer.isEmpty && blockId > 0:
+            // Tolerate writers that omit the terminating block
+            break
+        default:
+            throw KdbxError.decryptionFailed
+        }
+
+        try next.finish()
+    }
+
+    private func fillHeaderBuffer(size: Int, bytes: UnsafeRawBufferPointer, offset: Int) -> Int {
+        let count = min(size - headerBuffer.count, bytes.count - offset)
+        headerBuffer.append(contentsOf: UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+        return count
+    }
+
+    private func readBlockHeader() throws {
+        let (id, hash, size) = try DataReadCursor.with(bytes: headerBuffer) { cursor -> (UInt32, [UInt8], UInt32) in
+            return try (cursor.read(), cursor.readBytes(size: 32), cursor.read())
+        }
+
+        headerBuffer.removeAll(keepingCapacity: true)
+
+        guard id == blockId else {
+            throw KdbxError.decryptionFailed
+        }
+
+        if size == 0 {
+            guard hash.first(where: { $0 != 0 }) == nil else {
+                throw KdbxError.decryptionFailed
+            }
+
+            state = .end
+        } else {
+            blockHash = hash
+            state = .blockData(remaining: Int(size))
+        }
+    }
+}
+
+// Writes the KDBX 3 hashed block stream: the stream start bytes, then blocks
+// of up to `blockSize` bytes, each preceded by its index, SHA-256 and size,
+// then an empty terminating block with a zero hash.
+final class KdbxHashedBlockWriteSink: KdbxByteSink {
+
+    static let defaultBlockSize = 1024 * 1024
+
+    private let next: KdbxByteSink
+    private let blockSize: Int
+    private var current = [UInt8]()
+    private var index = UInt32(0)
+    private var sha = KdbxSha256()
+
+    init(streamStartBytes: [UInt8], blockSize: Int = KdbxHashedBlockWriteSink.defaultBlockSize, next: KdbxByteSink) throws {
+        precondition(blockSize > 0)
+
+        self.next = next
+        self.blockSize = blockSize
+
+        try streamStartBytes.withUnsafeBytes { try next.write($0) }
+
+        current.reserveCapacity(blockSize)
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            let count = min(blockSize - current.count, bytes.count - offset)
+            let slice = UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count])
+
+            // The block's hash is folded in as it fills, so it is ready when the block is
+            sha.update(slice)
+            current.append(contentsOf: slice)
+            offset += count
+
+            if current.count == blockSize {
+                try writeCurrent()
+            }
+        }
+    }
+
+    func finish() throws {
+        if !current.isEmpty {
+            try writeCurrent()
+        }
+
+        // Terminating empty block
+        let terminator = index.littleEndianBytes + [UInt8](repeating: 0x0, count: 32) + UInt32(0).littleEndianBytes
+        try terminator.withUnsafeBytes { try next.write($0) }
+
+        try next.finish()
+    }
+
+    private func writeCurrent() throws {
+        let blockHeader = index.littleEndianBytes + sha.finalize() + UInt32(current.count).littleEndianBytes
+
+        try blockHeader.withUnsafeBytes { try next.write($0) }
+        try current.withUnsafeBytes { try next.write($0) }
+
+        current.removeAll(keepingCapacity: true)
+        index += 1
+    }
+}
+
+final class KdbxGunzipSink: KdbxByteSink {
+
+    private let next: KdbxByteSink
+    private var stream = z_stream()
+    private var buffer = [UInt8](repeating: 0x0, count: 64 * 1024)
+    private var isStreamEnd = false
+
+    init(next: KdbxByteSink) throws {
+        self.next = next
+
+        // 32 added to the window bits enables gzip and zlib header detection
+        let status = inflateInit2_(&stream, MAX_WBITS + 32, ZLIB_VERSION, Int32(MemoryLayout<z_stream>.size))
+
+        guard status == Z_OK else {
+            throw KdbxError.decryptionFailed
+        }
+    }
+
+    deinit {
+        inflateEnd(&stream)
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        guard !isStreamEnd, let baseAddress = bytes.baseAddress, bytes.count > 0 else {
+            return
+        }
+
+        stream.next_in = UnsafeMutablePointer(mutating: baseAddress.assumingMemoryBound(to: Bytef.self))
+        stream.avail_in = uInt(bytes.count)
+
+        try inflateAvailable(flush: Z_NO_FLUSH)
+    }
+
+    func finish() throws {
+        if !isStreamEnd {
+            stream.next_in = nil
+            stream.avail_in = 0
+
+            try inflateAvailable(flush: Z_FINISH)
+        }
+
+        guard isStreamEnd else {
+            throw KdbxError.decryptionFailed
+        }
+
+        try next.finish()
+    }
+
+    private func inflateAvailable(flush: Int32) throws {
+        repeat {
+            var produced = 0
+            let status = buffer.withUnsafeMutableBytes { output -> Int32 in
+                stream.next_out = output.baseAddress?.assumingMemoryBound(to: Bytef.self)
+                stream.avail_out = uInt(output.count)
+
+                let status = inflate(&stream, flush)
+                produced = output.count - Int(stream.avail_out)
+
+                return status
+            }
+
+            switch status {
+            case Z_STREAM_END:
+                isStreamEnd = true
+            case Z_OK, Z_BUF_ERROR:
+                break
+            default:
+                throw KdbxError.decryptionFailed
+            }
+
+            if produced > 0 {
+                try buffer.withUnsafeBytes { output in
+                    try next.write(UnsafeRawBufferPointer(rebasing: output[0..<produced]))
+                }
+            } else if status == Z_BUF_ERROR {
+                break
+            }
+        } while !isStreamEnd && (stream.avail_in > 0 || stream.avail_out == 0)
+    }
+}
+
+// Compresses like pigz: input is cut into chunks that are deflated on all
+// cores and joined into one gzip member. Each chunk is primed with the 32 KiB
+// before it as a dictionary, so the ratio stays close to a single stream, and
+// ends on a sync flush, so the raw deflate streams concatenate. The CRC-32s of
+// the chunks are combined for the trailer. Output is the same for the same
+// input, whatever the number of cores.
+final class KdbxParallelGzipSink: KdbxByteSink {
+
+    static let defaultLevel = Z_DEFAULT_COMPRESSION
+    static let defaultChunkSize = 128 * 1024
+    static let dictionarySize = 32 * 1024
+
+    // Chunks being compressed or waiting to be written, before writes block
+    private static let maximumPendingChunks = 2 * ProcessInfo.processInfo.activeProcessorCount
+
+    private static let header: [UInt8] = [0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff]
+
+    private final class Chunk {
+        let input: [UInt8]
+        let dictionary: [UInt8]
+        let isLast: Bool
+        let done = DispatchSemaphore(value: 0)
+        var output = [UInt8]()
+        var crc = uLong(0)
+        var failed = false
+
+        init(input: [UInt8], dictionary: [UInt8], isLast: Bool) {
+            self.input = input
+            self.dictionary = dictionary
+            self.isLast = isLast
+        }
+    }
+
+    private let next: KdbxByteSink
+    private let level: Int32
+    private let chunkSize: Int
+    private let queue = DispatchQueue(label: "KdbxParallelGzipSink", attributes: .concurrent)
+    private var pending = [Chunk]()
+    private var current = [UInt8]()
+    private var dictionary = [UInt8]()
+    private var crc = crc32(0, nil, 0)
+    private var length = UInt32(0)
+
+    init(level: Int32 = KdbxParallelGzipSink.defaultLevel, chunkSize: Int = KdbxParallelGzipSink.defaultChunkSize, next: KdbxByteSink) throws {
+        precondition(chunkSize > 0)
+
+        self.next = next
+        self.level = level
+        self.chunkSize = chunkSize
+
+        try KdbxParallelGzipSink.header.withUnsafeBytes { try next.write($0) }
+
+        current.reserveCapacity(chunkSize)
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            let count = min(chunkSize - current.count, bytes.count - offset)
+            current.append(contentsOf: UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+            offset += count
+
+            if current.count == chunkSize {
+                try dispatchCurrent(isLast: false)
+            }
+        }
+    }
+
+    func finish() throws {
+        // The last chunk carries the final block, even when it is empty
+        try dispatchCurrent(isLast: true)
+
+        while !pending.isEmpty {
+            try writeFirstPending()
+        }
+
+        let trailer = UInt32(truncatingIfNeeded: crc).littleEndianBytes + length.littleEndianBytes
+        try trailer.withUnsafeBytes { try next.write($0) }
+
+        try next.finish()
+    }
+
+    private func dispatchCurrent(isLast: Bool) throws {
+        let chunk = Chunk(input: current, dictionary: dictionary, isLast: isLast)
+        pending.append(chunk)
+
+        let window = KdbxParallelGzipSink.dictionarySize
+        if current.count >= window {
+            dictionary = Array(current[(current.count - window)...])
+        } else {
+            dictionary = Array((dictionary + current).suffix(window))
+        }
+
+        current.removeAll(keepingCapacity: true)
+
+        let level = self.level
+
+        // Only the worker touches the chunk until it signals
+        queue.async {
+            KdbxParallelGzipSink.compress(chunk: chunk, level: level)
+            chunk.done.signal()
+        }
+
+        if pending.count > KdbxParallelGzipSink.maximumPendingChunks {
+            try writeFirstPending()
+        }
+    }
+
+    private func writeFirstPending() throws {
+        let chunk = pending.removeFirst()
+        chunk.done.wait()
+
+        guard !chunk.failed else {
+            throw KdbxError.encryptionFailed
+        }
+
+        crc = crc32_combine(crc, chunk.crc, z_off_t(chunk.input.count))
+        length = length &+ UInt32(truncatingIfNeeded: chunk.input.count)
+
+        try chunk.output.withUnsafeBytes { try next.write($0) }
+    }
+
+    private static func compress(chunk: Chunk, level: Int32) {
+        var stream = z_stream()
+
+        // Negative window bits write raw deflate, without a header of its own
+        guard deflateInit2_(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY, ZLIB_VERSION, Int32(MemoryLayout<z_stream>.size)) == Z_OK else {
+            chunk.failed = true
+            return
+        }
+
+        defer {
+            deflateEnd(&stream)
+        }
+
+        if !chunk.dictionary.isEmpty {
+            guard deflateSetDictionary(&stream, chunk.dictionary, uInt(chunk.dictionary.count)) == Z_OK else {
+                chunk.failed = true
+                return
+            }
+        }
+
+        // Room for the worst case plus the empty block a sync flush appends
+        var output = [UInt8](repeating: 0x0, count: Int(deflateBound(&stream, uLong(chunk.input.count))) + 16)
+        let flush = chunk.isLast ? Z_FINISH : Z_SYNC_FLUSH
+
+        let status = chunk.input.withUnsafeBytes { input -> Int32 in
+            output.withUnsafeMutableBytes { buffer -> Int32 in
+                stream.next_in = UnsafeMutablePointer(mutating: input.baseAddress?.assumingMemoryBound(to: Bytef.self))
+                stream.avail_in = uInt(input.count)
+                stream.next_out = buffer.baseAddress?.assumingMemoryBound(to: Bytef.self)
+                stream.avail_out = uInt(buffer.count)
+
+                return deflate(&stream, flush)
+            }
+        }
+
+        let isComplete = chunk.isLast ? status == Z_STREAM_END : status == Z_OK && stream.avail_in == 0 && stream.avail_out > 0
+
+        guard isComplete else {
+            chunk.failed = true
+            return
+        }
+
+        output.removeLast(Int(stream.avail_out))
+
+        chunk.output = output
+        chunk.crc = chunk.input.withUnsafeBytes { input in
+            crc32(0, input.baseAddress?.assumingMemoryBound(to: Bytef.self), uInt(input.count))
+        }
+    }
+}
+
+// KDBX 4 block stream: every block is authenticated with HMAC-SHA256 under a
+// per-block key, and the stream ends with an authenticated empty block.
+final class KdbxHmacBlockSink: KdbxByteSink {
+
+    private enum State {
+        case blockHeader
+        case blockData(remaining: Int)
+        case end
+    }
+
+    private static let blockHeaderSize = 32 + 4
+
+    private let next: KdbxByteSink
+    private let hmacKey: [UInt8]
+    private var state = State.blockHeader
+    private var headerBuffer = [UInt8]()
+    private var blockIndex = UInt64(0)
+    private var blockHmac = [UInt8]()
+    private var hmac = KdbxHmacSha256(key: [])
+
+    init(hmacKey: [UInt8], next: KdbxByteSink) {
+        self.hmacKey = hmacKey
+        self.next = next
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            switch state {
+            case .blockHeader:
+                let count = min(KdbxHmacBlockSink.blockHeaderSize - headerBuffer.count, bytes.count - offset)
+                headerBuffer.append(contentsOf: UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+                offset += count
+
+                if headerBuffer.count == KdbxHmacBlockSink.blockHeaderSize {
+                    try readBlockHeader()
+                }
+            case .blockData(let remaining):
+                let count = min(remaining, bytes.count - offset)
+                let slice = UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count])
+
+                hmac.update(slice)
+                try next.write(slice)
+
+                offset += count
+
+                if count == remaining {
+                    try verifyBlock()
+                    state = .blockHeader
+                } else {
+                    state = .blockData(remaining: remaining - count)
+                }
+            case .end:
+                offset = bytes.count
+            }
+        }
+    }
+
+    func finish() throws {
+        guard case .end = state else {
+            throw KdbxError.decryptionFailed
+        }
+
+        try next.finish()
+    }
+
+    private func readBlockHeader() throws {
+        let (expected, size) = try DataReadCursor.with(bytes: headerBuffer) { cursor -> ([UInt8], Int32) in
+            return try (cursor.readBytes(size: 32), cursor.read())
+        }
+
+        headerBuffer.removeAll(keepingCapacity: true)
+
+        guard size >= 0 else {
+            throw KdbxError.decryptionFailed
+        }
+
+        // The MAC covers the block index and size ahead of the data
+        hmac.reset(key: KdbxCrypto.hmacBlockKey(index: blockIndex, hmacKey: hmacKey))
+        hmac.update(blockIndex.littleEndianBytes)
+        hmac.update(size.littleEndianBytes)
+        blockHmac = expected
+
+        if size == 0 {
+            try verifyBlock()
+            state = .end
+        } else {
+            state = .blockData(remaining: Int(size))
+        }
+    }
+
+    private func verifyBlock() throws {
+        guard hmac.finalize() == blockHmac else {
+            throw KdbxError.decryptionFailed
+        }
+
+        blockIndex += 1
+    }
+}
+
+final class KdbxChaCha20Sink: KdbxByteSink {
+
+    private let next: KdbxByteSink
+    private let chaCha20: ChaCha20
+    private var buffer = [UInt8]()
+
+    init(key: [UInt8], nonce: [UInt8], next: KdbxByteSink) {
+        self.chaCha20 = ChaCha20(key: key, nonce: nonce)
+        self.next = next
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        buffer.removeAll(keepingCapacity: true)
+        buffer.append(contentsOf: bytes)
+
+        try buffer.withUnsafeMutableBytes { output in
+            chaCha20.transform(output)
+            try next.write(UnsafeRawBufferPointer(output))
+        }
+    }
+
+    func finish() throws {
+        try next.finish()
+    }
+}
+
+// Reads the KDBX 4 inner header at the start of the decompressed payload and
+// forwards everything after it (the XML) downstream.
+final class KdbxInnerHeaderSink: KdbxByteSink {
+
+    enum ReadType: UInt8 {
+        case end = 0
+        case streamAlgorithm = 1
+        case streamKey = 2
+        case binary = 3
+    }
+
+    struct Binary {
+        let isProtected: Bool
+        let bytes: [UInt8]
+    }
+
+    private static let fieldHeaderSize = 1 + 4
+
+    private let next: KdbxByteSink
+    private var fieldBuffer = [UInt8]()
+    private var fieldType: ReadType?
+    private var fieldSize = 0
+    private var isEnd = false
+
+    private(set) var streamAlgorithm: UInt32?
+    private(set) var streamKey = [UInt8]()
+    private(set) var binaries = [Binary]()
+
+    init(next: KdbxByteSink) {
+        self.next = next
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while !isEnd && offset < bytes.count {
+            let needed = (fieldType == nil ? KdbxInnerHeaderSink.fieldHeaderSize : fieldSize) - fieldBuffer.count
+            let count = min(needed, bytes.count - offset)
+
+            fieldBuffer.append(contentsOf: UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+            offset += count
+
+            if count == needed {
+                try readField()
+            }
+        }
+
+        if isEnd && offset < bytes.count {
+            try next.write(UnsafeRawBufferPointer(rebasing: bytes[offset..<bytes.count]))
+        }
+    }
+
+    func finish() throws {
+        guard isEnd else {
+            throw KdbxError.decryptionFailed
+        }
+
+        try next.finish()
+    }
+
+    private func readField() throws {
+        guard let type = fieldType else {
+            let (typeInt, size) = try DataReadCursor.with(bytes: fieldBuffer) { cursor -> (UInt8, Int32) in
+                return try (cursor.read(), cursor.read())
+            }
+
+            guard let type = ReadType(rawValue: typeInt), size >= 0 else {
+                throw KdbxError.decryptionFailed
+            }
+
+            fieldBuffer.removeAll(keepingCapacity: true)
+            fieldType = type
+            fieldSize = Int(size)
+
+            if fieldSize == 0 {
+                try readField()
+            }
+            return
+        }
+
+        switch type {
+        case .end:
+            isEnd = true
+        case .streamAlgorithm:
+            streamAlgorithm = try DataReadCursor.with(bytes: fieldBuffer) { cursor in
+                return try cursor.read() as UInt32
+            }
+        case .streamKey:
+            streamKey = fieldBuffer
+        case .binary:
+            // First byte holds flags, bit 0 marks the binary as protected
+            guard let flags = fieldBuffer.first else {
+                throw KdbxError.decryptionFailed
+            }
+
+            binaries.append(Binary(isProtected: flags & 0x01 != 0, bytes: Array(fieldBuffer.dropFirst())))
+        }
+
+        fieldBuffer = []
+        fieldType = nil
+        fieldSize = 0
+    }
+}
+
+// Writes the KDBX 4 block stream. Input is cut into fixed-size blocks, and
+// each full block is handed to a concurrent queue to be transformed (ChaCha20
+// can seek, so encryption happens here too) and authenticated while the caller
+// keeps compressing and encrypting the blocks that follow.
+final class KdbxHmacBlockWriteSink: KdbxByteSink {
+
+    typealias BlockTransform = (_ index: UInt64, _ bytes: UnsafeMutableRawBufferPointer) -> Void
+
+    static let defaultBlockSize = 1024 * 1024
+
+    private final class Block {
+        let index: UInt64
+        var bytes: [UInt8]
+        var hmac = [UInt8]()
+
+        init(index: UInt64, bytes: [UInt8]) {
+            self.index = index
+            self.bytes = bytes
+        }
+    }
+
+    private let hmacKey: [UInt8]
+    private let blockSize: Int
+    private let transform: BlockTransform?
+    private let queue = DispatchQueue(label: "KdbxHmacBlockWriteSink", attributes: .concurrent)
+    private let group = DispatchGroup()
+    private var blocks = [Block]()
+    private var current = [UInt8]()
+    private var isFinished = false
+
+    init(hmacKey: [UInt8], blockSize: Int = KdbxHmacBlockWriteSink.defaultBlockSize, transform: BlockTransform? = nil) {
+        precondition(blockSize > 0)
+
+        self.hmacKey = hmacKey
+        self.blockSize = blockSize
+        self.transform = transform
+
+        current.reserveCapacity(blockSize)
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        var offset = 0
+
+        while offset < bytes.count {
+            let count = min(blockSize - current.count, bytes.count - offset)
+            current.append(contentsOf: UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + count]))
+            offset += count
+
+            if current.count == blockSize {
+                dispatchCurrent()
+            }
+        }
+    }
+
+    func finish() throws {
+        if !current.isEmpty {
+            dispatchCurrent()
+        }
+
+        // Terminating empty block
+        dispatchCurrent()
+
+        group.wait()
+        isFinished = true
+    }
+
+    // The complete block stream, available once finish() returns
+    var data: Data {
+        precondition(isFinished)
+
+        var data = Data(capacity: blocks.reduce(0) { $0 + $1.bytes.count + 32 + 4 })
+        for block in blocks {
+            data.append(contentsOf: block.hmac)
+            data.append(contentsOf: UInt32(block.bytes.count).littleEndianBytes)
+            data.append(contentsOf: block.bytes)
+        }
+
+        return data
+    }
+
+    private func dispatchCurrent() {
+        let block = Block(index: UInt64(blocks.count), bytes: current)
+        blocks.append(block)
+
+        current.removeAll(keepingCapacity: true)
+
+        let hmacKey = self.hmacKey
+        let transform = self.transform
+
+        // Only the worker touches the block from here until the group is joined
+        queue.async(group: group) {
+            if let transform = transform {
+                block.bytes.withUnsafeMutableBytes { transform(block.index, $0) }
+            }
+
+            block.hmac = KdbxHmacBlockWriteSink.hmac(block: block, hmacKey: hmacKey)
+        }
+    }
+
+    private static func hmac(block: Block, hmacKey: [UInt8]) -> [UInt8] {
+        var authenticator = KdbxHmacSha256(key: KdbxCrypto.hmacBlockKey(index: block.index, hmacKey: hmacKey))
+        authenticator.update(block.index.littleEndianBytes)
+        authenticator.update(UInt32(block.bytes.count).littleEndianBytes)
+        authenticator.update(block.bytes)
+
+        return authenticator.finalize()
+    }
+}
+
+// Collects everything written to it, as the end of a write pipeline
+final class KdbxBufferSink: KdbxByteSink {
+
+    private(set) var bytes = [UInt8]()
+    private(set) var isFinished = false
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        self.bytes.append(contentsOf: bytes)
+    }
+
+    func finish() throws {
+        isFinished = true
+    }
+}
@@ -0,0 +1,216 @@
+//
+//  KdbxSearchIndex.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Case-folded search fields of every entry plus, per attribute, postings from
+// byte trigrams to the entries containing them. A query of three or more ASCII
+// bytes only checks entries holding all of its trigrams. Fields with non-ASCII
+// text can match under Unicode equivalence without sharing bytes, so they are
+// always checked. Every candidate is confirmed with the same `contains` that
+// Group.search uses, so results are identical, only cheaper to find. The
+// same fields are also kept as UTF-8 bytes for the fuzzy matcher. A copy is a
+// cheap snapshot, which search sessions query off the main queue.
+struct KdbxSearchIndex {
+
+    static let attributes: [KdbxEntrySearchAttribute] = [.title, .username, .url, .notes]
+
+    private var fields = [KdbxEntrySearchAttribute: [UUID: String]]()
+    private var foldedFields = [KdbxEntrySearchAttribute: [UUID: [UInt8]]]()
+    private var postings = [KdbxEntrySearchAttribute: [UInt32: Set<UUID>]]()
+    private var unindexed = [KdbxEntrySearchAttribute: Set<UUID>]()
+
+    init(group: KdbxXml.Group) {
+        for attribute in KdbxSearchIndex.attributes {
+            fields[attribute] = [:]
+            foldedFields[attribute] = [:]
+            postings[attribute] = [:]
+            unindexed[attribute] = []
+        }
+
+        add(group: group)
+    }
+
+    static func key(attribute: KdbxEntrySearchAttribute) -> String {
+        switch attribute {
+        case .title:
+            return "Title"
+        case .username:
+            return "UserName"
+        case .url:
+            return "Url"
+        case .notes:
+            return "Notes"
+        }
+    }
+
+    // MARK: Maintenance
+
+    mutating func add(group: KdbxXml.Group) {
+        for entry in group.entries {
+            add(entry: entry)
+        }
+
+        for subgroup in group.groups {
+            add(group: subgroup)
+        }
+    }
+
+    mutating func remove(group: KdbxXml.Group) {
+        for entry in group.entries {
+            remove(entryUUID: entry.uuid)
+        }
+
+        for subgroup in group.groups {
+            remove(group: subgroup)
+        }
+    }
+
+    mutating func add(entry: KdbxXml.Entry) {
+        for attribute in KdbxSearchIndex.attributes {
+            guard let value = entry.getStr(key: KdbxSearchIndex.key(attribute: attribute))?.value else {
+                continue
+            }
+
+            let lowercased = value.lowercased(with: .current)
+            fields[attribute]?[entry.uuid] = lowercased
+            foldedFields[attribute]?[entry.uuid] = Array(lowercased.utf8)
+
+            if let trigrams = KdbxSearchIndex.trigrams(lowercased) {
+                for trigram in trigrams {
+                    postings[attribute]?[trigram, default: []].insert(entry.uuid)
+                }
+            } else {
+                unindexed[attribute]?.insert(entry.uuid)
+            }
+        }
+    }
+
+    mutating func remove(entryUUID: UUID) {
+        for attribute in KdbxSearchIndex.attributes {
+            guard let lowercased = fields[attribute]?.removeValue(forKey: entryUUID) else {
+                continue
+            }
+
+            foldedFields[attribute]?.removeValue(forKey: entryUUID)
+
+            if let trigrams = KdbxSearchIndex.trigrams(lowercased) {
+                for trigram in trigrams {
+                    postings[attribute]?[trigram]?.remove(entryUUID)
+
+                    if postings[attribute]?[trigram]?.isEmpty ?? false {
+                        postings[attribute]?.removeValue(forKey: trigram)
+                    }
+                }
+            } else {
+                unindexed[attribute]?.remove(entryUUID)
+            }
+        }
+    }
+
+    mutating func update(entry: KdbxXml.Entry) {
+        remove(entryUUID: entry.uuid)
+        add(entry: entry)
+    }
+
+    // MARK: Queries
+
+    // Entries whose field contains the already lowercased query, in no particular order
+    func matches(lowercasedQuery query: String, attribute: KdbxEntrySearchAttribute) -> [UUID] {
+        guard let fields = fields[attribute] else {
+            return []
+        }
+
+        guard let queryTrigrams = KdbxSearchIndex.trigrams(query), !queryTrigrams.isEmpty,
+            let postings = postings[attribute], let unindexed = unindexed[attribute] else {
+            return fields.filter { $0.value.contains(query) }.map { $0.key }
+        }
+
+        // Intersect starting from the shortest posting list
+        var lists = [Set<UUID>]()
+        for trigram in queryTrigrams {
+            guard let list = postings[trigram] else {
+                lists = []
+                break
+            }
+            lists.append(list)
+        }
+        lists.sort { $0.count < $1.count }
+
+        var candidates = [UUID]()
+        if let shortest = lists.first {
+            candidates = Array(shortest.filter { uuid in
+                return !lists.dropFirst().contains { !$0.contains(uuid) }
+            })
+        }
+        candidates.append(contentsOf: unindexed)
+
+        return candidates.filter { fields[$0]?.contains(query) ?? false }
+    }
+
+    // The entries among `candidates` whose field contains the already lowercased query
+    func matches(lowercasedQuery query: String, attribute: KdbxEntrySearchAttribute, among candidates: [UUID]) -> [UUID] {
+        guard let fields = fields[attribute] else {
+            return []
+        }
+
+        return candidates.filter { fields[$0]?.contains(query) ?? false }
+    }
+
+    // The fuzzy score of one entry's field, nil when it does not match
+    func score(matcher: KdbxFuzzyMatcher, entryUUID: UUID, attribute: KdbxEntrySearchAttribute) -> Int? {
+        return foldedFields[attribute]?[entryUUID].flatMap { matcher.score(field: $0, attribute: attribute) }
+    }
+
+    // Up to `limit` fuzzy matches in `database`, each with the attribute it
+    // scored best in, best first, ties in document order
+    func rankedMatches(matcher: KdbxFuzzyMatcher, attributes: Set<KdbxEntrySearchAttribute>, limit: Int, database: KdbxXml.KeePassFile) -> [KdbxFuzzyMatcher.Match] {
+        var best = [UUID: KdbxFuzzyMatcher.Candidate]()
+
+        for attribute in attributes {
+            for (uuid, field) in foldedFields[attribute] ?? [:] {
+                guard let score = matcher.score(field: field, attribute: attribute) else {
+                    continue
+                }
+
+                if let current = best[uuid], current.score >= score {
+                    continue
+                }
+                best[uuid] = KdbxFuzzyMatcher.Candidate(uuid: uuid, attribute: attribute, score: score)
+            }
+        }
+
+        var top = KdbxTopCandidates(limit: limit) { database.entry($0, precedes: $1) }
+        for candidate in best.values {
+            top.insert(candidate)
+        }
+
+        return top.sorted.flatMap { candidate in
+            database.get(entryUUID: candidate.uuid).map { KdbxFuzzyMatcher.Match(entry: $0, attribute: candidate.attribute, score: candidate.score) }
+        }
+    }
+
+    // nil when the text is not all ASCII
+    private static func trigrams(_ string: String) -> Set<UInt32>? {
+        var trigrams = Set<UInt32>()
+        var window = UInt32(0)
+        var count = 0
+
+        for byte in string.utf8 {
+            guard byte < 0x80 else {
+                return nil
+            }
+
+            window = (window << 8 | UInt32(byte)) & 0xFFFFFF
+            count += 1
+
+            if count >= 3 {
+                trigrams.insert(window)
+            }
+        }
+
+        return trigrams
+    }
+}
@@ -0,0 +1,194 @@
+//
+//  KdbxSearchSession.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Type-ahead search over a snapshot of the database and its search index.
+// Each query runs on a background queue and is abandoned as soon as a newer
+// one arrives. A query that extends the previous one only rechecks the
+// previous matches. Matches come from the index and are ordered by the fuzzy
+// matcher's score, so prefixes come first, then word starts, then matches
+// inside a word, each in document order. The few best fuzzy matches across
+// all attributes come along, so a typo or abbreviation still finds an entry.
+final class KdbxSearchSession {
+
+    struct Results {
+        let query: String
+        let entries: [KdbxEntrySearchAttribute: [KdbxXml.Entry]]
+        // Only filled in once results are complete
+        let bestMatches: [KdbxFuzzyMatcher.Match]
+        let isComplete: Bool
+    }
+
+    static let bestMatchLimit = 5
+    static let firstBatchSize = 256
+
+    let attributes: [KdbxEntrySearchAttribute]
+
+    private let database: KdbxXml.KeePassFile
+    private let index: KdbxSearchIndex
+    private let queue = DispatchQueue(label: "KdbxSearchSession", qos: .userInitiated)
+    private let lock = NSLock()
+    private var generation = 0
+
+    // Only touched on the queue
+    private var previousQuery: String?
+    private var previousMatches = [KdbxEntrySearchAttribute: [UUID]]()
+
+    init(database: KdbxXml.KeePassFile, index: KdbxSearchIndex, attributes: [KdbxEntrySearchAttribute] = KdbxSearchIndex.attributes) {
+        self.database = database
+        self.index = index
+        self.attributes = attributes
+    }
+
+    // Results arrive on the main queue in growing batches; the last one is complete
+    func search(query: String, handler: @escaping (Results) -> Void) {
+        let current = nextGeneration()
+
+        queue.async {
+            self.run(query: query, generation: current, handler: handler)
+        }
+    }
+
+    func cancel() {
+        _ = nextGeneration()
+    }
+
+    private func nextGeneration() -> Int {
+        lock.lock()
+        defer { lock.unlock() }
+
+        generation += 1
+        return generation
+    }
+
+    private func isCurrent(_ candidate: Int) -> Bool {
+        lock.lock()
+        defer { lock.unlock() }
+
+        return candidate == generation
+    }
+
+    // MARK: Background work
+
+    private func run(query: String, generation current: Int, handler: @escaping (Results) -> Void) {
+        let lowercasedQuery = query.lowercased(with: .current)
+        let matcher = KdbxFuzzyMatcher(query: query)
+        let refines = previousQuery.map { KdbxSearchSession.query(lowercasedQuery, refines: $0) } ?? false
+
+        // Matches per attribute, in document order
+        var matches = [KdbxEntrySearchAttribute: [UUID]]()
+        var entries = [KdbxEntrySearchAttribute: [KdbxXml.Entry]]()
+
+        for attribute in attributes {
+            guard isCurrent(current) else {
+                return
+            }
+
+            let uuids: [UUID]
+            if refines {
+                uuids = index.matches(lowercasedQuery: lowercasedQuery, attribute: attribute, among: previousMatches[attribute] ?? [])
+            } else {
+                uuids = index.matches(lowercasedQuery: lowercasedQuery, attribute: attribute)
+            }
+
+            matches[attribute] = uuids
+            entries[attribute] = database.entries(uuids: uuids)
+        }
+
+        // Scores of the entries ranked so far, per attribute
+        var scores = [KdbxEntrySearchAttribute: [Int]]()
+        var position = 0
+        var batchEnd = KdbxSearchSession.firstBatchSize
+        let total = entries.values.map { $0.count }.max() ?? 0
+
+        while position < total {
+            guard isCurrent(current) else {
+                return
+            }
+
+            let end = min(batchEnd, total)
+
+            for attribute in attributes {
+                guard let attributeEntries = entries[attribute], position < attributeEntries.count else {
+                    continue
+                }
+
+                var attributeScores = scores[attribute] ?? []
+
+                // Entries the byte matcher cannot score, such as matches
+                // through Unicode equivalence, go last
+                for entry in attributeEntries[position..<min(end, attributeEntries.count)] {
+                    attributeScores.append(matcher.flatMap { index.score(matcher: $0, entryUUID: entry.uuid, attribute: attribute) } ?? 0)
+                }
+
+                scores[attribute] = attributeScores
+            }
+
+            position = end
+
+            // Doubling batches keep the number of deliveries logarithmic
+            if position < total {
+                deliver(query: query, entries: entries, scores: scores, bestMatches: [], isComplete: false, generation: current, handler: handler)
+                batchEnd = position * 2
+            }
+        }
+
+        guard isCurrent(current) else {
+            return
+        }
+
+        let bestMatches = matcher.map {
+            index.rankedMatches(matcher: $0, attributes: Set(attributes), limit: KdbxSearchSession.bestMatchLimit, database: database)
+        }
+
+        previousQuery = lowercasedQuery
+        previousMatches = matches
+
+        deliver(query: query, entries: entries, scores: scores, bestMatches: bestMatches ?? [], isComplete: true, generation: current, handler: handler)
+    }
+
+    private func deliver(query: String, entries: [KdbxEntrySearchAttribute: [KdbxXml.Entry]], scores: [KdbxEntrySearchAttribute: [Int]],
+                         bestMatches: [KdbxFuzzyMatcher.Match], isComplete: Bool, generation current: Int, handler: @escaping (Results) -> Void) {
+        var results = [KdbxEntrySearchAttribute: [KdbxXml.Entry]]()
+        for attribute in attributes {
+            results[attribute] = KdbxSearchSession.ranked(entries: entries[attribute] ?? [], scores: scores[attribute] ?? [])
+        }
+
+        let batch = Results(query: query, entries: results, bestMatches: bestMatches, isComplete: isComplete)
+
+        DispatchQueue.main.async {
+            if self.isCurrent(current) {
+                handler(batch)
+            }
+        }
+    }
+
+    // MARK: Ranking
+
+    // The first `scores.count` entries, best score first; ties keep document order
+    private static func ranked(entries: [KdbxXml.Entry], scores: [Int]) -> [KdbxXml.Entry] {
+        let order = scores.indices.sorted { lhs, rhs in
+            if scores[lhs] != scores[rhs] {
+                return scores[lhs] > scores[rhs]
+            }
+            return lhs < rhs
+        }
+
+        return order.map { entries[$0] }
+    }
+
+    // Every field containing the new query also contains the old one when the
+    // new query only appends to it. An empty query matches nothing, and
+    // non-ASCII queries can match through composed characters, so those
+    // always start from the full set.
+    private static func query(_ query: String, refines previous: String) -> Bool {
+        guard !previous.isEmpty, query.hasPrefix(previous) else {
+            return false
+        }
+
+        return !query.utf8.contains { $0 >= 0x80 }
+    }
+}
@@ -8,177 +8,345 @@ import Foundation
 protocol KdbxStreamCipher {
     func protect(string: String) throws -> String
     func unprotect(string: String) throws -> String
+    func transform(_ bytes: UnsafeMutableRawBufferPointer)
 }
 
-class Salsa20: KdbxStreamCipher {
+// The 64-byte block ciphers produce four consecutive blocks per call, laid
+// out word-interleaved so every operation of the round function runs across
+// the four blocks in one loop the compiler can vectorize. The keystream is
+// applied to whole buffers at once.
+protocol KdbxBlockStreamCipher: class, KdbxStreamCipher {
+    var keyStream: KdbxKeyStream { get }
+
+    // Fills keyStream with the next four blocks and advances the block counter
+    func generateKeyStream()
+}
+
+// The keystream buffer of a block cipher, and how far into it the stream is
+final class KdbxKeyStream {
+
+    static let blockSize = 64
+    static let parallelBlocks = 4
+    static let size = blockSize * parallelBlocks
+
+    let bytes: UnsafeMutablePointer<UInt8>
+    fileprivate var index = KdbxKeyStream.size
+
+    init() {
+        bytes = UnsafeMutablePointer<UInt8>.allocate(capacity: KdbxKeyStream.size)
+        bytes.initialize(to: 0, count: KdbxKeyStream.size)
+    }
+
+    deinit {
+        memset(bytes, 0, KdbxKeyStream.size)
+        bytes.deallocate(capacity: KdbxKeyStream.size)
+    }
+
+    // Adds the input words and writes the interleaved blocks out in stream order
+    @inline(__always) func store(_ x: UnsafePointer<UInt32>, _ input: UnsafePointer<UInt32>) {
+        let output = UnsafeMutableRawPointer(bytes)
+
+        for word in 0..<16 {
+            for lane in 0..<KdbxKeyStream.parallelBlocks {
+                let value = x[word * 4 + lane] &+ input[word * 4 + lane]
+                output.storeBytes(of: value.littleEndian, toByteOffset: lane * KdbxKeyStream.blockSize + word * 4, as: UInt32.self)
+            }
+        }
+    }
+
+    @inline(__always) fileprivate static func xor(_ output: UnsafeMutablePointer<UInt8>, _ keyStream: UnsafePointer<UInt8>, count: Int) {
+        var offset = 0
+
+        // Eight bytes at a time, the tail bytewise. memcpy keeps unaligned input legal and compiles to plain loads.
+        while offset + 8 <= count {
+            var word = UInt64(0)
+            var key = UInt64(0)
+            memcpy(&word, output + offset, 8)
+            memcpy(&key, keyStream + offset, 8)
+            word ^= key
+            memcpy(output + offset, &word, 8)
+
+            offset += 8
+        }
+
+        while offset < count {
+            output[offset] ^= keyStream[offset]
+            offset += 1
+        }
+    }
+}
+
+extension KdbxBlockStreamCipher {
+
+    func transform(_ bytes: UnsafeMutableRawBufferPointer) {
+        guard var output = bytes.baseAddress?.assumingMemoryBound(to: UInt8.self) else {
+            return
+        }
+
+        var remaining = bytes.count
+
+        while remaining > 0 {
+            if keyStream.index == KdbxKeyStream.size {
+                generateKeyStream()
+                keyStream.index = 0
+            }
+
+            let count = min(remaining, KdbxKeyStream.size - keyStream.index)
+            KdbxKeyStream.xor(output, keyStream.bytes + keyStream.index, count: count)
+
+            output += count
+            remaining -= count
+            keyStream.index += count
+        }
+    }
+
+    func protect(string: String) throws -> String {
+        var bytes = [UInt8](string.utf8)
+        bytes.withUnsafeMutableBytes { transform($0) }
+
+        return Data(bytes).base64EncodedString()
+    }
+
+    func unprotect(string: String) throws -> String {
+        guard var bytes = string.base64Decoded() else {
+            throw KdbxCrypto.CryptoError.dataError
+        }
+
+        bytes.withUnsafeMutableBytes { transform($0) }
+
+        guard let unprotectedString = String(bytes: bytes, encoding: .utf8) else {
+            throw KdbxCrypto.CryptoError.dataError
+        }
+
+        return unprotectedString
+    }
+
+    static func toUInt32(bytes: [UInt8], offset: Int) -> UInt32 {
+        let a = UInt32(bytes[offset])
+        let b = UInt32(bytes[offset + 1]) << 8
+        let c = UInt32(bytes[offset + 2]) << 16
+        let d = UInt32(bytes[offset + 3]) << 24
+        return a | b | c | d
+    }
+
+    @inline(__always) static func rotate(_ v: UInt32, _ c: UInt32) -> UInt32 {
+        return (v << c) | (v >> (32 - c))
+    }
+}
+
+final class Salsa20: KdbxBlockStreamCipher {
 
     private static let sigma = [UInt8]("expand 32-byte k".utf8)
     private static let tau = [UInt8]("expand 16-byte k".utf8)
 
     private let rounds: Int
-    private var index = 0
-    private var keyStream = [UInt8](repeating: 0, count: 64)
     private var state = [UInt32](repeating: 0, count: 16)
 
-    required init(key: [UInt8], iv: [UInt8], rounds: Int = 20) {
+    // Four blocks, word w of block l at [w * 4 + l]
+    private let input = UnsafeMutablePointer<UInt32>.allocate(capacity: 64)
+    private let x = UnsafeMutablePointer<UInt32>.allocate(capacity: 64)
+
+    let keyStream = KdbxKeyStream()
+
+    init(key: [UInt8], iv: [UInt8], rounds: Int = 20) {
         self.rounds = rounds
 
+        input.initialize(to: 0, count: 64)
+        x.initialize(to: 0, count: 64)
+
         setKeyIv(key, iv)
+    }
 
-        reset()
+    deinit {
+        memset(input, 0, 64 * 4)
+        memset(x, 0, 64 * 4)
+        input.deallocate(capacity: 64)
+        x.deallocate(capacity: 64)
     }
 
     private func setKeyIv(_ key: [UInt8], _ iv: [UInt8]) {
-        state[1] = toUInt32(bytes: key, offset: 0)
-        state[2] = toUInt32(bytes: key, offset: 4)
-        state[3] = toUInt32(bytes: key, offset: 8)
-        state[4] = toUInt32(bytes: key, offset: 12)
+        state[1] = Salsa20.toUInt32(bytes: key, offset: 0)
+        state[2] = Salsa20.toUInt32(bytes: key, offset: 4)
+        state[3] = Salsa20.toUInt32(bytes: key, offset: 8)
+        state[4] = Salsa20.toUInt32(bytes: key, offset: 12)
 
         let keyIndex = key.count - 16
 
-        state[11] = toUInt32(bytes: key, offset: keyIndex)
-        state[12] = toUInt32(bytes: key, offset: keyIndex + 4)
-        state[13] = toUInt32(bytes: key, offset: keyIndex + 8)
-        state[14] = toUInt32(bytes: key, offset: keyIndex + 12)
+        state[11] = Salsa20.toUInt32(bytes: key, offset: keyIndex)
+        state[12] = Salsa20.toUInt32(bytes: key, offset: keyIndex + 4)
+        state[13] = Salsa20.toUInt32(bytes: key, offset: keyIndex + 8)
+        state[14] = Salsa20.toUInt32(bytes: key, offset: keyIndex + 12)
 
         let constants = key.count == 32 ? Salsa20.sigma : Salsa20.tau
 
-        state[0] = toUInt32(bytes: constants, offset: 0)
-        state[5] = toUInt32(bytes: constants, offset: 4)
-        state[10] = toUInt32(bytes: constants, offset: 8)
-        state[15] = toUInt32(bytes: constants, offset: 12)
+        state[0] = Salsa20.toUInt32(bytes: constants, offset: 0)
+        state[5] = Salsa20.toUInt32(bytes: constants, offset: 4)
+        state[10] = Salsa20.toUInt32(bytes: constants, offset: 8)
+        state[15] = Salsa20.toUInt32(bytes: constants, offset: 12)
 
-        state[6] = toUInt32(bytes: iv, offset: 0)
-        state[7] = toUInt32(bytes: iv, offset: 4)
+        state[6] = Salsa20.toUInt32(bytes: iv, offset: 0)
+        state[7] = Salsa20.toUInt32(bytes: iv, offset: 4)
         state[8] = 0
         state[9] = 0
     }
 
-    private func toUInt32(bytes: [UInt8], offset: Int) -> UInt32 {
-        let a = UInt32(bytes[offset])
-        let b = UInt32(bytes[offset + 1]) << 8
-        let c = UInt32(bytes[offset + 2]) << 16
-        let d = UInt32(bytes[offset + 3]) << 24
-        return a | b | c | d
-    }
+    func generateKeyStream() {
+        for word in 0..<16 {
+            for lane in 0..<4 {
+                input[word * 4 + lane] = state[word]
+            }
+        }
 
-    func transformBlock(inputBuffer: [UInt8], inputOffset: Int, inputCount: Int, outputBuffer: inout [UInt8], outputOffset: Int) {
-        for i in 0..<inputCount {
-            outputBuffer[i + outputOffset] = keyStream[index] ^ inputBuffer[i + inputOffset]
-            index = (index + 1) & 63
+        // 64-bit block counter in words 8 and 9
+        let counter = UInt64(state[9]) << 32 | UInt64(state[8])
+        for lane in 0..<4 {
+            let laneCounter = counter &+ UInt64(lane)
+            input[8 * 4 + lane] = UInt32(truncatingIfNeeded: laneCounter)
+            input[9 * 4 + lane] = UInt32(truncatingIfNeeded: laneCounter >> 32)
+        }
 
-            if index == 0 {
-                state[8] = addOne(state[8])
-                if state[8] == 0 {
-                    state[9] = addOne(state[9])
-                }
+        let nextCounter = counter &+ 4
+        state[8] = UInt32(truncatingIfNeeded: nextCounter)
+        state[9] = UInt32(truncatingIfNeeded: nextCounter >> 32)
 
-                salsa20Core(input: state, output: &keyStream)
-            }
+        x.assign(from: input, count: 64)
+
+        for _ in stride(from: rounds, to: 0, by: -2) {
+            Salsa20.step(x, 04, 00, 12, 07)
+            Salsa20.step(x, 08, 04, 00, 09)
+            Salsa20.step(x, 12, 08, 04, 13)
+            Salsa20.step(x, 00, 12, 08, 18)
+            Salsa20.step(x, 09, 05, 01, 07)
+            Salsa20.step(x, 13, 09, 05, 09)
+            Salsa20.step(x, 01, 13, 09, 13)
+            Salsa20.step(x, 05, 01, 13, 18)
+            Salsa20.step(x, 14, 10, 06, 07)
+            Salsa20.step(x, 02, 14, 10, 09)
+            Salsa20.step(x, 06, 02, 14, 13)
+            Salsa20.step(x, 10, 06, 02, 18)
+            Salsa20.step(x, 03, 15, 11, 07)
+            Salsa20.step(x, 07, 03, 15, 09)
+            Salsa20.step(x, 11, 07, 03, 13)
+            Salsa20.step(x, 15, 11, 07, 18)
+            Salsa20.step(x, 01, 00, 03, 07)
+            Salsa20.step(x, 02, 01, 00, 09)
+            Salsa20.step(x, 03, 02, 01, 13)
+            Salsa20.step(x, 00, 03, 02, 18)
+            Salsa20.step(x, 06, 05, 04, 07)
+            Salsa20.step(x, 07, 06, 05, 09)
+            Salsa20.step(x, 04, 07, 06, 13)
+            Salsa20.step(x, 05, 04, 07, 18)
+            Salsa20.step(x, 11, 10, 09, 07)
+            Salsa20.step(x, 08, 11, 10, 09)
+            Salsa20.step(x, 09, 08, 11, 13)
+            Salsa20.step(x, 10, 09, 08, 18)
+            Salsa20.step(x, 12, 15, 14, 07)
+            Salsa20.step(x, 13, 12, 15, 09)
+            Salsa20.step(x, 14, 13, 12, 13)
+            Salsa20.step(x, 15, 14, 13, 18)
         }
+
+        keyStream.store(x, input)
     }
 
-    private func reset() {
-        index = 0
-        state[8] = 0
-        state[9] = 0
+    // x[target] ^= rotate(x[a] + x[b], shift), across all four blocks
+    @inline(__always) private static func step(_ x: UnsafeMutablePointer<UInt32>, _ target: Int, _ a: Int, _ b: Int, _ shift: UInt32) {
+        let t = x + target * 4
+        let p = x + a * 4
+        let q = x + b * 4
 
-        salsa20Core(input: state, output: &keyStream)
+        for lane in 0..<4 {
+            t[lane] ^= rotate(p[lane] &+ q[lane], shift)
+        }
     }
+}
 
-    private func addOne(_ v: UInt32) -> UInt32 {
-        return v &+ 1
-    }
+// ChaCha20 with a 96-bit nonce and 32-bit block counter (RFC 7539), used by
+// KDBX 4 both as the outer cipher and as the inner random stream.
+final class ChaCha20: KdbxBlockStreamCipher {
 
-    private func salsa20Core(input: [UInt32], output: inout [UInt8]) {
-        var x = input
-        for _ in stride(from: rounds, to: 0, by: -2) {
-            x[04] ^= rotate(add(x[00], x[12]), 07)
-            x[08] ^= rotate(add(x[04], x[00]), 09)
-            x[12] ^= rotate(add(x[08], x[04]), 13)
-            x[00] ^= rotate(add(x[12], x[08]), 18)
-            x[09] ^= rotate(add(x[05], x[01]), 07)
-            x[13] ^= rotate(add(x[09], x[05]), 09)
-            x[01] ^= rotate(add(x[13], x[09]), 13)
-            x[05] ^= rotate(add(x[01], x[13]), 18)
-            x[14] ^= rotate(add(x[10], x[06]), 07)
-            x[02] ^= rotate(add(x[14], x[10]), 09)
-            x[06] ^= rotate(add(x[02], x[14]), 13)
-            x[10] ^= rotate(add(x[06], x[02]), 18)
-            x[03] ^= rotate(add(x[15], x[11]), 07)
-            x[07] ^= rotate(add(x[03], x[15]), 09)
-            x[11] ^= rotate(add(x[07], x[03]), 13)
-            x[15] ^= rotate(add(x[11], x[07]), 18)
-            x[01] ^= rotate(add(x[00], x[03]), 07)
-            x[02] ^= rotate(add(x[01], x[00]), 09)
-            x[03] ^= rotate(add(x[02], x[01]), 13)
-            x[00] ^= rotate(add(x[03], x[02]), 18)
-            x[06] ^= rotate(add(x[05], x[04]), 07)
-            x[07] ^= rotate(add(x[06], x[05]), 09)
-            x[04] ^= rotate(add(x[07], x[06]), 13)
-            x[05] ^= rotate(add(x[04], x[07]), 18)
-            x[11] ^= rotate(add(x[10], x[09]), 07)
-            x[08] ^= rotate(add(x[11], x[10]), 09)
-            x[09] ^= rotate(add(x[08], x[11]), 13)
-            x[10] ^= rotate(add(x[09], x[08]), 18)
-            x[12] ^= rotate(add(x[15], x[14]), 07)
-            x[13] ^= rotate(add(x[12], x[15]), 09)
-            x[14] ^= rotate(add(x[13], x[12]), 13)
-            x[15] ^= rotate(add(x[14], x[13]), 18)
-        }
-
-        for i in 0..<16 {
-            toBytes(input: add(x[i], input[i]), output: &output, outputOffset: 4 * i)
-        }
-    }
-
-    private func rotate(_ v: UInt32, _ c: UInt32) -> UInt32 {
-        return (v << c) | (v >> (32 - c))
-    }
+    private static let sigma = [UInt8]("expand 32-byte k".utf8)
 
-    private func add(_ v: UInt32, _ w: UInt32) -> UInt32 {
-        return v &+ w
-    }
+    private var state = [UInt32](repeating: 0, count: 16)
 
-    private func toBytes(input: UInt32, output: inout [UInt8], outputOffset: Int) {
-        var littleEndian = input.littleEndian
-        let count = MemoryLayout<UInt32>.size
-        let bytePtr = withUnsafePointer(to: &littleEndian) {
-            $0.withMemoryRebound(to: UInt8.self, capacity: count) {
-                UnsafeBufferPointer(start: $0, count: count)
-            }
-        }
+    // Four blocks, word w of block l at [w * 4 + l]
+    private let input = UnsafeMutablePointer<UInt32>.allocate(capacity: 64)
+    private let x = UnsafeMutablePointer<UInt32>.allocate(capacity: 64)
 
-        let byteArray = [UInt8](bytePtr)
-        output[outputOffset] = byteArray[0]
-        output[outputOffset + 1] = byteArray[1]
-        output[outputOffset + 2] = byteArray[2]
-        output[outputOffset + 3] = byteArray[3]
-    }
+    let keyStream = KdbxKeyStream()
 
-    func protect(string: String) throws -> String {
-        let stringBytes = [UInt8](string.utf8)
+    init(key: [UInt8], nonce: [UInt8], counter: UInt32 = 0) {
+        precondition(key.count == 32 && nonce.count == 12)
 
-        var outputBuffer = [UInt8](repeating: 0, count: stringBytes.count)
-        transformBlock(inputBuffer: stringBytes, inputOffset: 0, inputCount: stringBytes.count, outputBuffer: &outputBuffer, outputOffset: 0)
+        input.initialize(to: 0, count: 64)
+        x.initialize(to: 0, count: 64)
 
-        let outputBufferData = Data(outputBuffer)
+        for i in 0..<4 {
+            state[i] = ChaCha20.toUInt32(bytes: ChaCha20.sigma, offset: 4 * i)
+        }
 
-        return outputBufferData.base64EncodedString()
+        for i in 0..<8 {
+            state[4 + i] = ChaCha20.toUInt32(bytes: key, offset: 4 * i)
+        }
+
+        state[12] = counter
+
+        for i in 0..<3 {
+            state[13 + i] = ChaCha20.toUInt32(bytes: nonce, offset: 4 * i)
+        }
     }
 
-    func unprotect(string: String) throws -> String {
-        guard let base64Decoded = string.base64Decoded() else {
-            throw KdbxCrypto.CryptoError.dataError
+    deinit {
+        memset(input, 0, 64 * 4)
+        memset(x, 0, 64 * 4)
+        input.deallocate(capacity: 64)
+        x.deallocate(capacity: 64)
+    }
+
+    func generateKeyStream() {
+        for word in 0..<16 {
+            for lane in 0..<4 {
+                input[word * 4 + lane] = state[word]
+            }
         }
 
-        var outputBuffer = [UInt8](repeating: 0, count: base64Decoded.count)
-        transformBlock(inputBuffer: base64Decoded, inputOffset: 0, inputCount: base64Decoded.count, outputBuffer: &outputBuffer, outputOffset: 0)
+        for lane in 0..<4 {
+            input[12 * 4 + lane] = state[12] &+ UInt32(lane)
+        }
 
-        guard let unprotectedString = String(bytes: outputBuffer, encoding: .utf8) else {
-            throw KdbxCrypto.CryptoError.dataError
+        state[12] = state[12] &+ 4
+
+        x.assign(from: input, count: 64)
+
+        for _ in 0..<10 {
+            ChaCha20.quarterRound(x, 0, 4, 8, 12)
+            ChaCha20.quarterRound(x, 1, 5, 9, 13)
+            ChaCha20.quarterRound(x, 2, 6, 10, 14)
+            ChaCha20.quarterRound(x, 3, 7, 11, 15)
+            ChaCha20.quarterRound(x, 0, 5, 10, 15)
+            ChaCha20.quarterRound(x, 1, 6, 11, 12)
+            ChaCha20.quarterRound(x, 2, 7, 8, 13)
+            ChaCha20.quarterRound(x, 3, 4, 9, 14)
         }
 
-        return unprotectedString
+        keyStream.store(x, input)
+    }
+
+    @inline(__always) private static func quarterRound(_ x: UnsafeMutablePointer<UInt32>, _ ai: Int, _ bi: Int, _ ci: Int, _ di: Int) {
+        let a = x + ai * 4
+        let b = x + bi * 4
+        let c = x + ci * 4
+        let d = x + di * 4
+
+        for lane in 0..<4 {
+            a[lane] = a[lane] &+ b[lane]
+            d[lane] = rotate(d[lane] ^ a[lane], 16)
+            c[lane] = c[lane] &+ d[lane]
+            b[lane] = rotate(b[lane] ^ c[lane], 12)
+            a[lane] = a[lane] &+ b[lane]
+            d[lane] = rotate(d[lane] ^ a[lane], 8)
+            c[lane] = c[lane] &+ d[lane]
+            b[lane] = rotate(b[lane] ^ c[lane], 7)
+        }
     }
 }
@@ -0,0 +1,84 @@
+//
+//  KdbxUUIDIndex.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Positions of every group and entry below a root group. A group is found by
+// the indices into each `groups` array on the way down to it, and an entry by
+// its group's path plus its index in that group's `entries`. History entries
+// share their entry's UUID and are not indexed.
+struct KdbxUUIDIndex {
+
+    struct EntryLocation {
+        var groupPath: [Int]
+        var index: Int
+
+        // Document order: a group's own entries come before those of its subgroups
+        func precedes(_ other: EntryLocation) -> Bool {
+            for (step, otherStep) in zip(groupPath, other.groupPath) where step != otherStep {
+                return step < otherStep
+            }
+
+            if groupPath.count != other.groupPath.count {
+                return groupPath.count < other.groupPath.count
+            }
+
+            return index < other.index
+        }
+    }
+
+    private(set) var groupPaths = [UUID: [Int]]()
+    private(set) var entryLocations = [UUID: EntryLocation]()
+
+    init(group: KdbxXml.Group) {
+        add(group: group, path: [])
+    }
+
+    // Indexes a group and everything below it
+    mutating func add(group: KdbxXml.Group, path: [Int]) {
+        groupPaths[group.uuid] = path
+
+        for (index, entry) in group.entries.enumerated() {
+            entryLocations[entry.uuid] = EntryLocation(groupPath: path, index: index)
+        }
+
+        for (index, subgroup) in group.groups.enumerated() {
+            add(group: subgroup, path: path + [index])
+        }
+    }
+
+    mutating func remove(group: KdbxXml.Group) {
+        groupPaths.removeValue(forKey: group.uuid)
+
+        for entry in group.entries {
+            entryLocations.removeValue(forKey: entry.uuid)
+        }
+
+        for subgroup in group.groups {
+            remove(group: subgroup)
+        }
+    }
+
+    mutating func add(entryUUID: UUID, groupPath: [Int], index: Int) {
+        entryLocations[entryUUID] = EntryLocation(groupPath: groupPath, index: index)
+    }
+
+    mutating func remove(entryUUID: UUID) {
+        entryLocations.removeValue(forKey: entryUUID)
+    }
+
+    // Removing from the middle of an array moves everything after it down by one
+    mutating func reindex(entriesOf group: KdbxXml.Group, path: [Int], from start: Int) {
+        for index in start..<group.entries.count {
+            entryLocations[group.entries[index].uuid] = EntryLocation(groupPath: path, index: index)
+        }
+    }
+
+    mutating func reindex(groupsOf group: KdbxXml.Group, path: [Int], from start: Int) {
+        for index in start..<group.groups.count {
+            add(group: group.groups[index], path: path + [index])
+        }
+    }
+}
@@ -0,0 +1,181 @@
+//
+//  KdbxVariantDictionary.swift
+//  GateKeeper
+//
+
+import Foundation
+
+struct KdbxVariantDictionary {
+
+    enum ValueType: UInt8 {
+        case end = 0x00
+        case uint32 = 0x04
+        case uint64 = 0x05
+        case bool = 0x08
+        case int32 = 0x0C
+        case int64 = 0x0D
+        case string = 0x18
+        case bytes = 0x42
+    }
+
+    enum Value {
+        case uint32(UInt32)
+        case uint64(UInt64)
+        case bool(Bool)
+        case int32(Int32)
+        case int64(Int64)
+        case string(String)
+        case bytes([UInt8])
+    }
+
+    enum ReadError: Error {
+        case unknownVersion
+        case unknownValueType
+        case invalidValue
+    }
+
+    static let version: UInt16 = 0x0100
+
+    private(set) var keys = [String]()
+    private var values = [String: Value]()
+
+    init() {
+    }
+
+    init(cursor: DataReadCursor) throws {
+        let version = try cursor.read() as UInt16
+
+        // Only the major version (high byte) is significant
+        guard version & 0xFF00 <= KdbxVariantDictionary.version & 0xFF00 else {
+            throw ReadError.unknownVersion
+        }
+
+        while true {
+            guard let valueType = ValueType(rawValue: try cursor.read() as UInt8) else {
+                throw ReadError.unknownValueType
+            }
+
+            if valueType == .end {
+                break
+            }
+
+            let keySize = Int(try cursor.read() as Int32)
+            let key = String(decoding: try cursor.readSlice(count: keySize), as: UTF8.self)
+            let valueSize = Int(try cursor.read() as Int32)
+            let valueBytes = try cursor.readSlice(count: valueSize)
+
+            let value: Value
+            switch valueType {
+            case .uint32:
+                value = .uint32(try KdbxVariantDictionary.integer(valueBytes))
+            case .uint64:
+                value = .uint64(try KdbxVariantDictionary.integer(valueBytes))
+            case .bool:
+                value = .bool(try KdbxVariantDictionary.integer(valueBytes) as UInt8 != 0)
+            case .int32:
+                value = .int32(try KdbxVariantDictionary.integer(valueBytes))
+            case .int64:
+                value = .int64(try KdbxVariantDictionary.integer(valueBytes))
+            case .string:
+                value = .string(String(decoding: valueBytes, as: UTF8.self))
+            case .bytes:
+                value = .bytes([UInt8](valueBytes))
+            case .end:
+                continue
+            }
+
+            self[key] = value
+        }
+    }
+
+    func write(to writeStream: DataWriteStream) throws {
+        try writeStream.write(KdbxVariantDictionary.version)
+
+        for key in keys {
+            guard let value = values[key] else {
+                continue
+            }
+
+            let (valueType, valueBytes) = KdbxVariantDictionary.encode(value)
+            let keyBytes = [UInt8](key.utf8)
+
+            try writeStream.write(valueType.rawValue)
+            try writeStream.write(Int32(keyBytes.count))
+            try writeStream.write(Data(bytes: keyBytes))
+            try writeStream.write(Int32(valueBytes.count))
+            try writeStream.write(Data(bytes: valueBytes))
+        }
+
+        try writeStream.write(ValueType.end.rawValue)
+    }
+
+    private static func encode(_ value: Value) -> (ValueType, [UInt8]) {
+        switch value {
+        case .uint32(let value):
+            return (.uint32, value.littleEndianBytes)
+        case .uint64(let value):
+            return (.uint64, value.littleEndianBytes)
+        case .bool(let value):
+            return (.bool, [value ? 1 : 0])
+        case .int32(let value):
+            return (.int32, value.littleEndianBytes)
+        case .int64(let value):
+            return (.int64, value.littleEndianBytes)
+        case .string(let value):
+            return (.string, [UInt8](value.utf8))
+        case .bytes(let value):
+            return (.bytes, value)
+        }
+    }
+
+    private static func integer<T: FixedWidthInteger>(_ bytes: UnsafeRawBufferPointer) throws -> T {
+        guard bytes.count == MemoryLayout<T>.size else {
+            throw ReadError.invalidValue
+        }
+
+        let cursor = DataReadCursor(buffer: bytes)
+        var value: T = 0
+        for shift in stride(from: 0, to: bytes.count * 8, by: 8) {
+            value |= T(try cursor.read() as UInt8) << T(shift)
+        }
+
+        return value
+    }
+
+    subscript(key: String) -> Value? {
+        get {
+            return values[key]
+        }
+        set {
+            if let newValue = newValue {
+                if values[key] == nil {
+                    keys.append(key)
+                }
+                values[key] = newValue
+            } else if values.removeValue(forKey: key) != nil {
+                keys = keys.filter { $0 != key }
+            }
+        }
+    }
+
+    func uint32(_ key: String) -> UInt32? {
+        if case .some(.uint32(let value)) = self[key] {
+            return value
+        }
+        return nil
+    }
+
+    func uint64(_ key: String) -> UInt64? {
+        if case .some(.uint64(let value)) = self[key] {
+            return value
+        }
+        return nil
+    }
+
+    func bytes(_ key: String) -> [UInt8]? {
+        if case .some(.bytes(let value)) = self[key] {
+            return value
+        }
+        return nil
+    }
+}
@@ -54,8 +54,6 @@ class KdbxXml {
 
             if let association = association {
                 elem.addChild(association.build())
-            } else {
-                elem.addChild(name: "Association")
             }
 
             return elem
@@ -67,6 +65,8 @@ class KdbxXml {
         var id: String
         var compressed: Bool
         var content: String
+        // Set for KDBX 4 inner header binaries flagged protected; XML binaries have no such flag
+        var isProtected: Bool
 
         static func parse(elem: AEXMLElement) -> Binary? {
 
@@ -77,7 +77,8 @@ class KdbxXml {
             return Binary(
                 id: id,
                 compressed: elem.attributes["Compressed"]?.xmlBool ?? false,
-                content: elem.string
+                content: elem.string,
+                isProtected: false
             )
         }
 
@@ -103,10 +104,10 @@ class KdbxXml {
             )
         }
 
-        func build() -> AEXMLElement {
+        func build(dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "DeletedObject")
             elem.addChild(name: "UUID", value: uuid.data.base64EncodedString(), attributes: [:])
-            elem.addChild(name: "DeletionTime", value: deletionTime?.xmlString, attributes: [:])
+            elem.addChild(name: "DeletionTime", value: deletionTime?.xmlString(format: dateFormat), attributes: [:])
             return elem
         }
     }
@@ -158,7 +159,7 @@ class KdbxXml {
             )
         }
 
-        func build(includeHistory: Bool) -> AEXMLElement {
+        func build(includeHistory: Bool, dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "Entry")
             elem.addChild(name: "UUID", value: uuid.data.base64EncodedString(), attributes: [:])
             elem.addChild(name: "IconID", value: iconId.xmlString, attributes: [:])
@@ -166,16 +167,18 @@ class KdbxXml {
             elem.addChild(name: "BackgroundColor", value: backgroundColor, attributes: [:])
             elem.addChild(name: "OverrideURL", value: overrideURL, attributes: [:])
             elem.addChild(name: "Tags", value: tags, attributes: [:])
-            elem.addChild(times.build())
+            elem.addChild(times.build(dateFormat: dateFormat))
 
             for str in strings {
                 elem.addChild(str.build())
             }
 
+            elem.addChild(autoType.build())
+
             if includeHistory {
                 let historyElem = elem.addChild(name: "History")
                 for entry in histories {
-                    let entry = entry.build(includeHistory: false)
+                    let entry = entry.build(includeHistory: false, dateFormat: dateFormat)
                     historyElem.addChild(entry)
                 }
             }
@@ -255,6 +258,24 @@ class KdbxXml {
             )
         }
 
+        // Paths index into `groups` level by level, see KdbxUUIDIndex
+        func group(at path: ArraySlice<Int>) -> Group {
+            guard let index = path.first else {
+                return self
+            }
+
+            return groups[index].group(at: path.dropFirst())
+        }
+
+        mutating func modifyGroup(at path: ArraySlice<Int>, _ body: (inout Group) -> Void) {
+            guard let index = path.first else {
+                body(&self)
+                return
+            }
+
+            groups[index].modifyGroup(at: path.dropFirst(), body)
+        }
+
         mutating func add(groupUUID: UUID, entry: Entry) {
             if uuid == groupUUID {
                 entries.append(entry)
@@ -275,13 +296,13 @@ class KdbxXml {
             }
         }
 
-        func build() -> AEXMLElement {
+        func build(dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "Group")
             elem.addChild(name: "UUID", value: uuid.data.base64EncodedString(), attributes: [:])
             elem.addChild(name: "Name", value: name, attributes: [:])
             elem.addChild(name: "Notes", value: notes, attributes: [:])
             elem.addChild(name: "IconID", value: iconId.xmlString, attributes: [:])
-            elem.addChild(times.build())
+            elem.addChild(times.build(dateFormat: dateFormat))
             elem.addChild(name: "IsExpanded", value: isExpanded.xmlString, attributes: [:])
             elem.addChild(name: "DefaultAutoTypeSequence", value: defaultAutoTypeSequence, attributes: [:])
             elem.addChild(name: "EnableAutoType", value: enableAutoType.xmlString, attributes: [:])
@@ -289,11 +310,11 @@ class KdbxXml {
             elem.addChild(name: "LastTopVisibleEntry", value: lastTopVisibleEntry, attributes: [:])
 
             for group in groups {
-                elem.addChild(group.build())
+                elem.addChild(group.build(dateFormat: dateFormat))
             }
 
             for entry in entries {
-                elem.addChild(entry.build(includeHistory: true))
+                elem.addChild(entry.build(includeHistory: true, dateFormat: dateFormat))
             }
 
             return elem
@@ -402,11 +423,9 @@ class KdbxXml {
 
         mutating func update(group: Group) {
             if let index = groups.index(where: { $0.uuid == group.uuid }) {
-                print("update group replacing entry at \(index) on '\(groups[index].name)'")
                 groups[index] = group
             } else {
                 for index in groups.indices {
-                    print("update group checking subgroup \(index) of '\(groups[index].name)'")
                     groups[index].update(group: group)
                 }
             }
@@ -414,11 +433,9 @@ class KdbxXml {
 
         mutating func update(entry: Entry) {
             if let index = entries.index(where: { $0.uuid == entry.uuid }) {
-                print("update entry replacing entry at \(index) on '\(name)'")
                 entries[index] = entry
             } else {
                 for index in groups.indices {
-                    print("update entry checking subgroup \(index) of '\(name)'")
                     groups[index].update(entry: entry)
                 }
             }
@@ -428,7 +445,27 @@ class KdbxXml {
     struct KeePassFile {
 
         var meta: Meta
-        var root: Root
+
+        // Replacing the root (or editing it directly) reindexes the whole tree,
+        // the mutating methods below keep the index in step instead
+        var root: Root {
+            get {
+                return storedRoot
+            }
+            set {
+                storedRoot = newValue
+                uuidIndex = KdbxUUIDIndex(group: newValue.group)
+            }
+        }
+
+        private var storedRoot: Root
+        private var uuidIndex: KdbxUUIDIndex
+
+        init(meta: Meta, root: Root) {
+            self.meta = meta
+            self.storedRoot = root
+            self.uuidIndex = KdbxUUIDIndex(group: root.group)
+        }
 
         static func parse(elem: AEXMLElement) -> KeePassFile {
             let meta = Meta.parse(elem: elem["Meta"])
@@ -436,10 +473,137 @@ class KdbxXml {
             return KeePassFile(meta: meta, root: root)
         }
 
-        func build() -> AEXMLElement {
+        func get(groupUUID: UUID) -> Group? {
+            guard let path = uuidIndex.groupPaths[groupUUID] else {
+                return nil
+            }
+
+            return storedRoot.group.group(at: path[...])
+        }
+
+        func get(entryUUID: UUID) -> Entry? {
+            guard let location = uuidIndex.entryLocations[entryUUID] else {
+                return nil
+            }
+
+            return storedRoot.group.group(at: location.groupPath[...]).entries[location.index]
+        }
+
+        // Whether the first entry comes before the second in a tree walk; false when either is missing
+        func entry(_ entryUUID: UUID, precedes otherUUID: UUID) -> Bool {
+            guard let location = uuidIndex.entryLocations[entryUUID], let other = uuidIndex.entryLocations[otherUUID] else {
+                return false
+            }
+
+            return location.precedes(other)
+        }
+
+        // The entries that exist, in the order a tree walk would visit them
+        func entries(uuids: [UUID]) -> [Entry] {
+            let locations = uuids.flatMap { uuidIndex.entryLocations[$0] }.sorted { $0.precedes($1) }
+
+            return locations.map { storedRoot.group.group(at: $0.groupPath[...]).entries[$0.index] }
+        }
+
+        mutating func add(groupUUID: UUID, entry: Entry) {
+            guard let path = uuidIndex.groupPaths[groupUUID] else {
+                return
+            }
+
+            var index = 0
+            storedRoot.group.modifyGroup(at: path[...]) { group in
+                index = group.entries.count
+                group.entries.append(entry)
+            }
+
+            uuidIndex.add(entryUUID: entry.uuid, groupPath: path, index: index)
+        }
+
+        mutating func add(groupUUID: UUID, group: Group) {
+            guard let path = uuidIndex.groupPaths[groupUUID] else {
+                return
+            }
+
+            var index = 0
+            storedRoot.group.modifyGroup(at: path[...]) { parent in
+                index = parent.groups.count
+                parent.groups.append(group)
+            }
+
+            uuidIndex.add(group: group, path: path + [index])
+        }
+
+        // The root group itself cannot be deleted
+        mutating func delete(groupUUID: UUID) {
+            guard let path = uuidIndex.groupPaths[groupUUID], let index = path.last else {
+                return
+            }
+
+            let parentPath = Array(path.dropLast())
+
+            var removed: Group?
+            var parent: Group?
+            storedRoot.group.modifyGroup(at: parentPath[...]) { group in
+                removed = group.groups.remove(at: index)
+                parent = group
+            }
+
+            if let removed = removed, let parent = parent {
+                uuidIndex.remove(group: removed)
+                uuidIndex.reindex(groupsOf: parent, path: parentPath, from: index)
+            }
+        }
+
+        mutating func delete(entryUUID: UUID) {
+            guard let location = uuidIndex.entryLocations[entryUUID] else {
+                return
+            }
+
+            var group: Group?
+            storedRoot.group.modifyGroup(at: location.groupPath[...]) { parent in
+                parent.entries.remove(at: location.index)
+                group = parent
+            }
+
+            uuidIndex.remove(entryUUID: entryUUID)
+
+            if let group = group {
+                uuidIndex.reindex(entriesOf: group, path: location.groupPath, from: location.index)
+            }
+        }
+
+        mutating func update(entry: Entry) {
+            guard let location = uuidIndex.entryLocations[entry.uuid] else {
+                return
+            }
+
+            storedRoot.group.modifyGroup(at: location.groupPath[...]) { group in
+                group.entries[location.index] = entry
+            }
+        }
+
+        // Replaces the group with everything below it, as passed in
+        mutating func update(group: Group) {
+            guard let path = uuidIndex.groupPaths[group.uuid] else {
+                return
+            }
+
+            var previous: Group?
+            storedRoot.group.modifyGroup(at: path[...]) { current in
+                previous = current
+                current = group
+            }
+
+            if let previous = previous {
+                uuidIndex.remove(group: previous)
+            }
+            uuidIndex.add(group: group, path: path)
+        }
+
+        func build(dateFormat: XmlDateFormatter.Format = .iso8601) -> AEXMLElement {
             let elem = AEXMLElement(name: "KeePassFile")
-            elem.addChild(meta.build())
-            elem.addChild(root.build())
+            elem.addChild(meta.build(dateFormat: dateFormat))
+            elem.addChild(root.build(dateFormat: dateFormat))
             return elem
         }
     }
@@ -538,26 +702,26 @@ class KdbxXml {
             )
         }
 
-        func build() -> AEXMLElement {
+        func build(dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "Meta")
             elem.addChild(name: "Generator", value: "KdbxSwift", attributes: [:])
             elem.addChild(name: "DatabaseName", value: databaseName, attributes: [:])
-            elem.addChild(name: "DatabaseNameChanged", value: databaseNameChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "DatabaseNameChanged", value: databaseNameChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "DatabaseDescription", value: databaseDescription, attributes: [:])
-            elem.addChild(name: "DatabaseDescriptionChanged", value: databaseDescriptionChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "DatabaseDescriptionChanged", value: databaseDescriptionChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "DefaultUserName", value: defaultUsername, attributes: [:])
-            elem.addChild(name: "DefaultUserNameChanged", value: defaultUsernameChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "DefaultUserNameChanged", value: defaultUsernameChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "MaintenanceHistoryDays", value: maintenanceHistoryDays.xmlString, attributes: [:])
             elem.addChild(name: "Color", value: color, attributes: [:])
-            elem.addChild(name: "MasterKeyChanged", value: masterKeyChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "MasterKeyChanged", value: masterKeyChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "MasterKeyChangeRec", value: masterKeyChangeRec.xmlString, attributes: [:])
             elem.addChild(name: "MasterKeyChangeForce", value: masterKeyChangeForce.xmlString, attributes: [:])
             elem.addChild(memoryProtection.build())
             elem.addChild(name: "RecycleBinEnabled", value: recycleBinEnabled.xmlString, attributes: [:])
             elem.addChild(name: "RecycleBinUUID", value: recycleBinUUID?.data.base64EncodedString() ?? "", attributes: [:])
-            elem.addChild(name: "RecycleBinChanged", value: recycleBinChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "RecycleBinChanged", value: recycleBinChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "EntryTemplatesGroup", value: entryTemplatesGroup, attributes: [:])
-            elem.addChild(name: "EntryTemplatesGroupChanged", value: entryTemplatesGroupChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "EntryTemplatesGroupChanged", value: entryTemplatesGroupChanged?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "HistoryMaxItems", value: historyMaxItems.xmlString, attributes: [:])
             elem.addChild(name: "HistoryMaxSize", value: historyMaxSize.xmlString, attributes: [:])
             elem.addChild(name: "LastSelectedGroup", value: lastSelectedGroup, attributes: [:])
@@ -579,37 +743,7 @@ class KdbxXml {
         var deletedObjects: [DeletedObject]
 
         static func parse(elem: AEXMLElement) -> Root {
-            let group: Group
-            if let groupElem = elem["Group"].first {
-                group = Group.parse(elem: groupElem)
-            } else {
-                let now = Date()
-
-                let times = KdbxXml.Times(
-                    lastModificationTime: now,
-                    creationTime: now,
-                    lastAccessTime: now,
-                    expiryTime: now,
-                    expires: false,
-                    usageCount: 0,
-                    locationChanged: nil
-                )
-
-                group = Group(
-                    uuid: UUID(),
-                    name: "GateKeeper",
-                    notes: "",
-                    iconId: 49,
-                    times: times,
-                    isExpanded: true,
-                    defaultAutoTypeSequence: nil,
-                    enableAutoType: false,
-                    enableSearching: true,
-                    lastTopVisibleEntry: "",
-                    groups: [],
-                    entries: []
-                )
-            }
+            let group = elem["Group"].first.map { Group.parse(elem: $0) } ?? makeDefaultGroup()
 
             var deletedObjects = [DeletedObject]()
             if let children = elem["DeletedObjects"]["DeletedObject"].all {
@@ -622,14 +756,43 @@ class KdbxXml {
             return Root(group: group, deletedObjects: deletedObjects)
         }
 
-        func build() -> AEXMLElement {
+        static func makeDefaultGroup() -> Group {
+            let now = Date()
+
+            let times = KdbxXml.Times(
+                lastModificationTime: now,
+                creationTime: now,
+                lastAccessTime: now,
+                expiryTime: now,
+                expires: false,
+                usageCount: 0,
+                locationChanged: nil
+            )
+
+            return Group(
+                uuid: UUID(),
+                name: "GateKeeper",
+                notes: "",
+                iconId: 49,
+                times: times,
+                isExpanded: true,
+                defaultAutoTypeSequence: nil,
+                enableAutoType: false,
+                enableSearching: true,
+                lastTopVisibleEntry: "",
+                groups: [],
+                entries: []
+            )
+        }
+
+        func build(dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "Root")
 
-            elem.addChild(group.build())
+            elem.addChild(group.build(dateFormat: dateFormat))
 
             let deletedObjectsElem = elem.addChild(name: "DeletedObjects")
             for deletedObject in deletedObjects {
-                deletedObjectsElem.addChild(deletedObject.build())
+                deletedObjectsElem.addChild(deletedObject.build(dateFormat: dateFormat))
             }
 
             return elem
@@ -680,59 +843,62 @@ class KdbxXml {
             )
         }
 
-        func build() -> AEXMLElement {
+        func build(dateFormat: XmlDateFormatter.Format) -> AEXMLElement {
             let elem = AEXMLElement(name: "Times")
-            elem.addChild(name: "LastModificationTime", value: lastModificationTime?.xmlString, attributes: [:])
-            elem.addChild(name: "CreationTime", value: creationTime?.xmlString, attributes: [:])
-            elem.addChild(name: "LastAccessTime", value: lastAccessTime?.xmlString, attributes: [:])
-            elem.addChild(name: "ExpiryTime", value: expiryTime?.xmlString, attributes: [:])
+            elem.addChild(name: "LastModificationTime", value: lastModificationTime?.xmlString(format: dateFormat), attributes: [:])
+            elem.addChild(name: "CreationTime", value: creationTime?.xmlString(format: dateFormat), attributes: [:])
+            elem.addChild(name: "LastAccessTime", value: lastAccessTime?.xmlString(format: dateFormat), attributes: [:])
+            elem.addChild(name: "ExpiryTime", value: expiryTime?.xmlString(format: dateFormat), attributes: [:])
             elem.addChild(name: "Expires", value: expires.xmlString, attributes: [:])
             elem.addChild(name: "UsageCount", value: usageCount.xmlString, attributes: [:])
-            elem.addChild(name: "LocationChanged", value: locationChanged?.xmlString, attributes: [:])
+            elem.addChild(name: "LocationChanged", value: locationChanged?.xmlString(format: dateFormat), attributes: [:])
             return elem
         }
     }
 
     class XmlDateFormatter {
 
+        enum Format {
+            case iso8601
+            case base64Ticks
+        }
+
         var formatter = DateFormatter()
 
         static var sharedInstance = XmlDateFormatter()
 
-        func to(date: Date) -> String {
-            return formatter.string(from: date)
+        static let ticksTo1970 = Int64(62135596800)
+
+        func to(date: Date, format: Format = .iso8601) -> String {
+            switch format {
+            case .iso8601:
+                return formatter.string(from: date)
+            case .base64Ticks:
+                let seconds = Int64(date.timeIntervalSince1970.rounded(.down)) + XmlDateFormatter.ticksTo1970
+                return Data(bytes: seconds.littleEndianBytes).base64EncodedString()
+            }
         }
 
         func from(string: String) -> Date? {
-            return formatter.date(from: string)
-        }
+            if let date = formatter.date(from: string) {
+                return date
+            }
 
-        init() {
-            formatter.locale = Locale(identifier: "en_US_POSIX")
-            formatter.dateFormat = "yyyy-MM-dd'T'HH:mm:ss'Z'"
-        }
-    }
+            // KDBX 4 stores times as base64 of little-endian seconds since 0001-01-01
+            guard let data = Data(base64Encoded: string), data.count == 8 else {
+                return nil
+            }
 
-    static func unprotect(elem: AEXMLElement, streamCipher: KdbxStreamCipher) throws {
-        for child in elem.children {
-            if child.name == "Value" {
-                if child.attributes["Protected"]?.xmlBool ?? false {
-                    child.value = try streamCipher.unprotect(string: child.value ?? "")
-                    child.attributes.removeValue(forKey: "Protected")
-                }
+            let seconds = try? DataReadCursor.with(data: data) { cursor in
+                return try cursor.read() as Int64
             }
 
-            try unprotect(elem: child, streamCipher: streamCipher)
+            return seconds.map { Date(timeIntervalSince1970: TimeInterval($0 - XmlDateFormatter.ticksTo1970)) }
         }
-    }
 
-    static func parse(data: Data, streamCipher: KdbxStreamCipher?) throws -> KeePassFile {
-        let xmlDoc = try AEXMLDocument(xml: data)
-
-        if let streamCipher = streamCipher {
-            try unprotect(elem: xmlDoc.root, streamCipher: streamCipher)
+        init() {
+            formatter.locale = Locale(identifier: "en_US_POSIX")
+            formatter.dateFormat = "yyyy-MM-dd'T'HH:mm:ss'Z'"
         }
-
-        return KeePassFile.parse(elem: xmlDoc.root)
     }
 }
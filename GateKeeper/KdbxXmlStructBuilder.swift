@@ -0,0 +1,502 @@
+//
+//  KdbxXmlStructBuilder.swift
+//  GateKeeper
+//
+
+import Foundation
+
+extension KdbxXml {
+
+    // Builds a KeePassFile straight from tokenizer events, without an
+    // intermediate document. Every element is classified once when it starts
+    // and leaf text is stored into the struct being built when it ends.
+    // Protected values are unprotected as they end, which is the document
+    // order the inner stream was applied in.
+    final class StructBuilder: KdbxXmlTokenizerDelegate {
+
+        typealias StreamCipherProvider = () throws -> KdbxStreamCipher?
+
+        private enum Context {
+            case document
+            case keePassFile
+            case meta
+            case memoryProtection
+            case binaries
+            case binary
+            case root
+            case deletedObjects
+            case deletedObject
+            case group
+            case entry
+            case history
+            case times
+            case autoType
+            case association
+            case string
+            case field
+            case skipped
+        }
+
+        private let streamCipherProvider: StreamCipherProvider
+        private var streamCipher: KdbxStreamCipher?
+        private var isStreamCipherResolved = false
+
+        private var contexts = [Context.document]
+        private var text = ""
+        private var isProtectedValue = false
+        private var scratch = [UInt8]()
+
+        private var meta = StructBuilder.makeMeta()
+        private var rootGroup: Group?
+        private var deletedObjects = [DeletedObject]()
+        private var deletedObject = StructBuilder.makeDeletedObject()
+        private var binary: Binary?
+        private var groups = [Group]()
+        private var entries = [Entry]()
+        private var times = StructBuilder.makeTimes()
+        private var autoType = StructBuilder.makeAutoType()
+        private var association: Association?
+        private var str = Str(key: "", value: "", isProtected: false)
+
+        var database: KeePassFile {
+            return KeePassFile(meta: meta, root: Root(group: rootGroup ?? Root.makeDefaultGroup(), deletedObjects: deletedObjects))
+        }
+
+        init(streamCipher: KdbxStreamCipher?) {
+            streamCipherProvider = { streamCipher }
+        }
+
+        // For KDBX 4 the inner stream is only known once the inner header has
+        // been read, which completes before the first XML byte arrives
+        init(streamCipherProvider: @escaping StreamCipherProvider) {
+            self.streamCipherProvider = streamCipherProvider
+        }
+
+        deinit {
+            scratch.withUnsafeMutableBytes { _ = memset($0.baseAddress, 0, $0.count) }
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, didStartElement name: String, attributes: [String: String]) throws {
+            if !isStreamCipherResolved {
+                streamCipher = try streamCipherProvider()
+                isStreamCipherResolved = true
+            }
+
+            let parent = contexts[contexts.count - 1]
+            let context = self.context(name: name, parent: parent)
+
+            switch context {
+            case .binary:
+                binary = attributes["ID"].map { Binary(id: $0, compressed: attributes["Compressed"]?.xmlBool ?? false, content: "", isProtected: false) }
+            case .deletedObject:
+                deletedObject = StructBuilder.makeDeletedObject()
+            case .group:
+                groups.append(StructBuilder.makeGroup())
+            case .entry:
+                entries.append(StructBuilder.makeEntry())
+            case .times:
+                times = StructBuilder.makeTimes()
+            case .autoType:
+                autoType = StructBuilder.makeAutoType()
+            case .association:
+                association = Association(window: "", keystrokeSequence: "")
+            case .string:
+                str = Str(key: "", value: "", isProtected: false)
+            default:
+                break
+            }
+
+            // Protected values anywhere in the document advance the inner stream
+            if name == "Value" {
+                isProtectedValue = attributes["Protected"]?.xmlBool ?? false
+
+                if parent == .string {
+                    str.isProtected = isProtectedValue
+                }
+            }
+
+            text = ""
+            contexts.append(context)
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, didEndElement name: String) throws {
+            let context = contexts.removeLast()
+            let parent = contexts[contexts.count - 1]
+
+            if name == "Value" && isProtectedValue {
+                isProtectedValue = false
+
+                if streamCipher != nil {
+                    let value = try unprotect(string: StructBuilder.trimmed(text))
+
+                    if parent == .string {
+                        str.value = value
+                    }
+
+                    text = ""
+                    return
+                }
+            }
+
+            switch context {
+            case .field:
+                store(field: name, value: StructBuilder.trimmed(text), parent: parent)
+            case .binary:
+                if var binary = binary {
+                    binary.content = StructBuilder.trimmed(text)
+                    meta.binaries.append(binary)
+                }
+                binary = nil
+            case .deletedObject:
+                deletedObjects.append(deletedObject)
+            case .group:
+                let group = groups.removeLast()
+
+                if parent == .root {
+                    rootGroup = group
+                } else {
+                    groups[groups.count - 1].groups.append(group)
+                }
+            case .entry:
+                let entry = entries.removeLast()
+
+                if parent == .history {
+                    entries[entries.count - 1].histories.append(entry)
+                } else {
+                    groups[groups.count - 1].entries.append(entry)
+                }
+            case .times:
+                if parent == .group {
+                    groups[groups.count - 1].times = times
+                } else {
+                    entries[entries.count - 1].times = times
+                }
+            case .autoType:
+                entries[entries.count - 1].autoType = autoType
+            case .association:
+                // Only the first association is kept, as before
+                if autoType.association == nil {
+                    autoType.association = association
+                }
+            case .string:
+                entries[entries.count - 1].strings.append(str)
+            default:
+                break
+            }
+
+            text = ""
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, foundCharacters string: String) throws {
+            // A protected value is decoded even where it is discarded, since it
+            // still took its length from the inner stream
+            if isProtectedValue {
+                text.append(string)
+                return
+            }
+
+            switch contexts[contexts.count - 1] {
+            case .field, .binary:
+                text.append(string)
+            default:
+                break
+            }
+        }
+
+        private func context(name: String, parent: Context) -> Context {
+            switch (parent, name) {
+            case (.document, "KeePassFile"):
+                return .keePassFile
+            case (.keePassFile, "Meta"):
+                return .meta
+            case (.keePassFile, "Root"):
+                return .root
+            case (.meta, "MemoryProtection"):
+                return .memoryProtection
+            case (.meta, "Binaries"):
+                return .binaries
+            case (.binaries, "Binary"):
+                return .binary
+            case (.root, "Group"):
+                // Only the first root group is kept, as before
+                return rootGroup == nil ? .group : .skipped
+            case (.root, "DeletedObjects"):
+                return .deletedObjects
+            case (.deletedObjects, "DeletedObject"):
+                return .deletedObject
+            case (.group, "Group"):
+                return .group
+            case (.group, "Entry"), (.history, "Entry"):
+                return .entry
+            case (.group, "Times"), (.entry, "Times"):
+                return .times
+            case (.entry, "AutoType"):
+                return .autoType
+            case (.entry, "String"):
+                return .string
+            case (.entry, "History"):
+                return .history
+            case (.autoType, "Association"):
+                return .association
+            case (.meta, _), (.memoryProtection, _), (.deletedObject, _), (.group, _), (.entry, _),
+                 (.times, _), (.autoType, _), (.association, _), (.string, _):
+                return .field
+            default:
+                return .skipped
+            }
+        }
+
+        private func store(field name: String, value: String, parent: Context) {
+            switch parent {
+            case .meta:
+                store(metaField: name, value: value)
+            case .memoryProtection:
+                switch name {
+                case "ProtectTitle": meta.memoryProtection.isTitleProtected = value == "True"
+                case "ProtectUserName": meta.memoryProtection.isUsernameProtected = value == "True"
+                case "ProtectPassword": meta.memoryProtection.isPasswordProtected = value == "True"
+                case "ProtectURL": meta.memoryProtection.isUrlProtected = value == "True"
+                case "ProtectNotes": meta.memoryProtection.isNotesProtected = value == "True"
+                default: break
+                }
+            case .deletedObject:
+                switch name {
+                case "UUID": deletedObject.uuid = value.base64Decoded()?.uuid() ?? deletedObject.uuid
+                case "DeletionTime": deletedObject.deletionTime = value.xmlDate
+                default: break
+                }
+            case .group:
+                store(groupField: name, value: value)
+            case .entry:
+                store(entryField: name, value: value)
+            case .times:
+                switch name {
+                case "LastModificationTime": times.lastModificationTime = value.xmlDate
+                case "CreationTime": times.creationTime = value.xmlDate
+                case "LastAccessTime": times.lastAccessTime = value.xmlDate
+                case "ExpiryTime": times.expiryTime = value.xmlDate
+                case "Expires": times.expires = value == "True"
+                case "UsageCount": times.usageCount = Int(value) ?? 0
+                case "LocationChanged": times.locationChanged = value.xmlDate
+                default: break
+                }
+            case .autoType:
+                switch name {
+                case "Enabled": autoType.enabled = value == "True"
+                case "DataTransferObfuscation": autoType.dataTransferObfuscation = Int(value) ?? 0
+                default: break
+                }
+            case .association:
+                switch name {
+                case "Window": association?.window = value
+                case "KeystrokeSequence": association?.keystrokeSequence = value
+                default: break
+                }
+            case .string:
+                switch name {
+                case "Key": str.key = value
+                case "Value": str.value = value
+                default: break
+                }
+            default:
+                break
+            }
+        }
+
+        private func store(metaField name: String, value: String) {
+            switch name {
+            case "Generator": meta.generator = value
+            case "DatabaseName": meta.databaseName = value
+            case "DatabaseNameChanged": meta.databaseNameChanged = value.xmlDate
+            case "DatabaseDescription": meta.databaseDescription = value
+            case "DatabaseDescriptionChanged": meta.databaseDescriptionChanged = value.xmlDate
+            case "DefaultUserName": meta.defaultUsername = value
+            case "DefaultUserNameChanged": meta.defaultUsernameChanged = value.xmlDate
+            case "MaintenenceHistoryDays": meta.maintenanceHistoryDays = Int(value) ?? 365
+            case "Color": meta.color = value
+            case "MasterKeyChanged": meta.masterKeyChanged = value.xmlDate
+            case "MasterKeyChangeRec": meta.masterKeyChangeRec = Int(value) ?? -1
+            case "MasterKeyChangeForce": meta.masterKeyChangeForce = Int(value) ?? -1
+            case "RecycleBinEnabled": meta.recycleBinEnabled = value == "True"
+            case "RecycleBinUUID": meta.recycleBinUUID = value.base64Decoded()?.uuid()
+            case "RecycleBinChanged": meta.recycleBinChanged = value.xmlDate
+            case "EntryTemplatesGroup": meta.entryTemplatesGroup = value
+            case "EntryTemplatesGroupChanged": meta.entryTemplatesGroupChanged = value.xmlDate
+            case "HistoryMaxItems": meta.historyMaxItems = Int(value) ?? 10
+            case "HistoryMaxSize": meta.historyMaxSize = Int(value) ?? 6291456
+            case "LastSelectedGroup": meta.lastSelectedGroup = value
+            case "LastTopVisibleGroup": meta.lastTopVisibleGroup = value
+            case "CustomData": meta.customData = value
+            default: break
+            }
+        }
+
+        private func store(groupField name: String, value: String) {
+            let index = groups.count - 1
+
+            switch name {
+            case "UUID": groups[index].uuid = value.base64Decoded()?.uuid() ?? groups[index].uuid
+            case "Name": groups[index].name = value
+            case "Notes": groups[index].notes = value
+            case "IconID": groups[index].iconId = Int(value) ?? 49
+            case "IsExpanded": groups[index].isExpanded = value == "True"
+            case "DefaultAutoTypeSequence": groups[index].defaultAutoTypeSequence = value
+            case "EnableAutoType": groups[index].enableAutoType = value == "True"
+            case "EnableSearching": groups[index].enableSearching = value == "True"
+            case "LastTopVisibleEntry": groups[index].lastTopVisibleEntry = value
+            default: break
+            }
+        }
+
+        private func store(entryField name: String, value: String) {
+            let index = entries.count - 1
+
+            switch name {
+            case "UUID": entries[index].uuid = value.base64Decoded()?.uuid() ?? entries[index].uuid
+            case "IconID": entries[index].iconId = Int(value) ?? 0
+            case "ForegroundColor": entries[index].foregroundColor = value
+            case "BackgroundColor": entries[index].backgroundColor = value
+            case "OverrideURL": entries[index].overrideURL = value
+            case "Tags": entries[index].tags = value
+            default: break
+            }
+        }
+
+        private func unprotect(string: String) throws -> String {
+            guard let streamCipher = streamCipher else {
+                return string
+            }
+
+            // Decode into a reused buffer so no per-value allocation is made
+            scratch.removeAll(keepingCapacity: true)
+
+            if !string.base64Decode(appendingTo: &scratch) {
+                guard let bytes = string.base64Decoded() else {
+                    throw KdbxCrypto.CryptoError.dataError
+                }
+                scratch.append(contentsOf: bytes)
+            }
+
+            defer {
+                scratch.withUnsafeMutableBytes { _ = memset($0.baseAddress, 0, $0.count) }
+            }
+
+            scratch.withUnsafeMutableBytes { streamCipher.transform($0) }
+
+            guard let unprotectedString = String(bytes: scratch, encoding: .utf8) else {
+                throw KdbxCrypto.CryptoError.dataError
+            }
+
+            return unprotectedString
+        }
+
+        // Leaf text is rarely padded, so only hand it to Foundation when an end
+        // byte is whitespace or non-ASCII
+        private static func trimmed(_ string: String) -> String {
+            guard let first = string.utf8.first, let last = string.utf8.last else {
+                return string
+            }
+
+            func isPlain(_ byte: UInt8) -> Bool {
+                return byte > 0x20 && byte < 0x80
+            }
+
+            guard !isPlain(first) || !isPlain(last) else {
+                return string
+            }
+
+            return string.trimmingCharacters(in: .whitespacesAndNewlines)
+        }
+
+        // Defaults match those of the element parsers for missing elements
+
+        private static func makeTimes() -> Times {
+            return Times(
+                lastModificationTime: nil,
+                creationTime: nil,
+                lastAccessTime: nil,
+                expiryTime: nil,
+                expires: false,
+                usageCount: 0,
+                locationChanged: nil
+            )
+        }
+
+        private static func makeAutoType() -> AutoType {
+            return AutoType(enabled: false, dataTransferObfuscation: 0, association: nil)
+        }
+
+        private static func makeDeletedObject() -> DeletedObject {
+            return DeletedObject(uuid: UUID(), deletionTime: nil)
+        }
+
+        private static func makeGroup() -> Group {
+            return Group(
+                uuid: UUID(),
+                name: "",
+                notes: "",
+                iconId: 49,
+                times: makeTimes(),
+                isExpanded: false,
+                defaultAutoTypeSequence: "",
+                enableAutoType: false,
+                enableSearching: false,
+                lastTopVisibleEntry: "",
+                groups: [],
+                entries: []
+            )
+        }
+
+        private static func makeEntry() -> Entry {
+            return Entry(
+                uuid: UUID(),
+                iconId: 0,
+                foregroundColor: "",
+                backgroundColor: "",
+                overrideURL: "",
+                tags: "",
+                times: makeTimes(),
+                autoType: makeAutoType(),
+                strings: [],
+                histories: []
+            )
+        }
+
+        private static func makeMeta() -> Meta {
+            let memoryProtection = MemoryProtection(
+                isTitleProtected: false,
+                isUsernameProtected: false,
+                isPasswordProtected: false,
+                isUrlProtected: false,
+                isNotesProtected: false
+            )
+
+            return Meta(
+                generator: "",
+                databaseName: "",
+                databaseNameChanged: nil,
+                databaseDescription: "",
+                databaseDescriptionChanged: nil,
+                defaultUsername: "",
+                defaultUsernameChanged: nil,
+                maintenanceHistoryDays: 365,
+                color: "",
+                masterKeyChanged: nil,
+                masterKeyChangeRec: -1,
+                masterKeyChangeForce: -1,
+                memoryProtection: memoryProtection,
+                recycleBinEnabled: false,
+                recycleBinUUID: nil,
+                recycleBinChanged: nil,
+                entryTemplatesGroup: "",
+                entryTemplatesGroupChanged: nil,
+                historyMaxItems: 10,
+                historyMaxSize: 6291456,
+                lastSelectedGroup: "",
+                lastTopVisibleGroup: "",
+                binaries: [],
+                customData: ""
+            )
+        }
+    }
+}
@@ -0,0 +1,365 @@
+//
+//  KdbxXmlTokenizer.swift
+//  GateKeeper
+//
+
+import Foundation
+
+protocol KdbxXmlTokenizerDelegate: class {
+    func tokenizer(_ tokenizer: KdbxXmlTokenizer, didStartElement name: String, attributes: [String: String]) throws
+    func tokenizer(_ tokenizer: KdbxXmlTokenizer, didEndElement name: String) throws
+    func tokenizer(_ tokenizer: KdbxXmlTokenizer, foundCharacters string: String) throws
+}
+
+// Push-style XML tokenizer. Bytes arrive in arbitrary chunks and events are
+// emitted as soon as a complete tag or text run is available, so only the
+// markup currently being parsed is buffered.
+final class KdbxXmlTokenizer: KdbxByteSink {
+
+    enum TokenizeError: Error {
+        case malformed
+        case unbalanced
+    }
+
+    private static let lessThan = UInt8(ascii: "<")
+    private static let greaterThan = UInt8(ascii: ">")
+    private static let slash = UInt8(ascii: "/")
+    private static let ampersand = UInt8(ascii: "&")
+    private static let equals = UInt8(ascii: "=")
+
+    private let delegate: KdbxXmlTokenizerDelegate
+    private var pending = [UInt8]()
+    private var start = 0
+    private var openElements = [String]()
+
+    init(delegate: KdbxXmlTokenizerDelegate) {
+        self.delegate = delegate
+    }
+
+    func write(_ bytes: UnsafeRawBufferPointer) throws {
+        pending.append(contentsOf: bytes)
+
+        try tokenize()
+
+        // Drop consumed bytes once they make up most of the buffer
+        if start > 0 && start >= pending.count / 2 {
+            pending.removeFirst(start)
+            start = 0
+        }
+    }
+
+    func finish() throws {
+        try tokenize()
+
+        let trailing = pending[start..<pending.count]
+        guard trailing.first(where: { !KdbxXmlTokenizer.isWhitespace($0) }) == nil else {
+            throw TokenizeError.malformed
+        }
+
+        guard openElements.isEmpty else {
+            throw TokenizeError.unbalanced
+        }
+
+        pending.removeAll()
+        start = 0
+    }
+
+    private func tokenize() throws {
+        let bytes = pending
+
+        try bytes.withUnsafeBufferPointer { buffer in
+            while start < buffer.count {
+                if buffer[start] == KdbxXmlTokenizer.lessThan {
+                    guard let end = markupEnd(buffer, from: start) else {
+                        return
+                    }
+
+                    try markup(buffer, start..<end)
+                    start = end
+                } else {
+                    guard let end = index(of: KdbxXmlTokenizer.lessThan, in: buffer, from: start) else {
+                        return
+                    }
+
+                    if !openElements.isEmpty {
+                        try delegate.tokenizer(self, foundCharacters: KdbxXmlTokenizer.decode(buffer, start..<end))
+                    }
+                    start = end
+                }
+            }
+        }
+    }
+
+    // Returns the index just past the end of the markup starting at `from`,
+    // or nil if the markup is not complete yet.
+    private func markupEnd(_ buffer: UnsafeBufferPointer<UInt8>, from: Int) -> Int? {
+        if hasPrefix("<!--", buffer, at: from) {
+            return index(ofTerminator: "-->", in: buffer, from: from + 4)
+        }
+
+        if hasPrefix("<![CDATA[", buffer, at: from) {
+            return index(ofTerminator: "]]>", in: buffer, from: from + 9)
+        }
+
+        if hasPrefix("<?", buffer, at: from) {
+            return index(ofTerminator: "?>", in: buffer, from: from + 2)
+        }
+
+        var quote: UInt8?
+        var i = from + 1
+
+        while i < buffer.count {
+            let byte = buffer[i]
+
+            if let q = quote {
+                if byte == q {
+                    quote = nil
+                }
+            } else if byte == UInt8(ascii: "\"") || byte == UInt8(ascii: "'") {
+                quote = byte
+            } else if byte == KdbxXmlTokenizer.greaterThan {
+                return i + 1
+            }
+
+            i += 1
+        }
+
+        return nil
+    }
+
+    private func markup(_ buffer: UnsafeBufferPointer<UInt8>, _ range: Range<Int>) throws {
+        if hasPrefix("<!--", buffer, at: range.lowerBound) || hasPrefix("<?", buffer, at: range.lowerBound) {
+            return
+        }
+
+        if hasPrefix("<![CDATA[", buffer, at: range.lowerBound) {
+            if !openElements.isEmpty {
+                let text = UnsafeBufferPointer(rebasing: buffer[range.lowerBound + 9..<range.upperBound - 3])
+                try delegate.tokenizer(self, foundCharacters: String(decoding: text, as: UTF8.self))
+            }
+            return
+        }
+
+        if hasPrefix("<!", buffer, at: range.lowerBound) {
+            // DOCTYPE and other declarations carry nothing we use
+            return
+        }
+
+        if buffer[range.lowerBound + 1] == KdbxXmlTokenizer.slash {
+            let name = KdbxXmlTokenizer.string(buffer, KdbxXmlTokenizer.trim(buffer, range.lowerBound + 2..<range.upperBound - 1))
+
+            guard let open = openElements.popLast(), open == name else {
+                throw TokenizeError.unbalanced
+            }
+
+            try delegate.tokenizer(self, didEndElement: name)
+            return
+        }
+
+        var end = range.upperBound - 1
+        let isEmptyElement = buffer[end - 1] == KdbxXmlTokenizer.slash
+        if isEmptyElement {
+            end -= 1
+        }
+
+        var i = range.lowerBound + 1
+        while i < end && !KdbxXmlTokenizer.isWhitespace(buffer[i]) {
+            i += 1
+        }
+
+        let name = KdbxXmlTokenizer.string(buffer, range.lowerBound + 1..<i)
+        guard !name.isEmpty else {
+            throw TokenizeError.malformed
+        }
+
+        let attributes = try KdbxXmlTokenizer.attributes(buffer, i..<end)
+
+        openElements.append(name)
+        try delegate.tokenizer(self, didStartElement: name, attributes: attributes)
+
+        if isEmptyElement {
+            openElements.removeLast()
+            try delegate.tokenizer(self, didEndElement: name)
+        }
+    }
+
+    // MARK: Helpers
+
+    private static func attributes(_ buffer: UnsafeBufferPointer<UInt8>, _ range: Range<Int>) throws -> [String: String] {
+        var attributes = [String: String]()
+        var i = range.lowerBound
+
+        while true {
+            while i < range.upperBound && isWhitespace(buffer[i]) {
+                i += 1
+            }
+
+            if i >= range.upperBound {
+                return attributes
+            }
+
+            let nameStart = i
+            while i < range.upperBound && buffer[i] != equals && !isWhitespace(buffer[i]) {
+                i += 1
+            }
+            let name = string(buffer, nameStart..<i)
+
+            while i < range.upperBound && isWhitespace(buffer[i]) {
+                i += 1
+            }
+
+            guard i < range.upperBound && buffer[i] == equals else {
+                throw TokenizeError.malformed
+            }
+            i += 1
+
+            while i < range.upperBound && isWhitespace(buffer[i]) {
+                i += 1
+            }
+
+            guard i < range.upperBound else {
+                throw TokenizeError.malformed
+            }
+
+            let quote = buffer[i]
+            guard quote == UInt8(ascii: "\"") || quote == UInt8(ascii: "'") else {
+                throw TokenizeError.malformed
+            }
+            i += 1
+
+            let valueStart = i
+            while i < range.upperBound && buffer[i] != quote {
+                i += 1
+            }
+
+            guard i < range.upperBound else {
+                throw TokenizeError.malformed
+            }
+
+            attributes[name] = decode(buffer, valueStart..<i)
+            i += 1
+        }
+    }
+
+    static func decode(_ buffer: UnsafeBufferPointer<UInt8>, _ range: Range<Int>) -> String {
+        let slice = UnsafeBufferPointer(rebasing: buffer[range])
+
+        guard let base = slice.baseAddress, memchr(base, Int32(ampersand), slice.count) != nil else {
+            return String(decoding: slice, as: UTF8.self)
+        }
+
+        var decoded = [UInt8]()
+        decoded.reserveCapacity(slice.count)
+
+        var i = 0
+        while i < slice.count {
+            let byte = slice[i]
+
+            guard byte == ampersand, let semicolon = slice[i..<slice.count].index(of: UInt8(ascii: ";")) else {
+                decoded.append(byte)
+                i += 1
+                continue
+            }
+
+            let entity = String(decoding: UnsafeBufferPointer(rebasing: slice[i + 1..<semicolon]), as: UTF8.self)
+
+            if let replacement = decode(entity: entity) {
+                decoded.append(contentsOf: replacement.utf8)
+                i = semicolon + 1
+            } else {
+                decoded.append(byte)
+                i += 1
+            }
+        }
+
+        return String(decoding: decoded, as: UTF8.self)
+    }
+
+    private static func decode(entity: String) -> String? {
+        switch entity {
+        case "lt":
+            return "<"
+        case "gt":
+            return ">"
+        case "amp":
+            return "&"
+        case "quot":
+            return "\""
+        case "apos":
+            return "'"
+        default:
+            let scalarValue: UInt32?
+            if entity.hasPrefix("#x") || entity.hasPrefix("#X") {
+                scalarValue = UInt32(entity.dropFirst(2), radix: 16)
+            } else if entity.hasPrefix("#") {
+                scalarValue = UInt32(entity.dropFirst(1), radix: 10)
+            } else {
+                scalarValue = nil
+            }
+
+            guard let value = scalarValue, let scalar = UnicodeScalar(value) else {
+                return nil
+            }
+
+            return String(Character(scalar))
+        }
+    }
+
+    private static func isWhitespace(_ byte: UInt8) -> Bool {
+        return byte == 0x20 || byte == 0x09 || byte == 0x0A || byte == 0x0D
+    }
+
+    private static func string(_ buffer: UnsafeBufferPointer<UInt8>, _ range: Range<Int>) -> String {
+        return String(decoding: UnsafeBufferPointer(rebasing: buffer[range]), as: UTF8.self)
+    }
+
+    private static func trim(_ buffer: UnsafeBufferPointer<UInt8>, _ range: Range<Int>) -> Range<Int> {
+        var lower = range.lowerBound
+        var upper = range.upperBound
+
+        while lower < upper && isWhitespace(buffer[lower]) {
+            lower += 1
+        }
+
+        while upper > lower && isWhitespace(buffer[upper - 1]) {
+            upper -= 1
+        }
+
+        return lower..<upper
+    }
+
+    private func index(of byte: UInt8, in buffer: UnsafeBufferPointer<UInt8>, from: Int) -> Int? {
+        guard let base = buffer.baseAddress, from < buffer.count else {
+            return nil
+        }
+
+        guard let match = memchr(base + from, Int32(byte), buffer.count - from) else {
+            return nil
+        }
+
+        return base.distance(to: match.assumingMemoryBound(to: UInt8.self))
+    }
+
+    private func index(ofTerminator terminator: String, in buffer: UnsafeBufferPointer<UInt8>, from: Int) -> Int? {
+        let terminatorBytes = [UInt8](terminator.utf8)
+        var i = from
+
+        while let match = index(of: terminatorBytes[0], in: buffer, from: i) {
+            if hasPrefix(terminator, buffer, at: match) {
+                return match + terminatorBytes.count
+            }
+            i = match + 1
+        }
+
+        return nil
+    }
+
+    private func hasPrefix(_ prefix: String, _ buffer: UnsafeBufferPointer<UInt8>, at offset: Int) -> Bool {
+        let prefixBytes = prefix.utf8
+        guard buffer.count - offset >= prefixBytes.count else {
+            return false
+        }
+
+        return buffer[offset..<offset + prefixBytes.count].elementsEqual(prefixBytes)
+    }
+}
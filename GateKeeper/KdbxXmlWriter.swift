@@ -0,0 +1,415 @@
+//
+//  KdbxXmlWriter.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Serializes a KeePassFile as UTF-8 straight into a byte sink, in the element
+// order of the KdbxXml build methods. Output is staged in one reused buffer
+// that is handed on whenever it fills, so no element tree or document string
+// is ever built. Protected values go through the inner stream as they are
+// written, which keeps them in document order.
+final class KdbxXmlWriter {
+
+    static let flushSize = 64 * 1024
+
+    private static let declaration: StaticString = "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>"
+    private static let base64Alphabet = [UInt8]("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/".utf8)
+
+    private let next: KdbxByteSink
+    private let dateFormat: KdbxXml.XmlDateFormatter.Format
+    private let streamCipher: KdbxStreamCipher?
+    private var buffer = [UInt8]()
+    private var scratch = [UInt8]()
+
+    init(next: KdbxByteSink, dateFormat: KdbxXml.XmlDateFormatter.Format, streamCipher: KdbxStreamCipher?) {
+        self.next = next
+        self.dateFormat = dateFormat
+        self.streamCipher = streamCipher
+
+        buffer.reserveCapacity(KdbxXmlWriter.flushSize * 2)
+    }
+
+    deinit {
+        scratch.withUnsafeMutableBytes { _ = memset($0.baseAddress, 0, $0.count) }
+    }
+
+    // Writes the whole document to `next`, leaving it open for the caller to finish
+    func write(file: KdbxXml.KeePassFile) throws {
+        append(KdbxXmlWriter.declaration)
+
+        open("KeePassFile")
+        try write(meta: file.meta)
+        try write(root: file.root)
+        close("KeePassFile")
+
+        try flush()
+    }
+
+    // MARK: Structs
+
+    private func write(meta: KdbxXml.Meta) throws {
+        open("Meta")
+        element("Generator", text: "KdbxSwift")
+        element("DatabaseName", text: meta.databaseName)
+        element("DatabaseNameChanged", date: meta.databaseNameChanged)
+        element("DatabaseDescription", text: meta.databaseDescription)
+        element("DatabaseDescriptionChanged", date: meta.databaseDescriptionChanged)
+        element("DefaultUserName", text: meta.defaultUsername)
+        element("DefaultUserNameChanged", date: meta.defaultUsernameChanged)
+        element("MaintenanceHistoryDays", int: meta.maintenanceHistoryDays)
+        element("Color", text: meta.color)
+        element("MasterKeyChanged", date: meta.masterKeyChanged)
+        element("MasterKeyChangeRec", int: meta.masterKeyChangeRec)
+        element("MasterKeyChangeForce", int: meta.masterKeyChangeForce)
+
+        open("MemoryProtection")
+        element("ProtectTitle", bool: meta.memoryProtection.isTitleProtected)
+        element("ProtectUserName", bool: meta.memoryProtection.isUsernameProtected)
+        element("ProtectPassword", bool: meta.memoryProtection.isPasswordProtected)
+        element("ProtectURL", bool: meta.memoryProtection.isUrlProtected)
+        element("ProtectNotes", bool: meta.memoryProtection.isNotesProtected)
+        close("MemoryProtection")
+
+        element("RecycleBinEnabled", bool: meta.recycleBinEnabled)
+        element("RecycleBinUUID", uuid: meta.recycleBinUUID)
+        element("RecycleBinChanged", date: meta.recycleBinChanged)
+        element("EntryTemplatesGroup", text: meta.entryTemplatesGroup)
+        element("EntryTemplatesGroupChanged", date: meta.entryTemplatesGroupChanged)
+        element("HistoryMaxItems", int: meta.historyMaxItems)
+        element("HistoryMaxSize", int: meta.historyMaxSize)
+        element("LastSelectedGroup", text: meta.lastSelectedGroup)
+        element("LastTopVisibleGroup", text: meta.lastTopVisibleGroup)
+        element("CustomData", text: meta.customData)
+
+        open("Binaries")
+        for binary in meta.binaries {
+            append("<Binary ID=\"")
+            appendEscaped(binary.id)
+            append("\" Compressed=\"")
+            append(binary.compressed ? "True" : "False")
+            append("\">")
+            appendEscaped(binary.content)
+            close("Binary")
+
+            try flushIfFull()
+        }
+        close("Binaries")
+
+        close("Meta")
+    }
+
+    private func write(root: KdbxXml.Root) throws {
+        open("Root")
+        try write(group: root.group)
+
+        open("DeletedObjects")
+        for deletedObject in root.deletedObjects {
+            open("DeletedObject")
+            element("UUID", uuid: deletedObject.uuid)
+            element("DeletionTime", date: deletedObject.deletionTime)
+            close("DeletedObject")
+        }
+        close("DeletedObjects")
+
+        close("Root")
+    }
+
+    private func write(group: KdbxXml.Group) throws {
+        open("Group")
+        element("UUID", uuid: group.uuid)
+        element("Name", text: group.name)
+        element("Notes", text: group.notes)
+        element("IconID", int: group.iconId)
+        write(times: group.times)
+        element("IsExpanded", bool: group.isExpanded)
+        element("DefaultAutoTypeSequence", text: group.defaultAutoTypeSequence)
+        element("EnableAutoType", bool: group.enableAutoType)
+        element("EnableSearching", bool: group.enableSearching)
+        element("LastTopVisibleEntry", text: group.lastTopVisibleEntry)
+
+        for subgroup in group.groups {
+            try write(group: subgroup)
+        }
+
+        for entry in group.entries {
+            try write(entry: entry, includeHistory: true)
+        }
+
+        close("Group")
+    }
+
+    private func write(entry: KdbxXml.Entry, includeHistory: Bool) throws {
+        open("Entry")
+        element("UUID", uuid: entry.uuid)
+        element("IconID", int: entry.iconId)
+        element("ForegroundColor", text: entry.foregroundColor)
+        element("BackgroundColor", text: entry.backgroundColor)
+        element("OverrideURL", text: entry.overrideURL)
+        element("Tags", text: entry.tags)
+        write(times: entry.times)
+
+        for str in entry.strings {
+            open("String")
+            element("Key", text: str.key)
+
+            if str.isProtected, let streamCipher = streamCipher {
+                append("<Value Protected=\"True\">")
+                appendProtected(str.value, streamCipher: streamCipher)
+                close("Value")
+            } else {
+                element("Value", text: str.value)
+            }
+
+            close("String")
+        }
+
+        write(autoType: entry.autoType)
+
+        if includeHistory {
+            open("History")
+            for history in entry.histories {
+                try write(entry: history, includeHistory: false)
+            }
+            close("History")
+        }
+
+        close("Entry")
+
+        try flushIfFull()
+    }
+
+    private func write(times: KdbxXml.Times) {
+        open("Times")
+        element("LastModificationTime", date: times.lastModificationTime)
+        element("CreationTime", date: times.creationTime)
+        element("LastAccessTime", date: times.lastAccessTime)
+        element("ExpiryTime", date: times.expiryTime)
+        element("Expires", bool: times.expires)
+        element("UsageCount", int: times.usageCount)
+        element("LocationChanged", date: times.locationChanged)
+        close("Times")
+    }
+
+    private func write(autoType: KdbxXml.AutoType) {
+        open("AutoType")
+        element("Enabled", bool: autoType.enabled)
+        element("DataTransferObfuscation", int: autoType.dataTransferObfuscation)
+
+        if let association = autoType.association {
+            open("Association")
+            element("Window", text: association.window)
+            element("KeystrokeSequence", text: association.keystrokeSequence)
+            close("Association")
+        }
+
+        close("AutoType")
+    }
+
+    // MARK: Elements
+
+    private func open(_ name: StaticString) {
+        buffer.append(UInt8(ascii: "<"))
+        append(name)
+        buffer.append(UInt8(ascii: ">"))
+    }
+
+    private func close(_ name: StaticString) {
+        buffer.append(UInt8(ascii: "<"))
+        buffer.append(UInt8(ascii: "/"))
+        append(name)
+        buffer.append(UInt8(ascii: ">"))
+    }
+
+    private func empty(_ name: StaticString) {
+        buffer.append(UInt8(ascii: "<"))
+        append(name)
+        buffer.append(UInt8(ascii: "/"))
+        buffer.append(UInt8(ascii: ">"))
+    }
+
+    private func element(_ name: StaticString, text: String?) {
+        guard let text = text, !text.isEmpty else {
+            empty(name)
+            return
+        }
+
+        open(name)
+        appendEscaped(text)
+        close(name)
+    }
+
+    private func element(_ name: StaticString, bool: Bool) {
+        open(name)
+        append(bool ? "True" : "False")
+        close(name)
+    }
+
+    private func element(_ name: StaticString, int: Int) {
+        open(name)
+        buffer.append(contentsOf: String(int).utf8)
+        close(name)
+    }
+
+    private func element(_ name: StaticString, uuid: UUID?) {
+        guard var bytes = uuid?.uuid else {
+            empty(name)
+            return
+        }
+
+        open(name)
+        withUnsafeBytes(of: &bytes) { appendBase64($0) }
+        close(name)
+    }
+
+    private func element(_ name: StaticString, date: Date?) {
+        guard let date = date else {
+            empty(name)
+            return
+        }
+
+        open(name)
+
+        switch dateFormat {
+        case .iso8601:
+            buffer.append(contentsOf: date.xmlString(format: .iso8601).utf8)
+        case .base64Ticks:
+            let seconds = Int64(date.timeIntervalSince1970.rounded(.down)) + KdbxXml.XmlDateFormatter.ticksTo1970
+            seconds.littleEndianBytes.withUnsafeBytes { appendBase64($0) }
+        }
+
+        close(name)
+    }
+
+    // MARK: Bytes
+
+    private func append(_ string: StaticString) {
+        buffer.append(contentsOf: UnsafeBufferPointer(start: string.utf8Start, count: string.utf8CodeUnitCount))
+    }
+
+    // Text is copied in as is and only rewritten when a word scan of the
+    // copied bytes finds markup, which for typical vault contents it does not
+    private func appendEscaped(_ string: String) {
+        let start = buffer.count
+        buffer.append(contentsOf: string.utf8)
+
+        let hasMarkup = buffer.withUnsafeBufferPointer { bytes in
+            return KdbxXmlWriter.containsMarkup(UnsafeBufferPointer(rebasing: bytes[start..<bytes.count]))
+        }
+
+        guard hasMarkup else {
+            return
+        }
+
+        let raw = Array(buffer[start..<buffer.count])
+        buffer.removeSubrange(start..<buffer.count)
+
+        for byte in raw {
+            switch byte {
+            case UInt8(ascii: "&"):
+                append("&amp;")
+            case UInt8(ascii: "<"):
+                append("&lt;")
+            case UInt8(ascii: ">"):
+                append("&gt;")
+            case UInt8(ascii: "\""):
+                append("&quot;")
+            default:
+                buffer.append(byte)
+            }
+        }
+    }
+
+    private func appendProtected(_ string: String, streamCipher: KdbxStreamCipher) {
+        scratch.removeAll(keepingCapacity: true)
+        scratch.append(contentsOf: string.utf8)
+
+        defer {
+            scratch.withUnsafeMutableBytes { _ = memset($0.baseAddress, 0, $0.count) }
+        }
+
+        scratch.withUnsafeMutableBytes { streamCipher.transform($0) }
+        scratch.withUnsafeBytes { appendBase64($0) }
+    }
+
+    private func appendBase64(_ bytes: UnsafeRawBufferPointer) {
+        let alphabet = KdbxXmlWriter.base64Alphabet
+        var index = 0
+
+        while index + 3 <= bytes.count {
+            let value = UInt32(bytes[index]) << 16 | UInt32(bytes[index + 1]) << 8 | UInt32(bytes[index + 2])
+
+            buffer.append(alphabet[Int(value >> 18 & 0x3F)])
+            buffer.append(alphabet[Int(value >> 12 & 0x3F)])
+            buffer.append(alphabet[Int(value >> 6 & 0x3F)])
+            buffer.append(alphabet[Int(value & 0x3F)])
+
+            index += 3
+        }
+
+        let remaining = bytes.count - index
+        guard remaining > 0 else {
+            return
+        }
+
+        let value = UInt32(bytes[index]) << 16 | (remaining == 2 ? UInt32(bytes[index + 1]) << 8 : 0)
+
+        buffer.append(alphabet[Int(value >> 18 & 0x3F)])
+        buffer.append(alphabet[Int(value >> 12 & 0x3F)])
+        buffer.append(remaining == 2 ? alphabet[Int(value >> 6 & 0x3F)] : UInt8(ascii: "="))
+        buffer.append(UInt8(ascii: "="))
+    }
+
+    private func flushIfFull() throws {
+        if buffer.count >= KdbxXmlWriter.flushSize {
+            try flush()
+        }
+    }
+
+    private func flush() throws {
+        try buffer.withUnsafeBytes { try next.write($0) }
+        buffer.removeAll(keepingCapacity: true)
+    }
+
+    // Eight bytes at a time: a byte of the word equals `byte` exactly when the
+    // XOR leaves a zero byte, which the borrow trick exposes in its high bit
+    static func containsMarkup(_ bytes: UnsafeBufferPointer<UInt8>) -> Bool {
+        guard let base = bytes.baseAddress else {
+            return false
+        }
+
+        let ones = UInt64(0x0101010101010101)
+        let highs = UInt64(0x8080808080808080)
+
+        func contains(_ word: UInt64, _ byte: UInt8) -> Bool {
+            let x = word ^ (ones &* UInt64(byte))
+            return (x &- ones) & ~x & highs != 0
+        }
+
+        var index = 0
+
+        while index + 8 <= bytes.count {
+            var word = UInt64(0)
+            memcpy(&word, base + index, 8)
+
+            if contains(word, UInt8(ascii: "&")) || contains(word, UInt8(ascii: "<")) ||
+                contains(word, UInt8(ascii: ">")) || contains(word, UInt8(ascii: "\"")) {
+                return true
+            }
+
+            index += 8
+        }
+
+        while index < bytes.count {
+            switch bytes[index] {
+            case UInt8(ascii: "&"), UInt8(ascii: "<"), UInt8(ascii: ">"), UInt8(ascii: "\""):
+                return true
+            default:
+                index += 1
+            }
+        }
+
+        return false
+    }
+}
@@ -11,11 +11,14 @@ class SearchViewController: UIViewController, SearchBarDelegate, UITableViewData
     let separatorView = UIView()
     let tableView = UITableView()
 
+    var bestEntries: [KdbxXml.Entry] = Array()
     var titleEntries: [KdbxXml.Entry] = Array()
     var usernameEntries: [KdbxXml.Entry] = Array()
     var urlEntries: [KdbxXml.Entry] = Array()
     var notesEntries: [KdbxXml.Entry] = Array()
 
+    var searchSession: KdbxSearchSession?
+
     override func viewDidLoad() {
         view.backgroundColor = Theme.Base.viewBackgroundColor
 
@@ -71,12 +74,14 @@ class SearchViewController: UIViewController, SearchBarDelegate, UITableViewData
     func getEntry(indexPath: IndexPath) -> KdbxXml.Entry? {
         switch indexPath.section {
         case 0:
-            return titleEntries[indexPath.row]
+            return bestEntries[indexPath.row]
         case 1:
-            return usernameEntries[indexPath.row]
+            return titleEntries[indexPath.row]
         case 2:
-            return urlEntries[indexPath.row]
+            return usernameEntries[indexPath.row]
         case 3:
+            return urlEntries[indexPath.row]
+        case 4:
             return notesEntries[indexPath.row]
         default:
             return nil
@@ -86,6 +91,9 @@ class SearchViewController: UIViewController, SearchBarDelegate, UITableViewData
     // MARK: SearchBarDelegate
 
     func searchBar(searchBar: SearchBar, didClear textField: UITextField, with text: String?) {
+        searchSession?.cancel()
+
+        bestEntries.removeAll()
         titleEntries.removeAll()
         usernameEntries.removeAll()
         urlEntries.removeAll()
@@ -99,41 +107,41 @@ class SearchViewController: UIViewController, SearchBarDelegate, UITableViewData
             return
         }
 
-        titleEntries.removeAll()
-        usernameEntries.removeAll()
-        urlEntries.removeAll()
-        notesEntries.removeAll()
-
-        let results = kdbx.search(query: query, attributes: [.title, .username, .url, .notes])
-
-        titleEntries.append(contentsOf: results[.title] ?? [])
-        usernameEntries.append(contentsOf: results[.username] ?? [])
-        urlEntries.append(contentsOf: results[.url] ?? [])
-        notesEntries.append(contentsOf: results[.notes] ?? [])
+        if searchSession == nil {
+            searchSession = kdbx.makeSearchSession(attributes: [.title, .username, .url, .notes])
+        }
 
-        print("title results: \(titleEntries.count)")
-        print("username results: \(usernameEntries.count)")
-        print("url results: \(urlEntries.count)")
-        print("notes results: \(notesEntries.count)")
+        searchSession?.search(query: query) { results in
+            // Earlier batches come without best matches, keep the last ones until then
+            if results.isComplete {
+                self.bestEntries = results.bestMatches.map { $0.entry }
+            }
+            self.titleEntries = results.entries[.title] ?? []
+            self.usernameEntries = results.entries[.username] ?? []
+            self.urlEntries = results.entries[.url] ?? []
+            self.notesEntries = results.entries[.notes] ?? []
 
-        tableView.reloadData()
+            self.tableView.reloadData()
+        }
     }
 
     // MARK: UITableViewDataSource
 
     func numberOfSections(in tableView: UITableView) -> Int {
-        return 4
+        return 5
     }
 
     func tableView(_ tableView: UITableView, numberOfRowsInSection section: Int) -> Int {
         switch section {
         case 0:
-            return titleEntries.count
+            return bestEntries.count
         case 1:
-            return usernameEntries.count
+            return titleEntries.count
         case 2:
-            return urlEntries.count
+            return usernameEntries.count
         case 3:
+            return urlEntries.count
+        case 4:
             return notesEntries.count
         default:
             return 0
@@ -162,18 +170,22 @@ class SearchViewController: UIViewController, SearchBarDelegate, UITableViewData
     func tableView(_ tableView: UITableView, titleForHeaderInSection section: Int) -> String? {
         switch section {
         case 0:
+            if !bestEntries.isEmpty {
+                return "Best matches"
+            }
+        case 1:
             if !titleEntries.isEmpty {
                 return "Title matches"
             }
-        case 1:
+        case 2:
             if !usernameEntries.isEmpty {
                 return "Username matches"
             }
-        case 2:
+        case 3:
             if !urlEntries.isEmpty {
                 return "URL matches"
             }
-        case 3:
+        case 4:
             if !notesEntries.isEmpty {
                 return "Notes matches"
             }
@@ -78,6 +78,10 @@ class SyncView: UIView {
                     self.statusLabel.text = "Failed"
                     self.statusLabel.textColor = UIColor(hex: 0xD50000)
                     stackView.addArrangedSubview(self.retryButton)
+                case .pending:
+                    self.statusLabel.text = "Unsaved changes"
+                    self.statusLabel.textColor = UIColor(hex: 0xFFCC80)
+                    self.retryButton.removeFromSuperview()
                 case .transferring:
                     self.statusLabel.text = "Transferring ..."
                     self.statusLabel.textColor = UIColor(hex: 0xFFCC80)
@@ -362,26 +362,18 @@ class UnlockViewController: UITableViewController, UITextFieldDelegate {
             do {
                 async(in: .main, {
                     HUD.dimsBackground = false
-                    HUD.show(.labeledProgress(title: "Opening", subtitle: "Connecting"))
                 })
-                try await(in: .background, card.connect().retry(2))
-                
-                async(in: .main, {
-                    HUD.show(.labeledProgress(title: "Opening", subtitle: "Database exists?"))
-                })
-                
-                let databaseExists = try await(card.exists(path: Vault.dbPath))
 
-                if (!databaseExists) {
+                let loaded = try Vault.load(card: card) { subtitle in
+                    async(in: .main, {
+                        HUD.show(.labeledProgress(title: "Opening", subtitle: subtitle))
+                    })
+                }
+
+                guard let data = loaded else {
                     throw UnlockError.databaseNotFound
                 }
                 
-                async(in: .main, {
-                    HUD.show(.labeledProgress(title: "Opening", subtitle: "Transferring"))
-                })
-                
-                let data = try await(card.get(path: Vault.dbPath))
-                
                 async(in: .main, {
                     HUD.show(.labeledProgress(title: "Opening", subtitle: "Decrypting"))
                 })
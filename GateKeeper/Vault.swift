@@ -3,14 +3,20 @@
 //  GateKeeper
 //
 
+import Hydra
 import Signals
 
 class Vault {
+    enum SaveError: Error {
+        case superseded
+    }
+
     enum SyncStatus {
         case complete
         case connecting
         case encrypting
         case failed
+        case pending
         case transferring
     }
 
@@ -37,6 +43,16 @@ class Vault {
         }
     }
 
+    // zlib level saves compress with; a device setting rather than part of the file
+    static var compressionLevel: Int32 {
+        get {
+            return (UserDefaults.standard.object(forKey: "compressionLevel") as? Int).map { Int32($0) } ?? KdbxParallelGzipSink.defaultLevel
+        }
+        set {
+            UserDefaults.standard.set(Int(newValue), forKey: "compressionLevel")
+        }
+    }
+
     static let syncStatus = Signal<Vault.SyncStatus>(retainLastData: true)
     static let syncQueue = DispatchQueue(label: "sync")
 
@@ -61,64 +77,121 @@ class Vault {
         return kdbx!
     }
 
-    static func save() {
+    // Reads the stored vault off the card, or nil when the card holds none.
+    // Leaves the card connected. Blocks, so never call this on the main queue.
+    static func load(card: GKCard, progress: @escaping (String) -> Void = { _ in }) throws -> Data? {
+        progress("Connecting")
+        try await(in: .background, card.connect().retry(2))
+
+        progress("Database exists?")
+        guard try await(card.exists(path: Vault.dbPath)) else {
+            return nil
+        }
+
+        progress("Transferring")
+        return try await(card.get(path: Vault.dbPath))
+    }
+
+    // Coalesces saves requested in quick succession into one
+    static let saveScheduler = VaultSaveScheduler { isCurrent, completion in
         Vault.syncQueue.async {
-            guard let kdbx = kdbx else {
-                return
-            }
+            Vault.performSave(isCurrent: isCurrent, completion: completion)
+        }
+    }
 
-            guard let cardUUID = cardUUID else {
-                return
-            }
+    // Edits stay pending until the scheduler's window has passed and the save starts
+    static func save() {
+        if kdbx != nil && cardUUID != nil {
+            syncStatus.fire(.pending)
+        }
 
-            guard let card = GKCard(uuid: cardUUID) else {
-                return
-            }
+        saveScheduler.schedule()
+    }
 
-            let semaphore = DispatchSemaphore(value: 0)
+    private static func performSave(isCurrent: @escaping () -> Bool, completion: @escaping () -> Void) {
+        guard let kdbx = kdbx else {
+            completion()
+            return
+        }
 
-            syncStatus.fire(.encrypting)
+        guard let cardUUID = cardUUID else {
+            completion()
+            return
+        }
 
-            let encryptedData: Data
-            do {
-                encryptedData = try kdbx.encrypt()
-            } catch {
-                print(error)
-                return
-            }
+        guard let card = GKCard(uuid: cardUUID) else {
+            syncStatus.fire(.failed)
+            completion()
+            return
+        }
 
-            GKCard.checkBluetoothState()
-            .then {
-                syncStatus.fire(.connecting)
-            }
-            .then {
-                card.connect().retry(2)
-            }
-            .then {
-                syncStatus.fire(.transferring)
-            }
-            .then {
-                card.put(data: encryptedData)
-            }
-            .then {
-                card.checksum(data: encryptedData)
-            }
-            .then {
-                card.close(path: Vault.dbPath)
+        // A superseded save leaves the status to the save that replaced it
+        func report(_ status: SyncStatus) {
+            if isCurrent() {
+                syncStatus.fire(status)
             }
-            .then {
-                syncStatus.fire(.complete)
-            }
-            .always {
-                card.disconnect().then {}
-                semaphore.signal()
+        }
+
+        report(.encrypting)
+
+        let encryptedData: Data
+        do {
+            kdbx.compressionLevel = compressionLevel
+            encryptedData = try kdbx.encrypt()
+        } catch {
+            print(error)
+            report(.failed)
+            completion()
+            return
+        }
+
+        // A newer save takes over; the card only commits the file on close
+        func checkCurrent() throws {
+            if !isCurrent() {
+                throw SaveError.superseded
             }
-            .catch { error in
+        }
+
+        GKCard.checkBluetoothState()
+        .then {
+            try checkCurrent()
+        }
+        .then {
+            report(.connecting)
+        }
+        .then {
+            card.connect().retry(2)
+        }
+        .then {
+            report(.transferring)
+        }
+        .then {
+            card.put(data: encryptedData, isCurrent: isCurrent)
+        }
+        .then { checksum in
+            card.checksum(expected: checksum)
+        }
+        .then {
+            try checkCurrent()
+        }
+        .then {
+            card.close(path: Vault.dbPath)
+        }
+        .then {
+            report(.complete)
+        }
+        .always {
+            card.disconnect().then {}
+            completion()
+        }
+        .catch { error in
+            switch error {
+            case SaveError.superseded, GKCardFileTransfer.TransferError.superseded:
+                print("save superseded")
+            default:
                 print(error)
-                syncStatus.fire(.failed)
+                report(.failed)
             }
-
-            semaphore.wait()
         }
     }
 }
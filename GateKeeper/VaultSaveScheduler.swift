@@ -0,0 +1,85 @@
+//
+//  VaultSaveScheduler.swift
+//  GateKeeper
+//
+
+import Foundation
+
+// Turns bursts of save requests into as few saves as possible. A request
+// waits `window` for more to arrive, and a request made while a save is
+// running supersedes that save: the job is told it is no longer current, and
+// a new save of the latest state follows once it has stopped.
+final class VaultSaveScheduler {
+
+    // The job checks `isCurrent` between steps and calls `completion` once, however it ends
+    typealias Job = (_ isCurrent: @escaping () -> Bool, _ completion: @escaping () -> Void) -> Void
+
+    static let defaultWindow: TimeInterval = 0.75
+
+    let window: TimeInterval
+
+    private let job: Job
+    private let queue = DispatchQueue(label: "VaultSaveScheduler")
+    private let lock = NSLock()
+    private var generation = 0
+
+    // Only touched on the queue
+    private var isPending = false
+    private var isRunning = false
+    private var timer: DispatchWorkItem?
+
+    init(window: TimeInterval = VaultSaveScheduler.defaultWindow, job: @escaping Job) {
+        self.window = window
+        self.job = job
+    }
+
+    func schedule() {
+        lock.lock()
+        generation += 1
+        lock.unlock()
+
+        queue.async {
+            self.isPending = true
+            self.timer?.cancel()
+
+            let timer = DispatchWorkItem {
+                self.timer = nil
+                self.startIfIdle()
+            }
+            self.timer = timer
+
+            self.queue.asyncAfter(deadline: .now() + self.window, execute: timer)
+        }
+    }
+
+    private func isCurrent(_ candidate: Int) -> Bool {
+        lock.lock()
+        defer { lock.unlock() }
+
+        return candidate == generation
+    }
+
+    private func startIfIdle() {
+        guard isPending, !isRunning else {
+            return
+        }
+
+        lock.lock()
+        let current = generation
+        lock.unlock()
+
+        isPending = false
+        isRunning = true
+
+        job({ self.isCurrent(current) }, {
+            self.queue.async {
+                self.isRunning = false
+
+                // A request that arrived during the job, and whose window has passed
+                if self.timer == nil {
+                    self.startIfIdle()
+                }
+            }
+        })
+    }
+}
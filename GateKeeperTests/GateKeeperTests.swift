@@ -5,6 +5,7 @@
 
 import XCTest
 @testable import GateKeeper
+import AEXML
 
 class GateKeeperTests: XCTestCase {
 
@@ -30,4 +31,1618 @@ class GateKeeperTests: XCTestCase {
         }
     }
 
+    // MARK: DataStream
+
+    class CollectingSink: KdbxByteSink {
+
+        var bytes = [UInt8]()
+        var isFinished = false
+
+        func write(_ bytes: UnsafeRawBufferPointer) throws {
+            self.bytes.append(contentsOf: bytes)
+        }
+
+        func finish() throws {
+            isFinished = true
+        }
+    }
+
+    func makeBlockPayload(size: Int, blockSize: Int) -> Data {
+        let writeStream = DataWriteStream()
+        var id = UInt32(0)
+        var remaining = size
+
+        while remaining > 0 {
+            let count = min(blockSize, remaining)
+            let bytes = [UInt8].random(size: count)
+
+            try? writeStream.write(id)
+            try? writeStream.write(Data(bytes: bytes.sha256()))
+            try? writeStream.write(UInt32(count))
+            try? writeStream.write(Data(bytes: bytes))
+
+            id += 1
+            remaining -= count
+        }
+
+        return writeStream.data
+    }
+
+    func testDataReadCursorBounds() {
+        let data = Data(bytes: [0x01, 0x02, 0x03, 0x04, 0x05])
+
+        DataReadCursor.with(data: data) { cursor in
+            XCTAssertEqual(try? cursor.read() as UInt8, 0x01)
+            XCTAssertEqual(try? cursor.read() as UInt32, 0x05040302)
+            XCTAssertFalse(cursor.hasBytesAvailable)
+            XCTAssertThrowsError(try cursor.read() as UInt8)
+            XCTAssertThrowsError(try cursor.readSlice(count: 1))
+        }
+    }
+
+    func testPerformanceDataReadStream() {
+        let payload = makeBlockPayload(size: 10 * 1024 * 1024, blockSize: 1024 * 1024)
+
+        measure {
+            let readStream = DataReadStream(data: payload)
+
+            while readStream.bytesAvailable > 0 {
+                _ = try? readStream.read() as UInt32
+                _ = try? readStream.readBytes(size: 32)
+                let size = (try? readStream.read() as UInt32) ?? 0
+                _ = try? readStream.readBytes(size: Int(size))
+            }
+        }
+    }
+
+    func testPerformanceDataReadCursor() {
+        let payload = makeBlockPayload(size: 10 * 1024 * 1024, blockSize: 1024 * 1024)
+
+        measure {
+            DataReadCursor.with(data: payload) { cursor in
+                while cursor.hasBytesAvailable {
+                    _ = try? cursor.read() as UInt32
+                    _ = try? cursor.readSlice(count: 32)
+                    let size = (try? cursor.read() as UInt32) ?? 0
+                    _ = try? cursor.readSlice(count: Int(size))
+                }
+            }
+        }
+    }
+
+    // MARK: KdbxPayloadStream
+
+    func testHashedBlockSinkReadsAllBlocks() {
+        let streamStartBytes = [UInt8].random(size: 32)
+        let blocks = makeBlockPayload(size: 300_000, blockSize: 100_000)
+
+        let writeStream = DataWriteStream()
+        try? writeStream.write(Data(bytes: streamStartBytes))
+        try? writeStream.write(blocks)
+        try? writeStream.write(UInt32(3))
+        try? writeStream.write(Data(bytes: [UInt8](repeating: 0x0, count: 32)))
+        try? writeStream.write(UInt32(0))
+
+        let collectingSink = CollectingSink()
+        let blockSink = KdbxHashedBlockSink(streamStartBytes: streamStartBytes, next: collectingSink)
+
+        XCTAssertNoThrow(try DataReadCursor.with(data: writeStream.data) { cursor in
+            try blockSink.write(chunked: cursor.readRemaining(), chunkSize: 1000)
+            try blockSink.finish()
+        })
+
+        XCTAssertEqual(collectingSink.bytes.count, 300_000)
+        XCTAssertTrue(collectingSink.isFinished)
+    }
+
+    // Builds an AEXML document from tokenizer events, to compare against AEXML's own parser
+    final class DocumentBuilder: KdbxXmlTokenizerDelegate {
+
+        let document = AEXMLDocument()
+        private var currentElement: AEXMLElement
+        private var currentValue = ""
+
+        init() {
+            currentElement = document
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, didStartElement name: String, attributes: [String: String]) throws {
+            currentValue = ""
+            currentElement = currentElement.addChild(name: name, attributes: attributes)
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, didEndElement name: String) throws {
+            currentElement.value = currentElement.value?.trimmingCharacters(in: .whitespacesAndNewlines)
+            currentElement = currentElement.parent ?? document
+
+            // Text after a child belongs to the parent alone, as with AEXML's parser
+            currentValue = ""
+        }
+
+        func tokenizer(_ tokenizer: KdbxXmlTokenizer, foundCharacters string: String) throws {
+            currentValue.append(string)
+            currentElement.value = currentValue.isEmpty ? nil : currentValue
+        }
+    }
+
+    func testXmlTokenizerAcrossChunks() {
+        let xml = "<?xml version=\"1.0\"?><A><B x=\"1 &amp; 2\">a &lt; b</B><!-- c --><C/><![CDATA[<d>]]></A>"
+        let documentBuilder = DocumentBuilder()
+        let tokenizer = KdbxXmlTokenizer(delegate: documentBuilder)
+
+        XCTAssertNoThrow(try [UInt8](xml.utf8).withUnsafeBytes { bytes in
+            try tokenizer.write(chunked: bytes, chunkSize: 3)
+            try tokenizer.finish()
+        })
+
+        let root = documentBuilder.document.root
+        XCTAssertEqual(root.name, "A")
+        XCTAssertEqual(root["B"].attributes["x"], "1 & 2")
+        XCTAssertEqual(root["B"].string, "a < b")
+        XCTAssertNotNil(root["C"].first)
+        XCTAssertEqual(root.string, "<d>")
+
+        // Text following a child is not joined to the child's text
+        let nestedBuilder = DocumentBuilder()
+        let nestedTokenizer = KdbxXmlTokenizer(delegate: nestedBuilder)
+
+        XCTAssertNoThrow(try [UInt8]("<A><B>x</B>y</A>".utf8).withUnsafeBytes { bytes in
+            try nestedTokenizer.write(chunked: bytes, chunkSize: 2)
+            try nestedTokenizer.finish()
+        })
+
+        XCTAssertEqual(nestedBuilder.document.root["B"].string, "x")
+        XCTAssertEqual(nestedBuilder.document.root.string, "y")
+    }
+
+    // MARK: KDBX 4
+
+    func bytes(hex: String) -> [UInt8] {
+        let characters = Array(hex.utf8)
+        return stride(from: 0, to: characters.count, by: 2).map { UInt8(String(decoding: characters[$0..<$0 + 2], as: UTF8.self), radix: 16)! }
+    }
+
+    func testArgon2KnownAnswers() throws {
+        // RFC 9106, section 5
+        let password = [UInt8](repeating: 0x01, count: 32)
+        let salt = [UInt8](repeating: 0x02, count: 16)
+        let secret = [UInt8](repeating: 0x03, count: 8)
+        let associatedData = [UInt8](repeating: 0x04, count: 12)
+
+        let argon2d = try KdbxArgon2.hash(password: password, salt: salt, parallelism: 4, memoryKiB: 32, iterations: 3,
+                                          version: KdbxArgon2.version13, variant: .d, secret: secret, associatedData: associatedData)
+        XCTAssertEqual(argon2d, bytes(hex: "512b391b6f1162975371d30919734294f868e3be3984f3c1a13a4db9fabe4acb"))
+
+        let argon2id = try KdbxArgon2.hash(password: password, salt: salt, parallelism: 4, memoryKiB: 32, iterations: 3,
+                                           version: KdbxArgon2.version13, variant: .id, secret: secret, associatedData: associatedData)
+        XCTAssertEqual(argon2id, bytes(hex: "0d640df58d78766c08c037a34a8b53c9d01ef0452d75b65eb52520e96b01e659"))
+    }
+
+    func testHmacBlockSinkVerifiesBlocks() throws {
+        let hmacKey = [UInt8].random(size: 64)
+        let data = [UInt8].random(size: 3000)
+
+        var stream = [UInt8]()
+        for (index, block) in [Array(data[0..<2048]), Array(data[2048..<3000]), []].enumerated() {
+            let prefix = UInt64(index).littleEndianBytes + UInt32(block.count).littleEndianBytes
+            let blockKey = KdbxCrypto.hmacBlockKey(index: UInt64(index), hmacKey: hmacKey)
+
+            stream += KdbxCrypto.hmacSha256(key: blockKey, bytes: prefix + block) + UInt32(block.count).littleEndianBytes + block
+        }
+
+        let sink = CollectingSink()
+        let blockReader = KdbxHmacBlockSink(hmacKey: hmacKey, next: sink)
+        try stream.withUnsafeBytes { try blockReader.write(chunked: $0, chunkSize: 7) }
+        try blockReader.finish()
+        XCTAssertEqual(sink.bytes, data)
+        XCTAssertTrue(sink.isFinished)
+
+        stream[40] ^= 0x01
+        XCTAssertThrowsError(try stream.withUnsafeBytes { try KdbxHmacBlockSink(hmacKey: hmacKey, next: CollectingSink()).write(chunked: $0) })
+    }
+
+    func makeEntry(index: Int) -> KdbxXml.Entry {
+        let now = Date()
+        let times = KdbxXml.Times(lastModificationTime: now, creationTime: now, lastAccessTime: now, expiryTime: now, expires: false, usageCount: 0, locationChanged: nil)
+        let association = KdbxXml.Association(window: "Target Window", keystrokeSequence: "{USERNAME}{TAB}{PASSWORD}{TAB}{ENTER}")
+        let autoType = KdbxXml.AutoType(enabled: false, dataTransferObfuscation: 0, association: association)
+
+        return KdbxXml.Entry(
+            uuid: UUID(),
+            iconId: 0,
+            foregroundColor: "",
+            backgroundColor: "",
+            overrideURL: "",
+            tags: "",
+            times: times,
+            autoType: autoType,
+            strings: [
+                KdbxXml.Str(key: "Title", value: "Entry \(index)", isProtected: false),
+                KdbxXml.Str(key: "UserName", value: "user\(index)@example.com", isProtected: false),
+                KdbxXml.Str(key: "Password", value: "password <\(index)> & more", isProtected: true),
+                KdbxXml.Str(key: "Url", value: "https://example.com/\(index)", isProtected: false),
+                KdbxXml.Str(key: "Notes", value: String(repeating: "note \(index) ", count: 8), isProtected: false)
+            ],
+            histories: []
+        )
+    }
+
+    func makeKdbx4(entryCount: Int, cipherType: Kdbx.CipherType) -> Kdbx4 {
+        var database = Kdbx(password: "test").database
+        database.root.group.entries = (0..<entryCount).map { makeEntry(index: $0) }
+        database.meta.binaries = [
+            KdbxXml.Binary(id: "0", compressed: false, content: Data(bytes: [UInt8].random(size: 100)).base64EncodedString(), isProtected: false),
+            KdbxXml.Binary(id: "1", compressed: false, content: Data(bytes: [UInt8].random(size: 50)).base64EncodedString(), isProtected: true)
+        ]
+
+        let header = Kdbx4Header()
+        header.cipherType = cipherType
+        header.transformRounds = 1000
+
+        return Kdbx4(database: database, header: header)
+    }
+
+    func testKdbx4RoundTrip() throws {
+        for cipherType in [Kdbx.CipherType.aes, .chaCha20] {
+            let kdbx4 = makeKdbx4(entryCount: 5000, cipherType: cipherType)
+            let encryptedData = try kdbx4.encrypt(compositeKey: "test".sha256())
+
+            let kdbx = try Kdbx(encryptedData: encryptedData, password: "test")
+            let entries = kdbx.database.root.group.entries
+
+            XCTAssertEqual(entries.map { $0.uuid }, kdbx4.database.root.group.entries.map { $0.uuid })
+            XCTAssertEqual(entries.last?.getStr(key: "Password")?.value, "password <4999> & more")
+            XCTAssertEqual(kdbx.database.meta.binaries.map { $0.content }, kdbx4.database.meta.binaries.map { $0.content })
+            XCTAssertEqual(kdbx.database.meta.binaries.map { $0.isProtected }, [false, true])
+            XCTAssertEqual(
+                Int(entries[0].times.creationTime?.timeIntervalSince1970 ?? 0),
+                Int(kdbx4.database.root.group.entries[0].times.creationTime?.timeIntervalSince1970 ?? 0)
+            )
+
+            XCTAssertThrowsError(try Kdbx(encryptedData: encryptedData, password: "wrong"))
+        }
+    }
+
+    func testKdbx4RejectsOutOfRangeKdfParameters() throws {
+        let kdbx4 = makeKdbx4(entryCount: 1, cipherType: .chaCha20)
+        let header = Kdbx4Header()
+        header.kdf = .argon2(Kdbx4Header.Argon2Parameters(
+            variant: .d,
+            salt: [UInt8].random(size: 32),
+            parallelism: 1,
+            memory: 64 * 1024,
+            iterations: 1,
+            version: KdbxArgon2.version13
+        ))
+        let encryptedData = try Kdbx4(database: kdbx4.database, header: header).encrypt(compositeKey: "test".sha256())
+
+        // Set I to UInt64.max: type, key length, "I", value length, value
+        var bytes = [UInt8](encryptedData)
+        let pattern: [UInt8] = [0x05, 1, 0, 0, 0, UInt8(ascii: "I"), 8, 0, 0, 0]
+        guard let offset = (0...bytes.count - pattern.count - 8).first(where: { Array(bytes[$0..<$0 + pattern.count]) == pattern }) else {
+            return XCTFail("no iterations parameter")
+        }
+        bytes.replaceSubrange(offset + pattern.count..<offset + pattern.count + 8, with: [UInt8](repeating: 0xff, count: 8))
+
+        XCTAssertThrowsError(try Kdbx(encryptedData: Data(bytes: bytes), password: "test")) { error in
+            XCTAssertEqual(error as? Kdbx4Header.ReadError, .invalidKdfParameters)
+        }
+    }
+
+    func testPerformanceKdbx4Encrypt() {
+        let kdbx4 = makeKdbx4(entryCount: 20000, cipherType: .chaCha20)
+
+        self.measure {
+            _ = try? kdbx4.encrypt(compositeKey: "test".sha256())
+        }
+    }
+
+    // MARK: AES-KDF
+
+    func testAesKdfKnownAnswer() throws {
+        // 100 rounds of AES-256-ECB, computed with OpenSSL
+        let seed = (32..<64).map { UInt8($0) }
+        let key = (0..<32).map { UInt8($0) }
+
+        var reported = [Double]()
+        let transformed = try KdbxAesKdf(seed: seed).transform(key: key, rounds: 100) { reported.append($0) }
+
+        XCTAssertEqual(transformed, bytes(hex: "31b980ea73304d61a303b70ecd11dbeddad6e1b06fd0c734f09dd1df8f2f7aae"))
+        XCTAssertEqual(reported.last, 1.0)
+    }
+
+    func testAesKdfCancellation() {
+        let kdf = KdbxAesKdf(seed: [UInt8].random(size: 32))
+
+        XCTAssertThrowsError(try kdf.transform(key: [UInt8].random(size: 32), rounds: 100_000_000) { _ in kdf.cancel() })
+    }
+
+    // The variant KdbxAesKdf is compared against: each 16-byte half of the
+    // key chained on its own thread, one CCCryptorUpdate per block per round
+    func twoLaneAesKdf(seed: [UInt8], key: [UInt8], rounds: Int) -> [UInt8] {
+        let state = UnsafeMutablePointer<UInt8>.allocate(capacity: key.count)
+        state.initialize(from: key, count: key.count)
+
+        defer {
+            state.deallocate(capacity: key.count)
+        }
+
+        DispatchQueue.concurrentPerform(iterations: 2) { lane in
+            var cryptor: CCCryptorRef?
+            CCCryptorCreate(UInt32(kCCEncrypt), UInt32(kCCAlgorithmAES128), UInt32(kCCOptionECBMode), seed, kCCKeySizeAES256, nil, &cryptor)
+
+            let block = state + lane * kCCBlockSizeAES128
+            var moved = 0
+            for _ in 0..<rounds {
+                CCCryptorUpdate(cryptor, block, kCCBlockSizeAES128, block, kCCBlockSizeAES128, &moved)
+            }
+
+            CCCryptorRelease(cryptor)
+        }
+
+        return [UInt8](UnsafeBufferPointer(start: state, count: key.count))
+    }
+
+    func testAesKdfMatchesTwoLanes() throws {
+        let seed = [UInt8].random(size: 32)
+        let key = [UInt8].random(size: 32)
+
+        XCTAssertEqual(try KdbxAesKdf(seed: seed).transform(key: key, rounds: 10_000), twoLaneAesKdf(seed: seed, key: key, rounds: 10_000))
+    }
+
+    func testPerformanceAesKdf() {
+        let kdf = KdbxAesKdf(seed: [UInt8].random(size: 32))
+        let key = [UInt8].random(size: 32)
+
+        self.measure {
+            _ = try? kdf.transform(key: key, rounds: 1_000_000)
+        }
+    }
+
+    func testPerformanceAesKdfTwoLanes() {
+        let seed = [UInt8].random(size: 32)
+        let key = [UInt8].random(size: 32)
+
+        self.measure {
+            _ = twoLaneAesKdf(seed: seed, key: key, rounds: 1_000_000)
+        }
+    }
+
+    func testKdfCalibrationReusesMeasurement() throws {
+        KdbxKdfCalibration.removeMeasurements()
+
+        let measured = try KdbxKdfCalibration.throughput(kdf: .aes, window: 0.05)
+        let stored = try KdbxKdfCalibration.throughput(kdf: .aes)
+        XCTAssertEqual(measured, stored)
+
+        let rounds = try KdbxKdfCalibration.rounds(kdf: .aes, target: 1.0)
+        XCTAssertGreaterThanOrEqual(rounds, KdbxKdfCalibration.Kdf.aes.minimumRounds)
+        XCTAssertEqual(rounds % 1000, 0)
+
+        KdbxKdfCalibration.removeMeasurements()
+    }
+
+    func testKdfCalibrationLeavesOutArgon2FixedCost() throws {
+        KdbxKdfCalibration.removeMeasurements()
+
+        let kdf = KdbxKdfCalibration.Kdf.argon2(variant: .d, version: KdbxArgon2.version13, memoryKiB: 4096, parallelism: 2)
+        let rounds = try KdbxKdfCalibration.rounds(kdf: kdf, target: 0.5, useStoredMeasurement: false)
+
+        // The suggested iterations land near the target, fixed cost included
+        let start = Date()
+        _ = try KdbxArgon2.hash(password: [UInt8].random(size: 32), salt: [UInt8].random(size: 32), parallelism: 2, memoryKiB: 4096,
+                                iterations: rounds, version: KdbxArgon2.version13, variant: .d)
+        let elapsed = Date().timeIntervalSince(start)
+
+        XCTAssertGreaterThan(elapsed, 0.25)
+        XCTAssertLessThan(elapsed, 1.0)
+
+        KdbxKdfCalibration.removeMeasurements()
+    }
+
+    // MARK: Stream ciphers
+
+    func keyStream(_ cipher: KdbxStreamCipher, chunks: [Int]) -> [UInt8] {
+        var bytes = [UInt8](repeating: 0, count: chunks.reduce(0, +))
+        var offset = 0
+
+        bytes.withUnsafeMutableBytes { buffer in
+            for chunk in chunks {
+                cipher.transform(UnsafeMutableRawBufferPointer(rebasing: buffer[offset..<offset + chunk]))
+                offset += chunk
+            }
+        }
+
+        return bytes
+    }
+
+    func testStreamCipherKeyStreams() {
+        let key = (0..<32).map { UInt8($0) }
+
+        // Reference digests of the first 1000 keystream bytes
+        let salsa20 = keyStream(Salsa20(key: key, iv: (0..<8).map { UInt8($0) }), chunks: [1, 7, 300, 692])
+        XCTAssertEqual(salsa20.sha256(), bytes(hex: "5d2e3d80e99c0280f21f4c01ee3280abd3863464f63dc69609b4c51337626acf"))
+
+        let chaCha20 = keyStream(ChaCha20(key: key, nonce: (0..<12).map { UInt8($0) }), chunks: [255, 2, 743])
+        XCTAssertEqual(chaCha20.sha256(), bytes(hex: "3a88566112aab062fe3a7b9886097e33bb81f3ac05437feeadcdfa812b617661"))
+
+        // ECRYPT Salsa20 set 1, vector 0
+        let ecrypt = keyStream(Salsa20(key: [0x80] + [UInt8](repeating: 0, count: 31), iv: [UInt8](repeating: 0, count: 8)), chunks: [8])
+        XCTAssertEqual(ecrypt, bytes(hex: "e3be8fdd8beca2e3"))
+    }
+
+    func testPerformanceSalsa20Transform() {
+        var bytes = [UInt8](repeating: 0, count: 16 * 1024 * 1024)
+        let salsa20 = Salsa20(key: [UInt8].random(size: 32), iv: [UInt8].random(size: 8))
+
+        self.measure {
+            bytes.withUnsafeMutableBytes { salsa20.transform($0) }
+        }
+    }
+
+    // MARK: Protected values
+
+    func makeProtectedXml(entryCount: Int, key: [UInt8], iv: [UInt8]) throws -> String {
+        var database = Kdbx(password: "test").database
+        database.root.group.entries = (0..<entryCount).map { makeEntry(index: $0) }
+        database.root.group.entries[0].setStr(key: "Notes", value: "Grüße, 密码 🔑", isProtected: true)
+
+        let elem = database.build()
+        try protectPerValue(elem: elem, streamCipher: Salsa20(key: key, iv: iv))
+
+        return elem.xml
+    }
+
+    func protectPerValue(elem: AEXMLElement, streamCipher: KdbxStreamCipher) throws {
+        for child in elem.children {
+            if child.name == "Value" && child.attributes["Protected"]?.xmlBool ?? false {
+                child.value = try streamCipher.protect(string: child.value ?? "")
+            }
+
+            try protectPerValue(elem: child, streamCipher: streamCipher)
+        }
+    }
+
+    func unprotectPerValue(elem: AEXMLElement, streamCipher: KdbxStreamCipher) throws {
+        for child in elem.children {
+            if child.name == "Value" && child.attributes["Protected"]?.xmlBool ?? false {
+                child.value = try streamCipher.unprotect(string: child.value ?? "")
+                child.attributes.removeValue(forKey: "Protected")
+            }
+
+            try unprotectPerValue(elem: child, streamCipher: streamCipher)
+        }
+    }
+
+    func testBase64DecodeMatchesFoundation() {
+        for string in ["", "Zg==", "Zm8=", "Zm9v", "Zm9vYmFy", "Zg=", "Zm9v\n", "****"] {
+            var bytes = [UInt8]()
+            let decoded = string.base64Decode(appendingTo: &bytes) ? bytes : nil
+
+            XCTAssertEqual(decoded.map { Data(bytes: $0) }, Data(base64Encoded: string), string)
+        }
+    }
+
+    // MARK: Struct builder
+
+    func summary(entry: KdbxXml.Entry) -> String {
+        let strings = entry.strings.map { "\($0.key)=\($0.value)" }.joined(separator: ",")
+        let created = Int(entry.times.creationTime?.timeIntervalSince1970 ?? 0)
+        let window = entry.autoType.association?.window ?? "-"
+
+        return "\(entry.uuid) \(entry.iconId) \(created) \(window) [\(strings)] \(entry.histories.map { summary(entry: $0) })"
+    }
+
+    func buildStructs(xml: String, streamCipher: KdbxStreamCipher?) throws -> KdbxXml.KeePassFile {
+        let structBuilder = KdbxXml.StructBuilder(streamCipher: streamCipher)
+        let tokenizer = KdbxXmlTokenizer(delegate: structBuilder)
+
+        try [UInt8](xml.utf8).withUnsafeBytes { bytes in
+            try tokenizer.write(chunked: bytes, chunkSize: 4096)
+            try tokenizer.finish()
+        }
+
+        return structBuilder.database
+    }
+
+    func testStructBuilderMatchesDocumentParse() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 8)
+        let xml = try makeProtectedXml(entryCount: 500, key: key, iv: iv)
+
+        let document = try AEXMLDocument(xml: xml)
+        try unprotectPerValue(elem: document.root, streamCipher: Salsa20(key: key, iv: iv))
+        let reference = KdbxXml.KeePassFile.parse(elem: document.root)
+
+        let database = try buildStructs(xml: xml, streamCipher: Salsa20(key: key, iv: iv))
+
+        XCTAssertEqual(database.meta.databaseName, reference.meta.databaseName)
+        XCTAssertEqual(database.meta.historyMaxSize, reference.meta.historyMaxSize)
+        XCTAssertEqual(database.root.group.uuid, reference.root.group.uuid)
+        XCTAssertEqual(database.root.group.name, reference.root.group.name)
+        XCTAssertEqual(database.root.group.entries.map { summary(entry: $0) }, reference.root.group.entries.map { summary(entry: $0) })
+        XCTAssertEqual(database.root.group.entries[0].getStr(key: "Notes")?.value, "Grüße, 密码 🔑")
+
+        // The protection flag survives unprotecting, so saving protects the value again
+        XCTAssertEqual(database.root.group.entries[0].getStr(key: "Password")?.isProtected, true)
+    }
+
+    func testStructBuilderAdvancesStreamPastSkippedValues() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 8)
+
+        // The first protected value sits in an element the builder does not keep
+        let document = try AEXMLDocument(xml: """
+            <KeePassFile><Root><Group><Entry>
+            <Unknown><Value Protected="True">not kept</Value></Unknown>
+            <String><Key>Password</Key><Value Protected="True">kept</Value></String>
+            </Entry></Group></Root></KeePassFile>
+            """)
+        try protectPerValue(elem: document.root, streamCipher: Salsa20(key: key, iv: iv))
+
+        let database = try buildStructs(xml: document.xml, streamCipher: Salsa20(key: key, iv: iv))
+
+        XCTAssertEqual(database.root.group.entries.first?.getStr(key: "Password")?.value, "kept")
+    }
+
+    func testPerformanceStructBuilder() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 8)
+        let xml = try makeProtectedXml(entryCount: 10000, key: key, iv: iv)
+
+        self.measure {
+            _ = try? buildStructs(xml: xml, streamCipher: Salsa20(key: key, iv: iv))
+        }
+    }
+
+    // MARK: XML writer
+
+    func writeXml(database: KdbxXml.KeePassFile, streamCipher: KdbxStreamCipher?) throws -> String {
+        let sink = CollectingSink()
+        try KdbxXmlWriter(next: sink, dateFormat: .iso8601, streamCipher: streamCipher).write(file: database)
+
+        return String(decoding: sink.bytes, as: UTF8.self)
+    }
+
+    func testXmlWriterMatchesBuild() throws {
+        var database = Kdbx(password: "test").database
+        database.root.group.entries = (0..<200).map { makeEntry(index: $0) }
+        database.root.group.entries[0].setStr(key: "Notes", value: "\"Grüße\" <b>&amp;</b> 🔑", isProtected: false)
+        database.root.group.entries[1].histories = [makeEntry(index: 1000)]
+        database.root.group.groups = [database.root.group]
+
+        let reference = try buildStructs(xml: database.build().xmlCompact, streamCipher: nil)
+
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 8)
+        let xml = try writeXml(database: database, streamCipher: Salsa20(key: key, iv: iv))
+        let written = try buildStructs(xml: xml, streamCipher: Salsa20(key: key, iv: iv))
+
+        XCTAssertEqual(written.meta.databaseName, reference.meta.databaseName)
+        XCTAssertEqual(written.root.group.groups.count, 1)
+        XCTAssertEqual(written.root.group.entries.map { summary(entry: $0) }, reference.root.group.entries.map { summary(entry: $0) })
+        XCTAssertEqual(written.root.group.groups[0].entries.map { summary(entry: $0) }, reference.root.group.groups[0].entries.map { summary(entry: $0) })
+        XCTAssertEqual(written.root.group.entries[0].getStr(key: "Notes")?.value, "\"Grüße\" <b>&amp;</b> 🔑")
+
+        // Protected values never appear in the clear
+        XCTAssertFalse(xml.contains("password <0> & more"))
+        XCTAssertFalse(xml.contains("password &lt;0&gt; &amp; more"))
+    }
+
+    func testXmlWriterMarkupScan() {
+        let plain = [UInt8](String(repeating: "plain text ", count: 5).utf8)
+
+        for special in ["&", "<", ">", "\""] {
+            for position in [0, 7, 8, 15, plain.count - 1] {
+                var bytes = plain
+                bytes[position] = special.utf8.first!
+
+                XCTAssertTrue(bytes.withUnsafeBufferPointer { KdbxXmlWriter.containsMarkup($0) }, "\(special) at \(position)")
+            }
+        }
+
+        XCTAssertFalse(plain.withUnsafeBufferPointer { KdbxXmlWriter.containsMarkup($0) })
+        XCTAssertFalse([UInt8]("Grüße 密码 🔑".utf8).withUnsafeBufferPointer { KdbxXmlWriter.containsMarkup($0) })
+    }
+
+    func testKdbx3RoundTrip() throws {
+        let kdbx = Kdbx(password: "test")
+        kdbx.transformationRounds = 1000
+
+        for index in 0..<500 {
+            kdbx.add(groupUUID: kdbx.database.root.group.uuid, entry: makeEntry(index: index))
+        }
+
+        let encryptedData = try kdbx.encrypt()
+        let reloaded = try Kdbx(encryptedData: encryptedData, password: "test")
+
+        XCTAssertEqual(reloaded.database.root.group.entries.map { summary(entry: $0) }, kdbx.database.root.group.entries.map { summary(entry: $0) })
+        XCTAssertEqual(reloaded.database.root.group.entries.last?.getStr(key: "Password")?.isProtected, true)
+    }
+
+    func testSavesShareNoCiphertext() throws {
+        let kdbx = makeIndexedKdbx(groupCount: 4, entriesPerGroup: 50)
+
+        // Fresh seeds and IV on every save, so two saves of the same vault have no block in common
+        let first = try kdbx.encrypt()
+        let second = try kdbx.encrypt()
+        let blocks = { (data: Data) in Set(stride(from: 0, to: data.count - 4096, by: 4096).map { data.subdata(in: $0..<$0 + 4096) }) }
+
+        XCTAssertTrue(blocks(first).isDisjoint(with: blocks(second)))
+        XCTAssertEqual(flatten(group: try Kdbx(encryptedData: second, password: "test").database.root.group), flatten(group: kdbx.database.root.group))
+    }
+
+    func testPerformanceXmlWriter() {
+        var database = Kdbx(password: "test").database
+        database.root.group.entries = (0..<10000).map { makeEntry(index: $0) }
+
+        self.measure {
+            _ = try? writeXml(database: database, streamCipher: Salsa20(key: [UInt8].random(size: 32), iv: [UInt8].random(size: 8)))
+        }
+    }
+
+    // MARK: UUID index
+
+    func makeTree(groupCount: Int, entriesPerGroup: Int) -> KdbxXml.KeePassFile {
+        var database = Kdbx(password: "test").database
+
+        var root = database.root
+        root.group.groups = (0..<groupCount).map { groupIndex in
+            var group = KdbxXml.Root.makeDefaultGroup()
+            group.name = "Group \(groupIndex)"
+            group.entries = (0..<entriesPerGroup).map { makeEntry(index: groupIndex * entriesPerGroup + $0) }
+            return group
+        }
+
+        // One level deeper, to exercise multi-step paths
+        let nested = root.group.groups.removeLast()
+        root.group.groups[0].groups.append(nested)
+
+        database.root = root
+        return database
+    }
+
+    func flatten(group: KdbxXml.Group) -> [String] {
+        return ["group \(group.uuid) \(group.name)"] + group.entries.map { summary(entry: $0) } + group.groups.flatMap { flatten(group: $0) }
+    }
+
+    func allGroups(_ group: KdbxXml.Group) -> [KdbxXml.Group] {
+        return [group] + group.groups.flatMap { allGroups($0) }
+    }
+
+    func testUUIDIndexTracksEdits() {
+        var database = makeTree(groupCount: 8, entriesPerGroup: 20)
+        var reference = database.root.group
+
+        func random(_ count: Int) -> Int {
+            return Int(arc4random_uniform(UInt32(count)))
+        }
+
+        for step in 0..<400 {
+            let groups = allGroups(reference)
+            let entries = groups.flatMap { $0.entries }
+            let group = groups[random(groups.count)]
+
+            switch step % 5 {
+            case 0:
+                let entry = makeEntry(index: 10000 + step)
+                database.add(groupUUID: group.uuid, entry: entry)
+                reference.add(groupUUID: group.uuid, entry: entry)
+            case 1 where !entries.isEmpty:
+                let uuid = entries[random(entries.count)].uuid
+                database.delete(entryUUID: uuid)
+                reference.delete(entryUUID: uuid)
+            case 2 where !entries.isEmpty:
+                var entry = entries[random(entries.count)]
+                entry.setStr(key: "Title", value: "Edited \(step)", isProtected: false)
+                database.update(entry: entry)
+                reference.update(entry: entry)
+            case 3:
+                var subgroup = KdbxXml.Root.makeDefaultGroup()
+                subgroup.entries = [makeEntry(index: 20000 + step)]
+                database.add(groupUUID: group.uuid, group: subgroup)
+                reference.add(groupUUID: group.uuid, group: subgroup)
+            case 4 where group.uuid != reference.uuid:
+                database.delete(groupUUID: group.uuid)
+                reference.delete(groupUUID: group.uuid)
+            default:
+                break
+            }
+        }
+
+        XCTAssertEqual(flatten(group: database.root.group), flatten(group: reference))
+
+        for group in allGroups(reference) {
+            XCTAssertEqual(database.get(groupUUID: group.uuid)?.uuid, group.uuid)
+
+            for entry in group.entries {
+                XCTAssertEqual(database.get(entryUUID: entry.uuid).map { summary(entry: $0) }, summary(entry: entry))
+            }
+        }
+
+        XCTAssertNil(database.get(entryUUID: UUID()))
+    }
+
+    func randomEdits(database: KdbxXml.KeePassFile, count: Int) -> [KdbxXml.Entry] {
+        let entries = allGroups(database.root.group).flatMap { $0.entries }
+
+        return (0..<count).map { index in
+            var entry = entries[Int(arc4random_uniform(UInt32(entries.count)))]
+            entry.setStr(key: "Title", value: "Edited \(index)", isProtected: false)
+            return entry
+        }
+    }
+
+    func testPerformanceIndexedEdits() {
+        let database = makeTree(groupCount: 100, entriesPerGroup: 200)
+        let edits = randomEdits(database: database, count: 1000)
+
+        self.measure {
+            var copy = database
+            for entry in edits {
+                copy.update(entry: entry)
+            }
+        }
+    }
+
+    func testPerformanceRecursiveEdits() {
+        let database = makeTree(groupCount: 100, entriesPerGroup: 200)
+        let edits = randomEdits(database: database, count: 1000)
+
+        self.measure {
+            var group = database.root.group
+            for entry in edits {
+                group.update(entry: entry)
+            }
+        }
+    }
+
+    // MARK: Search index
+
+    func makeIndexedKdbx(groupCount: Int, entriesPerGroup: Int) -> Kdbx {
+        let kdbx = Kdbx(password: "test")
+        let rootUUID = kdbx.database.root.group.uuid
+
+        for group in makeTree(groupCount: groupCount, entriesPerGroup: entriesPerGroup).root.group.groups {
+            kdbx.add(groupUUID: rootUUID, group: group)
+        }
+
+        return kdbx
+    }
+
+    func assertSearchMatchesTreeWalk(_ kdbx: Kdbx, queries: [String]) {
+        let attributes: Set<KdbxEntrySearchAttribute> = [.title, .username, .url, .notes]
+
+        for query in queries {
+            let expected = kdbx.database.root.group.search(query: query, attributes: attributes)
+            let found = kdbx.search(query: query, attributes: attributes)
+
+            for attribute in attributes {
+                XCTAssertEqual(found[attribute]?.map { $0.uuid } ?? [], expected[attribute]?.map { $0.uuid } ?? [], "\(query)")
+            }
+        }
+    }
+
+    func testSearchIndexMatchesTreeWalk() {
+        let kdbx = makeIndexedKdbx(groupCount: 8, entriesPerGroup: 20)
+        let queries = ["", "1", "En", "entry 1", "USER1", "example.com/15", "note 3 note", "zzz", "Ä", "straße"]
+
+        var entries = allGroups(kdbx.database.root.group).flatMap { $0.entries }
+        entries[0].setStr(key: "Title", value: "Straße Ärger", isProtected: false)
+        entries[1].setStr(key: "Notes", value: "STRASSE", isProtected: false)
+        kdbx.update(entry: entries[0])
+        kdbx.update(entry: entries[1])
+
+        assertSearchMatchesTreeWalk(kdbx, queries: queries)
+
+        let groups = allGroups(kdbx.database.root.group)
+        kdbx.delete(entryUUID: entries[2].uuid)
+        kdbx.delete(groupUUID: groups[2].uuid)
+        kdbx.add(groupUUID: groups[1].uuid, entry: makeEntry(index: 100))
+
+        var renamed = groups[1]
+        renamed.entries = Array(renamed.entries.prefix(2))
+        kdbx.update(group: renamed)
+
+        var subgroup = KdbxXml.Root.makeDefaultGroup()
+        subgroup.entries = [makeEntry(index: 1000)]
+        kdbx.add(groupUUID: groups[0].uuid, group: subgroup)
+
+        assertSearchMatchesTreeWalk(kdbx, queries: queries)
+    }
+
+    func testPerformanceIndexedSearch() {
+        let kdbx = makeIndexedKdbx(groupCount: 100, entriesPerGroup: 200)
+
+        self.measure {
+            _ = kdbx.search(query: "entry 1999", attributes: [.title, .username, .url, .notes])
+        }
+    }
+
+    func testPerformanceTreeWalkSearch() {
+        let kdbx = makeIndexedKdbx(groupCount: 100, entriesPerGroup: 200)
+
+        self.measure {
+            _ = kdbx.database.root.group.search(query: "entry 1999", attributes: [.title, .username, .url, .notes])
+        }
+    }
+
+    // MARK: Search session
+
+    func sessionResults(session: KdbxSearchSession, query: String) -> KdbxSearchSession.Results? {
+        let done = expectation(description: query)
+        var complete: KdbxSearchSession.Results?
+
+        session.search(query: query) { results in
+            if results.isComplete {
+                complete = results
+                done.fulfill()
+            }
+        }
+
+        waitForExpectations(timeout: 10.0, handler: nil)
+        return complete
+    }
+
+    func testSearchSessionMatchesTreeWalk() {
+        let kdbx = makeIndexedKdbx(groupCount: 20, entriesPerGroup: 100)
+        let database = kdbx.database
+        let session = kdbx.makeSearchSession()
+        let attributes: Set<KdbxEntrySearchAttribute> = [.title, .username, .url, .notes]
+
+        // Typing, deleting, and retyping a different query
+        for query in ["e", "en", "Entr", "entry 1", "entry 12", "entry 1", "", "user", "user5@", "COM/19", "ü"] {
+            guard let results = sessionResults(session: session, query: query) else {
+                XCTFail(query)
+                continue
+            }
+
+            let expected = database.root.group.search(query: query, attributes: attributes)
+
+            for attribute in attributes {
+                let found = results.entries[attribute]?.map { $0.uuid } ?? []
+                let walked = expected[attribute]?.map { $0.uuid } ?? []
+
+                XCTAssertEqual(Set(found), Set(walked), query)
+                XCTAssertEqual(found.count, walked.count, query)
+            }
+        }
+
+        XCTAssertEqual(sessionResults(session: session, query: "entry 1999")?.bestMatches.first?.entry.getStr(key: "Title")?.value, "Entry 1999")
+
+        // "Entry 1…" matches at a word start, "Entry 21" inside a word
+        let titles = (sessionResults(session: session, query: "1")?.entries[.title] ?? []).map { $0.getStr(key: "Title")?.value ?? "" }
+        let firstInside = titles.index { !$0.hasPrefix("Entry 1") } ?? titles.count
+        XCTAssertGreaterThan(firstInside, 0)
+        XCTAssertFalse(titles[firstInside...].contains { $0.hasPrefix("Entry 1") })
+    }
+
+    func testSearchSessionStreamsBatches() {
+        let kdbx = makeIndexedKdbx(groupCount: 20, entriesPerGroup: 100)
+        let session = kdbx.makeSearchSession(attributes: [.title])
+        let done = expectation(description: "entry")
+        var counts = [Int]()
+        var complete: KdbxSearchSession.Results?
+
+        session.search(query: "entry") { results in
+            counts.append(results.entries[.title]?.count ?? 0)
+
+            if results.isComplete {
+                complete = results
+                done.fulfill()
+            } else {
+                XCTAssertTrue(results.bestMatches.isEmpty)
+            }
+        }
+
+        waitForExpectations(timeout: 10.0, handler: nil)
+
+        // 2000 titles arrive in growing batches, the first one capped
+        XCTAssertEqual(counts.first, KdbxSearchSession.firstBatchSize)
+        XCTAssertEqual(counts, counts.sorted())
+        XCTAssertGreaterThan(counts.count, 2)
+        XCTAssertEqual(counts.last, complete?.entries[.title]?.count)
+        XCTAssertFalse(complete?.bestMatches.isEmpty ?? true)
+    }
+
+    func testPerformanceSearchSessionTyping() {
+        let kdbx = makeIndexedKdbx(groupCount: 100, entriesPerGroup: 200)
+
+        self.measure {
+            let session = kdbx.makeSearchSession()
+            for length in 1...10 {
+                _ = sessionResults(session: session, query: String("entry 1999".prefix(length)))
+            }
+        }
+    }
+
+    // MARK: Fuzzy search
+
+    func makeNamedEntry(title: String, username: String = "", url: String = "", notes: String = "") -> KdbxXml.Entry {
+        var entry = makeEntry(index: 0)
+        entry.setStr(key: "Title", value: title, isProtected: false)
+        entry.setStr(key: "UserName", value: username, isProtected: false)
+        entry.setStr(key: "Url", value: url, isProtected: false)
+        entry.setStr(key: "Notes", value: notes, isProtected: false)
+        return entry
+    }
+
+    func testFuzzyMatcherScores() {
+        guard let matcher = KdbxFuzzyMatcher(query: "Git") else {
+            return XCTFail()
+        }
+
+        let prefix = matcher.score(field: KdbxFuzzyMatcher.fold("GitHub"), allowSubsequence: true) ?? 0
+        let wordStart = matcher.score(field: KdbxFuzzyMatcher.fold("Work git server"), allowSubsequence: true) ?? 0
+        let inside = matcher.score(field: KdbxFuzzyMatcher.fold("Digital"), allowSubsequence: true) ?? 0
+        let subsequence = matcher.score(field: KdbxFuzzyMatcher.fold("Google Internet"), allowSubsequence: true) ?? 0
+
+        XCTAssertGreaterThan(prefix, wordStart)
+        XCTAssertGreaterThan(wordStart, inside)
+        XCTAssertGreaterThan(inside, subsequence)
+        XCTAssertGreaterThan(subsequence, 0)
+        XCTAssertNil(matcher.score(field: KdbxFuzzyMatcher.fold("Google Internet"), allowSubsequence: false))
+        XCTAssertNil(matcher.score(field: KdbxFuzzyMatcher.fold("Bank"), allowSubsequence: true))
+        XCTAssertNil(KdbxFuzzyMatcher(query: ""))
+
+        let url = KdbxFuzzyMatcher.fold("https://www.amazon.co.uk:443/login?next=/")
+        XCTAssertEqual(String(decoding: url[KdbxFuzzyMatcher.host(url: url)], as: UTF8.self), "amazon.co.uk")
+        XCTAssertEqual(KdbxFuzzyMatcher(query: "amaz")?.score(url: url), 950)
+        XCTAssertEqual(KdbxFuzzyMatcher(query: "co")?.score(url: url), 850)
+        XCTAssertEqual(KdbxFuzzyMatcher(query: "login")?.score(url: url).map { $0 <= 600 }, true)
+    }
+
+    func testRankedSearch() {
+        let kdbx = Kdbx(password: "test")
+        let rootUUID = kdbx.database.root.group.uuid
+
+        let entries = [
+            makeNamedEntry(title: "Digital Ocean"),
+            makeNamedEntry(title: "Shopping", notes: "gift cards from amazon"),
+            makeNamedEntry(title: "GitHub"),
+            makeNamedEntry(title: "Shop", url: "https://www.amazon.com/"),
+            makeNamedEntry(title: "Work", username: "git@example.com"),
+            makeNamedEntry(title: "Great Insurance Tax")
+        ]
+        entries.forEach { kdbx.add(groupUUID: rootUUID, entry: $0) }
+
+        let titles = kdbx.rankedSearch(query: "git", attributes: [.title, .username, .url, .notes], limit: 10).map { $0.entry.getStr(key: "Title")?.value ?? "" }
+        XCTAssertEqual(titles, ["GitHub", "Work", "Digital Ocean", "Great Insurance Tax"])
+
+        let amazon = kdbx.rankedSearch(query: "amazon", attributes: [.title, .username, .url, .notes], limit: 10)
+        XCTAssertEqual(amazon.map { $0.entry.uuid }, [entries[3].uuid, entries[1].uuid])
+        XCTAssertEqual(amazon.first?.attribute, .url)
+
+        XCTAssertEqual(kdbx.rankedSearch(query: "git", attributes: [.title], limit: 2).map { $0.entry.uuid }, [entries[2].uuid, entries[0].uuid])
+        XCTAssertTrue(kdbx.rankedSearch(query: "git", attributes: [.title], limit: 0).isEmpty)
+
+        // Ties at the cutoff keep the entries that come first in the document
+        let tied = (0..<20).map { _ in makeNamedEntry(title: "Mirror") }
+        tied.forEach { kdbx.add(groupUUID: rootUUID, entry: $0) }
+        XCTAssertEqual(kdbx.rankedSearch(query: "mirror", attributes: [.title], limit: 3).map { $0.entry.uuid }, tied.prefix(3).map { $0.uuid })
+    }
+
+    func testPerformanceRankedSearch() {
+        let kdbx = makeIndexedKdbx(groupCount: 100, entriesPerGroup: 200)
+
+        self.measure {
+            _ = kdbx.rankedSearch(query: "ent199", attributes: [.title, .username, .url, .notes], limit: 20)
+        }
+    }
+
+    // MARK: Card file transfer
+
+    class SimulatedTransport: GKCardTransport {
+
+        enum SimulatedError: Error {
+            case writeFailed
+        }
+
+        var maximumWriteLength: Int
+        var failAfterWrites: Int?
+        var received = Data()
+        var chunkSizes = [Int]()
+
+        private let queue = DispatchQueue(label: "SimulatedTransport")
+
+        init(maximumWriteLength: Int) {
+            self.maximumWriteLength = maximumWriteLength
+        }
+
+        func write(_ value: Data, completion: @escaping (Error?) -> Void) {
+            queue.async {
+                self.chunkSizes.append(value.count)
+
+                if let limit = self.failAfterWrites, self.chunkSizes.count > limit {
+                    completion(SimulatedError.writeFailed)
+                } else {
+                    self.received.append(value)
+                    completion(nil)
+                }
+            }
+        }
+    }
+
+    func runTransfer(_ transfer: GKCardFileTransfer) -> Error? {
+        let done = expectation(description: "transfer")
+        var result: Error?
+        var completions = 0
+
+        transfer.start { error in
+            result = error
+            completions += 1
+            done.fulfill()
+        }
+
+        waitForExpectations(timeout: 10.0, handler: nil)
+        XCTAssertEqual(completions, 1)
+        return result
+    }
+
+    func testFileTransferChunksByWriteLength() {
+        let data = Data(bytes: [UInt8].random(size: 10000))
+
+        for writeLength in [20, 128, 182, 512] {
+            let transport = SimulatedTransport(maximumWriteLength: writeLength)
+            let transfer = GKCardFileTransfer(data: data, transport: transport, maximumOutstandingWrites: 4)
+
+            XCTAssertNil(runTransfer(transfer))
+            XCTAssertEqual(transport.received, data)
+            XCTAssertEqual(transport.chunkSizes.max(), writeLength)
+            XCTAssertEqual(transfer.statistics.writes, (data.count + writeLength - 1) / writeLength)
+            XCTAssertLessThanOrEqual(transfer.statistics.mostOutstanding, 4)
+        }
+
+        XCTAssertNil(runTransfer(GKCardFileTransfer(data: Data(), transport: SimulatedTransport(maximumWriteLength: 20))))
+    }
+
+    func testFileTransferSurfacesFailures() {
+        let data = Data(bytes: [UInt8].random(size: 10000))
+        let transport = SimulatedTransport(maximumWriteLength: 100)
+        transport.failAfterWrites = 30
+
+        let transfer = GKCardFileTransfer(data: data, transport: transport, maximumOutstandingWrites: 4)
+
+        XCTAssertNotNil(runTransfer(transfer))
+        XCTAssertEqual(transport.received, data.subdata(in: 0..<3000))
+
+        // Writes already in flight finish, nothing new starts after the failure
+        XCTAssertLessThanOrEqual(transport.chunkSizes.count, 30 + 4)
+    }
+
+    func testFileTransferStopsWhenSuperseded() {
+        let data = Data(bytes: [UInt8].random(size: 10000))
+        let transport = SimulatedTransport(maximumWriteLength: 100)
+        let lock = NSLock()
+        var checks = 0
+
+        let transfer = GKCardFileTransfer(data: data, transport: transport, maximumOutstandingWrites: 4) {
+            lock.lock()
+            defer { lock.unlock() }
+
+            checks += 1
+            return checks <= 10
+        }
+
+        XCTAssertEqual(runTransfer(transfer) as? GKCardFileTransfer.TransferError, .superseded)
+        XCTAssertLessThan(transport.received.count, data.count)
+        XCTAssertEqual(transport.received, data.prefix(transport.received.count))
+    }
+
+    func testPerformanceFileTransfer() {
+        let data = Data(bytes: [UInt8].random(size: 1 << 20))
+
+        self.measure {
+            _ = runTransfer(GKCardFileTransfer(data: data, transport: SimulatedTransport(maximumWriteLength: 182)))
+        }
+    }
+
+    // MARK: Card simulator
+
+    func runBenchmark(sizes: [Int], configuration: GKCardSimulator.Configuration) -> ([GKCardBenchmark.Result]?, Error?) {
+        let done = expectation(description: "benchmark")
+        var outcome: ([GKCardBenchmark.Result]?, Error?) = (nil, nil)
+
+        GKCardBenchmark.run(sizes: sizes, configuration: configuration) { results, error in
+            outcome = (results, error)
+            done.fulfill()
+        }
+
+        waitForExpectations(timeout: 600.0, handler: nil)
+        return outcome
+    }
+
+    func testCardSimulatorRoundTrip() {
+        var configuration = GKCardSimulator.Configuration()
+        configuration.latency = 0.005
+        configuration.maximumWriteLength = 182
+        configuration.notificationLength = 20
+
+        let (results, error) = runBenchmark(sizes: [5000], configuration: configuration)
+        XCTAssertNil(error)
+        XCTAssertGreaterThan(results?.first?.size ?? 0, 5000 / 2)
+        XCTAssertNil(GKCard.simulator)
+
+        // Lost file writes show up as a checksum mismatch
+        configuration.dropRate = 1.0
+        let (_, dropError) = runBenchmark(sizes: [5000], configuration: configuration)
+        XCTAssertNotNil(dropError)
+    }
+
+    func testCardTransferBenchmark() {
+        var configuration = GKCardSimulator.Configuration()
+        configuration.latency = 0.0075
+
+        // Paced like a real card, 10 MiB takes minutes
+        configuration.writeInterval = 0
+
+        let (results, error) = runBenchmark(sizes: GKCardBenchmark.sizes, configuration: configuration)
+        XCTAssertNil(error)
+        XCTAssertEqual(results?.count, GKCardBenchmark.sizes.count)
+    }
+
+    // MARK: Card responses
+
+    func collectResponse(framing: GKCardResponse.Framing, timeout: TimeInterval, notifications: [(TimeInterval, Data)]) -> (Data, TimeInterval) {
+        let queue = DispatchQueue(label: "response")
+        let done = expectation(description: "response")
+        let start = Date()
+        var outcome = (Data(), 0.0)
+
+        let response = GKCardResponse(framing: framing, timeout: timeout, queue: queue) { data in
+            outcome = (data, Date().timeIntervalSince(start))
+            done.fulfill()
+        }
+
+        queue.async {
+            response.start()
+        }
+
+        for (delay, value) in notifications {
+            queue.asyncAfter(deadline: .now() + delay) {
+                response.append(value)
+            }
+        }
+
+        waitForExpectations(timeout: 10.0, handler: nil)
+        return outcome
+    }
+
+    func testCardResponseFraming() {
+        let status = collectResponse(framing: .status, timeout: 2.0, notifications: [(0.05, Data(bytes: [0x06])), (0.1, Data(bytes: [0x15]))])
+        XCTAssertEqual(status.0, Data(bytes: [0x06]))
+        XCTAssertLessThan(status.1, 0.5)
+
+        let fragments = (0..<10).map { (Double($0) * 0.02, Data(bytes: [UInt8](repeating: UInt8($0), count: 20))) }
+        let stream = collectResponse(framing: .stream(idleGap: 0.2), timeout: 2.0, notifications: fragments)
+        XCTAssertEqual(stream.0, fragments.reduce(Data()) { $0 + $1.1 })
+        XCTAssertLessThan(stream.1, 1.0)
+
+        let silent = collectResponse(framing: .status, timeout: 0.2, notifications: [])
+        XCTAssertTrue(silent.0.isEmpty)
+        XCTAssertGreaterThanOrEqual(silent.1, 0.2)
+    }
+
+    func testCardCommandsFinishAtRoundTripTime() {
+        var configuration = GKCardSimulator.Configuration()
+        configuration.latency = 0.01
+
+        let (results, error) = runBenchmark(sizes: [10 << 10], configuration: configuration)
+        XCTAssertNil(error)
+
+        // Idle polling cost one to two seconds per command
+        XCTAssertLessThan(results?.first?.save ?? .infinity, 1.0)
+        XCTAssertLessThan(results?.first?.unlock ?? .infinity, 1.0 + GKCard.streamIdleGap)
+    }
+
+    func testCardRequestRejectsSupersededRequest() {
+        var configuration = GKCardSimulator.Configuration()
+        configuration.latency = 0.05
+
+        let simulator = GKCardSimulator(configuration: configuration)
+        simulator.store(path: Vault.dbPath, data: Data(bytes: [0x01]))
+        let card = GKCard(link: simulator)
+
+        let superseded = expectation(description: "superseded")
+        let answered = expectation(description: "answered")
+        var firstError: Error?
+        var secondResult: Bool?
+
+        card.connect().then { _ -> Void in
+            card.exists(path: Vault.dbPath).catch { error in
+                firstError = error
+                superseded.fulfill()
+            }
+
+            card.exists(path: Vault.dbPath).then { exists -> Void in
+                secondResult = exists
+                answered.fulfill()
+            }
+        }
+
+        waitForExpectations(timeout: 10.0, handler: nil)
+
+        XCTAssertEqual(firstError as? GKCard.CardError, .requestSuperseded)
+        XCTAssertEqual(secondResult, true)
+    }
+
+    // MARK: Save scheduler
+
+    func testSaveSchedulerCoalescesBursts() {
+        let done = expectation(description: "save")
+        var runs = 0
+
+        let scheduler = VaultSaveScheduler(window: 0.1) { _, completion in
+            runs += 1
+            completion()
+            done.fulfill()
+        }
+
+        for _ in 0..<5 {
+            scheduler.schedule()
+        }
+
+        waitForExpectations(timeout: 5.0, handler: nil)
+
+        // Nothing further runs after the burst
+        let settled = expectation(description: "settled")
+        DispatchQueue.global().asyncAfter(deadline: .now() + 0.3) {
+            settled.fulfill()
+        }
+        waitForExpectations(timeout: 5.0, handler: nil)
+
+        XCTAssertEqual(runs, 1)
+    }
+
+    func testSaveSchedulerSupersedesRunningSave() {
+        let done = expectation(description: "saves")
+        let started = DispatchSemaphore(value: 0)
+        var outcomes = [Bool]()
+
+        let scheduler = VaultSaveScheduler(window: 0.05) { isCurrent, completion in
+            started.signal()
+
+            // A long transfer that checks whether it is still wanted before committing
+            DispatchQueue.global().asyncAfter(deadline: .now() + 0.3) {
+                outcomes.append(isCurrent())
+                completion()
+
+                if outcomes.count == 2 {
+                    done.fulfill()
+                }
+            }
+        }
+
+        scheduler.schedule()
+        started.wait()
+        scheduler.schedule()
+        scheduler.schedule()
+
+        waitForExpectations(timeout: 5.0, handler: nil)
+
+        // The first save was superseded, the one after it wrote the latest state
+        XCTAssertEqual(outcomes, [false, true])
+    }
+
+    // MARK: CRC16
+
+    // The byte-at-a-time algorithm the sliced one replaced
+    func bytewiseCrc16(_ data: Data) -> UInt16 {
+        var crc = UInt16(0)
+
+        data.forEach { byte in
+            let temp = UInt16(byte) ^ (crc >> 8) & 0xff
+            crc = crc16Table[Int(temp)] ^ (crc << 8)
+        }
+
+        return crc
+    }
+
+    func testCrc16CheckValue() {
+        XCTAssertEqual("123456789".data(using: .utf8)!.crc16(), 0x31C3)
+        XCTAssertEqual(Data().crc16(), 0)
+    }
+
+    func testCrc16MatchesBytewise() {
+        for length in [1, 7, 8, 9, 15, 16, 17, 100, 1000, 4099] {
+            let data = Data(bytes: [UInt8].random(size: length))
+            XCTAssertEqual(data.crc16(), bytewiseCrc16(data), "length \(length)")
+        }
+    }
+
+    func testCrc16UpdateInChunks() {
+        let data = Data(bytes: [UInt8].random(size: 10_000))
+        let expected = bytewiseCrc16(data)
+
+        for chunkSize in [1, 3, 8, 13, 128, 4096] {
+            var crc = GKCrc16()
+            var offset = 0
+
+            while offset < data.count {
+                let end = min(offset + chunkSize, data.count)
+                crc.update(data.subdata(in: offset..<end))
+                offset = end
+            }
+
+            XCTAssertEqual(crc.value, expected, "chunk size \(chunkSize)")
+        }
+    }
+
+    func testFileTransferFoldsChecksum() {
+        let data = Data(bytes: [UInt8].random(size: 5000))
+        let transport = SimulatedTransport(maximumWriteLength: 20)
+        let transfer = GKCardFileTransfer(data: data, transport: transport)
+
+        XCTAssertNil(runTransfer(transfer))
+        XCTAssertEqual(transfer.checksum.value, data.crc16())
+    }
+
+    func testPerformanceCrc16() {
+        let data = Data(bytes: [UInt8].random(size: 10 * 1024 * 1024))
+
+        measure {
+            _ = data.crc16()
+        }
+    }
+
+    // MARK: Hashing
+
+    func testSha256KnownAnswer() {
+        XCTAssertEqual("abc".sha256().hexString, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad")
+        XCTAssertEqual([UInt8]("abc".utf8).sha256(), "abc".sha256())
+    }
+
+    func testSha256InParts() {
+        let bytes = [UInt8].random(size: 10_000)
+        let expected = bytes.sha256()
+
+        XCTAssertEqual(KdbxSha256.hash(Array(bytes[0..<3]), Array(bytes[3..<4097]), Array(bytes[4097...])), expected)
+
+        var sha = KdbxSha256()
+        bytes.withUnsafeBytes { buffer in
+            var offset = 0
+            while offset < buffer.count {
+                let end = min(offset + 333, buffer.count)
+                sha.update(UnsafeRawBufferPointer(rebasing: buffer[offset..<end]))
+                offset = end
+            }
+        }
+        XCTAssertEqual(sha.finalize(), expected)
+
+        // finalize starts a new message
+        sha.update(bytes)
+        XCTAssertEqual(sha.finalize(), expected)
+    }
+
+    func testSha512InParts() {
+        let seed = [UInt8].random(size: 32)
+        let key = [UInt8].random(size: 32)
+
+        XCTAssertEqual(KdbxSha512.hash(seed, key, [0x01]), (seed + key + [0x01]).sha512())
+    }
+
+    func testHmacSha256() {
+        let key = [UInt8]("Jefe".utf8)
+        let message = [UInt8]("what do ya want for nothing?".utf8)
+
+        var hmac = KdbxHmacSha256(key: key)
+        hmac.update(Array(message[0..<10]))
+        hmac.update(Array(message[10...]))
+
+        XCTAssertEqual(hmac.finalize().hexString, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843")
+
+        hmac.reset(key: key)
+        hmac.update(message)
+        XCTAssertEqual(hmac.finalize(), KdbxCrypto.hmacSha256(key: key, bytes: message))
+    }
+
+    // MARK: AES-CBC cryptor
+
+    func runCryptor(_ cryptor: KdbxAesCbcCryptor, bytes: [UInt8], chunkSize: Int) throws -> [UInt8] {
+        var output = [UInt8]()
+        var offset = 0
+
+        try bytes.withUnsafeBytes { input in
+            repeat {
+                let end = offset + min(chunkSize, input.count - offset)
+                let chunk = UnsafeRawBufferPointer(rebasing: input[offset..<end])
+                var buffer = [UInt8](repeating: 0x0, count: cryptor.outputLength(inputLength: chunk.count))
+
+                let moved = try buffer.withUnsafeMutableBytes { try cryptor.update(in: chunk, out: $0) }
+                output.append(contentsOf: buffer[0..<moved])
+                offset = end
+            } while offset < input.count
+        }
+
+        var tail = [UInt8](repeating: 0x0, count: KdbxAesCbcCryptor.blockSize)
+        let moved = try tail.withUnsafeMutableBytes { try cryptor.finalize(out: $0) }
+        output.append(contentsOf: tail[0..<moved])
+
+        return output
+    }
+
+    func testAesCbcKnownAnswer() throws {
+        let key = bytes(hex: "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4")
+        let iv = bytes(hex: "000102030405060708090a0b0c0d0e0f")
+        let plain = bytes(hex: "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51")
+        let cipher = bytes(hex: "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d")
+
+        let encryptor = try KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv, padding: false)
+        XCTAssertEqual(try runCryptor(encryptor, bytes: plain, chunkSize: 5), cipher)
+
+        let decryptor = try KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv, padding: false)
+        XCTAssertEqual(try runCryptor(decryptor, bytes: cipher, chunkSize: 7), plain)
+    }
+
+    func testAesCbcChunkedMatchesOneShot() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 16)
+
+        for length in [0, 1, 15, 16, 17, 1000, 3 * KdbxAesCbcCryptor.parallelThreshold + 5] {
+            let plain = [UInt8].random(size: length)
+            let cipher = try runCryptor(KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv), bytes: plain, chunkSize: Int.max)
+
+            XCTAssertEqual(cipher.count, (length / 16 + 1) * 16)
+
+            // A single update of the large input takes the parallel path
+            let chunkSizes = length > 1000 ? [64 * 1024, Int.max] : [1, 16, 4099]
+
+            for chunkSize in chunkSizes {
+                let encryptor = try KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv)
+                XCTAssertEqual(try runCryptor(encryptor, bytes: plain, chunkSize: chunkSize), cipher, "encrypt \(length) by \(chunkSize)")
+
+                let decryptor = try KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv)
+                XCTAssertEqual(try runCryptor(decryptor, bytes: cipher, chunkSize: chunkSize), plain, "decrypt \(length) by \(chunkSize)")
+            }
+        }
+    }
+
+    func testAesCbcDecryptsInPlace() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 16)
+        let plain = [UInt8].random(size: 64 * 1024)
+
+        let encryptor = try KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv, padding: false)
+        var bytes = try runCryptor(encryptor, bytes: plain, chunkSize: Int.max)
+        let decryptor = try KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv, padding: false)
+
+        let moved = try bytes.withUnsafeMutableBytes { buffer in
+            try decryptor.update(in: UnsafeRawBufferPointer(buffer), out: buffer)
+        }
+
+        XCTAssertEqual(moved, plain.count)
+        XCTAssertEqual(bytes, plain)
+    }
+
+    func testAesCbcRejectsBadPadding() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 16)
+
+        // Whole blocks encrypted without padding almost never end in valid padding
+        var plain = [UInt8].random(size: 32)
+        plain[31] = 0x00
+        let encryptor = try KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv, padding: false)
+        let cipher = try runCryptor(encryptor, bytes: plain, chunkSize: Int.max)
+
+        XCTAssertThrowsError(try runCryptor(KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv), bytes: cipher, chunkSize: Int.max))
+        XCTAssertThrowsError(try runCryptor(KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv), bytes: Array(cipher[0..<31]), chunkSize: Int.max))
+    }
+
+    func testPerformanceAesCbcDecrypt() throws {
+        let key = [UInt8].random(size: 32)
+        let iv = [UInt8].random(size: 16)
+        let cipher = try runCryptor(KdbxAesCbcCryptor(operation: .encrypt, key: key, iv: iv), bytes: [UInt8].random(size: 10 * 1024 * 1024), chunkSize: Int.max)
+
+        measure {
+            _ = try? self.runCryptor(KdbxAesCbcCryptor(operation: .decrypt, key: key, iv: iv), bytes: cipher, chunkSize: KdbxAesCbcCryptor.parallelChunkSize)
+        }
+    }
+
+    // MARK: Parallel gzip
+
+    func gzipRoundTrip(_ bytes: [UInt8], level: Int32 = KdbxParallelGzipSink.defaultLevel, chunkSize: Int) throws -> (compressed: [UInt8], inflated: [UInt8]) {
+        let compressed = KdbxBufferSink()
+        let compressor = try KdbxParallelGzipSink(level: level, chunkSize: chunkSize, next: compressed)
+        try bytes.withUnsafeBytes { try compressor.write(chunked: $0, chunkSize: 1000) }
+        try compressor.finish()
+
+        let inflated = KdbxBufferSink()
+        let decompressor = try KdbxGunzipSink(next: inflated)
+        try compressed.bytes.withUnsafeBytes { try decompressor.write(chunked: $0, chunkSize: 777) }
+        try decompressor.finish()
+
+        return (compressed.bytes, inflated.bytes)
+    }
+
+    func testParallelGzipRoundTrip() throws {
+        let text = [UInt8](String(repeating: "<Entry><String><Key>Title</Key><Value>Example</Value></String></Entry>\n", count: 20_000).utf8)
+
+        for bytes in [[], [0x42], [UInt8].random(size: 300_000), text] {
+            for chunkSize in [1024, KdbxParallelGzipSink.defaultChunkSize] {
+                let (compressed, inflated) = try gzipRoundTrip(bytes, chunkSize: chunkSize)
+
+                XCTAssertEqual(inflated, bytes, "\(bytes.count) bytes in chunks of \(chunkSize)")
+                XCTAssertEqual(Array(compressed[0..<2]), [0x1f, 0x8b])
+            }
+        }
+    }
+
+    func testParallelGzipKeepsRatio() throws {
+        let text = [UInt8](String(repeating: "<Entry><String><Key>Title</Key><Value>Example</Value></String></Entry>\n", count: 20_000).utf8)
+
+        // Chunks primed with the previous 32 KiB compress repetitive input as well as one stream
+        let (compressed, _) = try gzipRoundTrip(text, chunkSize: KdbxParallelGzipSink.defaultChunkSize)
+        XCTAssertLessThan(compressed.count, text.count / 50)
+    }
+
+    func testParallelGzipIsDeterministic() throws {
+        let bytes = [UInt8].random(size: 100_000) + [UInt8](repeating: 0x41, count: 400_000)
+
+        let first = try gzipRoundTrip(bytes, level: 1, chunkSize: 64 * 1024).compressed
+        let second = try gzipRoundTrip(bytes, level: 1, chunkSize: 64 * 1024).compressed
+
+        XCTAssertEqual(first, second)
+    }
+
+    func testPerformanceParallelGzip() {
+        let text = [UInt8](String(repeating: "<Entry><String><Key>Title</Key><Value>Example</Value></String></Entry>\n", count: 150_000).utf8)
+
+        measure {
+            _ = try? gzipRoundTrip(text, chunkSize: KdbxParallelGzipSink.defaultChunkSize)
+        }
+    }
+
+    // MARK: Card container
+
+    func testCardContainerRoundTrip() throws {
+        let text = String(repeating: "<Entry><String><Key>Title</Key><Value>Example</Value></String></Entry>\n", count: 1000).data(using: .utf8)!
+
+        for algorithm in [GKCardContainer.Algorithm.lz4, .lzfse] {
+            let wrapped = GKCardContainer.wrap(text, algorithm: algorithm)
+
+            XCTAssertTrue(GKCardContainer.isWrapped(wrapped))
+            XCTAssertLessThan(wrapped.count, text.count / 10)
+            XCTAssertEqual(try GKCardContainer.unwrap(wrapped), text)
+        }
+    }
+
+    func testCardContainerKeepsIncompressibleFilesPlain() throws {
+        let kdbx = Kdbx(password: "password")
+        let encryptedData = try kdbx.encrypt()
+
+        // An encrypted payload does not compress, so the file stays a plain KDBX file
+        let stored = GKCardContainer.wrap(encryptedData, algorithm: .lzfse)
+        XCTAssertEqual(stored, encryptedData)
+        XCTAssertFalse(GKCardContainer.isWrapped(stored))
+        XCTAssertEqual(try GKCardContainer.unwrap(stored), encryptedData)
+    }
+
+    func testCardContainerRejectsCorruptFiles() {
+        let text = String(repeating: "GateKeeper ", count: 500).data(using: .utf8)!
+        var wrapped = GKCardContainer.wrap(text, algorithm: .lz4)
+        wrapped.removeLast(wrapped.count / 2)
+
+        XCTAssertThrowsError(try GKCardContainer.unwrap(wrapped))
+    }
+
+    func testCardContainerRejectsImplausibleLengths() {
+        var wrapped = Data(bytes: GKCardContainer.magic)
+        wrapped.append(GKCardContainer.Algorithm.lz4.rawValue)
+        wrapped.append(contentsOf: UInt32.max.littleEndianBytes)
+        wrapped.append(contentsOf: [UInt8](repeating: 0x0, count: 16))
+
+        XCTAssertThrowsError(try GKCardContainer.unwrap(wrapped))
+    }
+
+    func testCardCompressionBenchmark() throws {
+        let kdbx = Kdbx(password: "password")
+        for index in 0..<200 {
+            kdbx.add(groupUUID: kdbx.database.root.group.uuid, entry: makeEntry(index: index))
+        }
+
+        let results = try GKCardBenchmark.measureCompression(data: kdbx.encrypt())
+
+        XCTAssertEqual(results.count, 3)
+        XCTAssertTrue(results.filter { $0.storedSize > $0.size }.isEmpty)
+    }
 }